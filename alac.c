@@ -0,0 +1,819 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2016, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// native alac decoder - mp4 framing is parsed from streambuf by mp4.c and each sample decoded in tree
+// bitstream decoding follows the Apple Lossless reference decoder (Apache 2.0): adaptive golomb-rice
+// residuals, adaptive lpc prediction and stereo matrixing
+
+#include "squeezelite.h"
+
+#define ALAC_MAX_FRAME  16384 // frames per packet accepted
+#define PACKET_PAD      1280 // bit reader may read beyond the end of the packet before bounds are checked
+
+// element tags
+#define ID_SCE 0
+#define ID_CPE 1
+#define ID_CCE 2
+#define ID_LFE 3
+#define ID_DSE 4
+#define ID_PCE 5
+#define ID_FIL 6
+#define ID_END 7
+
+// adaptive golomb parameters from the reference decoder
+#define QBSHIFT           9
+#define QB                (1 << QBSHIFT)
+#define MMULSHIFT         2
+#define MDENSHIFT         (QBSHIFT - MMULSHIFT - 1)
+#define MOFF              (1 << (MDENSHIFT - 2))
+#define BITOFF            24
+#define MAX_PREFIX_16     9
+#define MAX_PREFIX_32     9
+#define MAX_DATATYPE_BITS_16 16
+#define N_MAX_MEAN_CLAMP  0xffff
+#define N_MEAN_CLAMP_VAL  0xffff
+
+struct alac {
+	// decoder config
+	u32_t frame_length;
+	u8_t  bit_depth;
+	u8_t  pb, mb, kb;
+	u8_t  channels;
+	u32_t sample_rate;
+	// working buffers
+	s32_t *predictor;
+	s32_t *mix_u;
+	s32_t *mix_v;
+	u16_t *shift_uv;
+	s32_t *out[MAX_CHANNELS];
+	// decoded frames not yet written to outputbuf, starting at offset within out
+	frames_t pending;
+	frames_t offset;
+	// size the working buffers were allocated for, kept between tracks
+	u32_t alloc_frames;
+	u8_t  alloc_channels;
+	// mp4 framing
+	struct mp4_alac mp4;
+	u32_t skip;
+};
+
+static struct alac *l;
+
+extern log_level loglevel;
+
+extern struct buffer *streambuf;
+extern struct buffer *outputbuf;
+extern struct streamstate stream;
+extern struct outputstate output;
+extern struct decodestate decode;
+extern struct processstate process;
+extern struct codec *codec;
+
+#define LOCK_S   mutex_lock(streambuf->mutex)
+#define UNLOCK_S mutex_unlock(streambuf->mutex)
+#define LOCK_O   mutex_lock(outputbuf->mutex)
+#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#if PROCESS
+#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
+#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
+#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
+#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
+#define IF_DIRECT(x)    if (decode.direct) { x }
+#define IF_PROCESS(x)   if (!decode.direct) { x }
+#else
+#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
+#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_not_direct
+#define UNLOCK_O_not_direct
+#define IF_DIRECT(x)    { x }
+#define IF_PROCESS(x)
+#endif
+
+// alac channel order to the wav order used by the downmix matrix, indexed by channel count
+// 4 channel alac is C L R Cs which has no wav layout of its own, it is passed as the 5 channel L R C BL BR layout
+// with Cs feeding both back channels so that C and Cs reach left and right equally
+static const u8_t order[MAX_CHANNELS + 1][MAX_CHANNELS] = {
+	{ 0 }, { 0 }, { 0, 1 },
+	{ 1, 2, 0 },
+	{ 1, 2, 0, 3, 3 },
+	{ 1, 2, 0, 3, 4 },
+	{ 1, 2, 0, 5, 3, 4 },
+	{ 1, 2, 0, 6, 5, 3, 4 },
+	{ 3, 4, 0, 7, 5, 6, 1, 2 },
+};
+
+// channels presented to the downmix, indexed by alac channel count
+static const u8_t mix_channels[MAX_CHANNELS + 1] = { 0, 1, 2, 3, 5, 5, 6, 7, 8 };
+
+// bit reader - positions are in bits from the start of the packet
+
+static inline u32_t read32(const u8_t *p) {
+	return (u32_t)p[0] << 24 | (u32_t)p[1] << 16 | (u32_t)p[2] << 8 | p[3];
+}
+
+static inline u32_t lead(u32_t x) {
+	u32_t n = 0;
+	if (!x) return 32;
+	while (!(x & 0x80000000)) {
+		x <<= 1;
+		n++;
+	}
+	return n;
+}
+
+static inline u32_t lg3a(u32_t x) {
+	return 31 - lead(x + 3);
+}
+
+// read up to 32 bits at any bit offset
+static u32_t getbits(const u8_t *in, u32_t pos, unsigned n) {
+	const u8_t *p = in + (pos >> 3);
+	unsigned off = pos & 7;
+	u32_t result;
+
+	if (!n) {
+		return 0;
+	}
+
+	if (n + off > 32) {
+		result = read32(p) << off;
+		result >>= 32 - n;
+		result |= p[4] >> (8 - (n + off - 32));
+	} else {
+		result = read32(p) >> (32 - n - off);
+	}
+
+	if (n != 32) {
+		result &= ~(0xffffffffu << n);
+	}
+
+	return result;
+}
+
+static inline u32_t readbits(const u8_t *in, u32_t *pos, unsigned n) {
+	u32_t v = getbits(in, *pos, n);
+	*pos += n;
+	return v;
+}
+
+static inline s32_t sign_of(s32_t i) {
+	s32_t negishift = (s32_t)((u32_t)-i >> 31);
+	return negishift | (i >> 31);
+}
+
+// zero run length
+static u32_t dyn_get(const u8_t *in, u32_t *pos, u32_t m, u32_t k) {
+	u32_t tempbits = *pos;
+	u32_t streamlong = read32(in + (tempbits >> 3)) << (tempbits & 7);
+	u32_t pre = lead(~streamlong);
+	u32_t result;
+
+	if (pre >= MAX_PREFIX_16) {
+		pre = MAX_PREFIX_16;
+		tempbits += pre;
+		streamlong <<= pre;
+		result = streamlong >> (32 - MAX_DATATYPE_BITS_16);
+		tempbits += MAX_DATATYPE_BITS_16;
+	} else {
+		u32_t v;
+		tempbits += pre + 1;
+		streamlong <<= pre + 1;
+		v = streamlong >> (32 - k);
+		tempbits += k;
+		result = pre * m + v - 1;
+		if (v < 2) {
+			result -= v - 1;
+			tempbits -= 1;
+		}
+	}
+
+	*pos = tempbits;
+	return result;
+}
+
+// residual value
+static u32_t dyn_get_32bit(const u8_t *in, u32_t *pos, u32_t m, u32_t k, unsigned maxbits) {
+	u32_t tempbits = *pos;
+	u32_t streamlong = read32(in + (tempbits >> 3)) << (tempbits & 7);
+	u32_t result = lead(~streamlong);
+
+	if (result >= MAX_PREFIX_32) {
+		result = getbits(in, tempbits + MAX_PREFIX_32, maxbits);
+		tempbits += MAX_PREFIX_32 + maxbits;
+	} else {
+		tempbits += result + 1;
+		if (k != 1) {
+			u32_t v;
+			streamlong <<= result + 1;
+			v = streamlong >> (32 - k);
+			tempbits += k - 1;
+			result = result * m;
+			if (v >= 2) {
+				result += v - 1;
+				tempbits += 1;
+			}
+		}
+	}
+
+	*pos = tempbits;
+	return result;
+}
+
+// adaptive golomb-rice decode of n residuals, returns false on a corrupt stream
+static bool dyn_decomp(const u8_t *in, u32_t *pos, u32_t maxpos, s32_t *pc, u32_t n, unsigned maxsize, u32_t pb, u32_t kb) {
+	u32_t wb = (1u << kb) - 1;
+	u32_t mb = l->mb;
+	u32_t c = 0;
+	s32_t zmode = 0;
+
+	while (c < n) {
+		u32_t m, k, v, ndecode;
+
+		if (*pos >= maxpos) {
+			return false;
+		}
+
+		m = mb >> QBSHIFT;
+		k = min(lg3a(m), kb);
+		m = (1u << k) - 1;
+
+		v = dyn_get_32bit(in, pos, m, k, maxsize);
+
+		// least significant bit is sign bit
+		ndecode = v + zmode;
+		*pc++ = (s32_t)((ndecode + 1) >> 1) * ((-(s32_t)(ndecode & 1)) | 1);
+		c++;
+
+		mb = pb * (v + zmode) + mb - ((pb * mb) >> QBSHIFT);
+
+		if (v > N_MAX_MEAN_CLAMP) {
+			mb = N_MEAN_CLAMP_VAL;
+		}
+
+		zmode = 0;
+
+		if (((mb << MMULSHIFT) < QB) && c < n) {
+			u32_t j, mz;
+			zmode = 1;
+			k = lead(mb) - BITOFF + ((mb + MOFF) >> MDENSHIFT);
+			mz = ((1u << k) - 1) & wb;
+			v = dyn_get(in, pos, mz, k);
+			if (c + v > n) {
+				return false;
+			}
+			for (j = 0; j < v; j++) {
+				*pc++ = 0;
+				++c;
+			}
+			if (v >= 65535) {
+				zmode = 0;
+			}
+			mb = 0;
+		}
+	}
+
+	return *pos <= maxpos;
+}
+
+// adaptive lpc predictor, coefs are updated in place as in the reference decoder
+static void unpc_block(const s32_t *pc, s32_t *out, u32_t num, s16_t *coefs, u32_t numactive, unsigned chanbits, unsigned denshift) {
+	unsigned chanshift = 32 - chanbits;
+	s32_t denhalf = denshift ? 1 << (denshift - 1) : 0;
+	u32_t j;
+
+	out[0] = pc[0];
+
+	if (numactive == 0) {
+		if (num > 1 && pc != out) {
+			memcpy(&out[1], &pc[1], (num - 1) * sizeof(s32_t));
+		}
+		return;
+	}
+
+	if (numactive == 31) {
+		for (j = 1; j < num; j++) {
+			u32_t del = (u32_t)pc[j] + (u32_t)out[j - 1];
+			out[j] = (s32_t)(del << chanshift) >> chanshift;
+		}
+		return;
+	}
+
+	for (j = 1; j <= numactive && j < num; j++) {
+		u32_t del = (u32_t)pc[j] + (u32_t)out[j - 1];
+		out[j] = (s32_t)(del << chanshift) >> chanshift;
+	}
+
+	for (j = numactive + 1; j < num; j++) {
+		const s32_t *pout = out + j - 1;
+		s32_t top = out[j - numactive - 1];
+		u32_t sum1 = 0; // wraps as in the reference decoder
+		s32_t del0, sg;
+		s32_t k;
+
+		for (k = 0; k < (s32_t)numactive; k++) {
+			sum1 += (u32_t)coefs[k] * ((u32_t)pout[-k] - (u32_t)top);
+		}
+
+		del0 = pc[j];
+		sg = sign_of(del0);
+		out[j] = (s32_t)(((u32_t)del0 + (u32_t)top + (u32_t)((s32_t)(sum1 + denhalf) >> denshift)) << chanshift) >> chanshift;
+
+		if (sg > 0) {
+			for (k = numactive - 1; k >= 0; k--) {
+				s32_t dd = top - pout[-k];
+				s32_t sgn = sign_of(dd);
+				coefs[k] -= sgn;
+				del0 -= (numactive - k) * ((sgn * dd) >> denshift);
+				if (del0 <= 0) break;
+			}
+		} else if (sg < 0) {
+			for (k = numactive - 1; k >= 0; k--) {
+				s32_t dd = top - pout[-k];
+				s32_t sgn = sign_of(dd);
+				coefs[k] += sgn;
+				del0 -= (numactive - k) * ((-sgn * dd) >> denshift);
+				if (del0 >= 0) break;
+			}
+		}
+	}
+}
+
+// decode one channel element (sce, lfe or cpe) into left justified planar output
+static bool decode_element(const u8_t *in, u32_t *pos, u32_t maxpos, unsigned stereo, s32_t *outl, s32_t *outr, u32_t *frames) {
+	u32_t n = *frames;
+	unsigned header, bytes_shifted, shift, chanbits, i, c;
+	bool escape;
+	u32_t shift_pos = 0;
+	s32_t mixbits = 0, mixres = 0;
+	unsigned justify = 32 - l->bit_depth;
+
+	readbits(in, pos, 4); // element instance tag
+	if (readbits(in, pos, 12) != 0) {
+		return false;
+	}
+
+	header = readbits(in, pos, 4);
+	bytes_shifted = (header >> 1) & 0x3;
+	escape = header & 0x1;
+	if (bytes_shifted == 3) {
+		return false;
+	}
+	shift = bytes_shifted * 8;
+
+	// partial frame overrides frame length
+	if (header & 0x8) {
+		n = readbits(in, pos, 32);
+		if (n > l->frame_length) {
+			return false;
+		}
+		*frames = n;
+	}
+
+	if (!escape) {
+		u32_t mode[2], den[2], pbf[2], num[2];
+		s16_t coefs[2][32];
+		s32_t *mix[2] = { l->mix_u, l->mix_v };
+
+		chanbits = l->bit_depth - shift + (stereo ? 1 : 0);
+		if (chanbits > 32) {
+			return false;
+		}
+
+		mixbits = readbits(in, pos, 8);
+		mixres = (signed char)readbits(in, pos, 8);
+		if (mixbits > 31) {
+			return false;
+		}
+
+		for (c = 0; c <= stereo; ++c) {
+			header = readbits(in, pos, 8);
+			mode[c] = header >> 4;
+			den[c] = header & 0xf;
+			header = readbits(in, pos, 8);
+			pbf[c] = header >> 5;
+			num[c] = header & 0x1f;
+			for (i = 0; i < num[c]; i++) {
+				coefs[c][i] = (s16_t)readbits(in, pos, 16);
+			}
+		}
+
+		// shifted off low bits follow the header, decode the residuals after them
+		if (bytes_shifted) {
+			shift_pos = *pos;
+			*pos += shift * (stereo + 1) * n;
+		}
+
+		if (*pos >= maxpos) {
+			return false;
+		}
+
+		for (c = 0; c <= stereo; ++c) {
+			if (!dyn_decomp(in, pos, maxpos, l->predictor, n, chanbits, (l->pb * pbf[c]) / 4, l->kb)) {
+				return false;
+			}
+			if (mode[c] != 0) {
+				unpc_block(l->predictor, l->predictor, n, NULL, 31, chanbits, 0);
+			}
+			unpc_block(l->predictor, mix[c], n, coefs[c], num[c], chanbits, den[c]);
+		}
+
+	} else {
+
+		// uncompressed
+		chanbits = l->bit_depth;
+		if (*pos + chanbits * (stereo + 1) * n > maxpos) {
+			return false;
+		}
+		for (i = 0; i < n; i++) {
+			for (c = 0; c <= stereo; ++c) {
+				s32_t val = (s32_t)(readbits(in, pos, chanbits) << (32 - chanbits)) >> (32 - chanbits);
+				(c ? l->mix_v : l->mix_u)[i] = val;
+			}
+		}
+		bytes_shifted = shift = 0;
+	}
+
+	if (bytes_shifted) {
+		for (i = 0; i < n * (stereo + 1); i++) {
+			l->shift_uv[i] = (u16_t)readbits(in, &shift_pos, shift);
+		}
+	}
+
+	// unmix and left justify to 32 bits
+	for (i = 0; i < n; i++) {
+		s32_t u = l->mix_u[i];
+		u32_t sl, sr = 0;
+
+		if (stereo) {
+			s32_t v = l->mix_v[i];
+			s32_t lv, rv;
+			if (mixres) {
+				lv = u + v - ((mixres * v) >> mixbits);
+				rv = lv - v;
+			} else {
+				lv = u;
+				rv = v;
+			}
+			sl = (u32_t)lv << shift;
+			sr = (u32_t)rv << shift;
+			if (bytes_shifted) {
+				sl |= l->shift_uv[i * 2];
+				sr |= l->shift_uv[i * 2 + 1];
+			}
+			outr[i] = (s32_t)(sr << justify);
+		} else {
+			sl = (u32_t)u << shift;
+			if (bytes_shifted) {
+				sl |= l->shift_uv[i];
+			}
+		}
+
+		outl[i] = (s32_t)(sl << justify);
+	}
+
+	return *pos <= maxpos;
+}
+
+// decode a packet to planar output, returns frames decoded or -1 on error
+static int alac_decode_packet(const u8_t *in, u32_t len) {
+	u32_t pos = 0, maxpos = len * 8;
+	u32_t frames = l->frame_length;
+	unsigned ch = 0;
+	u32_t tag;
+
+	while (pos + 3 <= maxpos && (tag = readbits(in, &pos, 3)) != ID_END) {
+
+		switch (tag) {
+		case ID_SCE:
+		case ID_LFE:
+		case ID_CPE:
+			{
+				unsigned stereo = tag == ID_CPE ? 1 : 0;
+				if (ch + stereo >= l->channels) {
+					LOG_WARN("too many channel elements");
+					return -1;
+				}
+				if (!decode_element(in, &pos, maxpos, stereo, l->out[ch], l->out[ch + stereo], &frames)) {
+					LOG_WARN("error decoding element");
+					return -1;
+				}
+				ch += stereo + 1;
+			}
+			break;
+		case ID_FIL:
+			{
+				u32_t count = readbits(in, &pos, 4);
+				if (count == 15) count += readbits(in, &pos, 8) - 1;
+				pos += count * 8;
+			}
+			break;
+		case ID_DSE:
+			{
+				u32_t align, count;
+				readbits(in, &pos, 4); // element instance tag
+				align = readbits(in, &pos, 1);
+				count = readbits(in, &pos, 8);
+				if (count == 255) count += readbits(in, &pos, 8);
+				if (align) pos = (pos + 7) & ~7;
+				pos += count * 8;
+			}
+			break;
+		default:
+			LOG_WARN("unsupported element: %u", tag);
+			return -1;
+		}
+	}
+
+	if (pos > maxpos) {
+		LOG_WARN("missing end element");
+		return -1;
+	}
+
+	if (ch != l->channels) {
+		LOG_WARN("channel elements: %u != channels: %u", ch, l->channels);
+		return -1;
+	}
+
+	return frames;
+}
+
+static void alac_free_buffers(void);
+
+// allocate working buffers unless those from a previous track are large enough
+static bool alac_alloc(void) {
+	unsigned c;
+
+	if (l->frame_length <= l->alloc_frames && l->channels <= l->alloc_channels) {
+		return true;
+	}
+
+	alac_free_buffers();
+
+	l->predictor = malloc(sizeof(s32_t) * l->frame_length);
+	l->mix_u = malloc(sizeof(s32_t) * l->frame_length);
+	l->mix_v = malloc(sizeof(s32_t) * l->frame_length);
+	l->shift_uv = malloc(sizeof(u16_t) * l->frame_length * 2);
+	if (!l->predictor || !l->mix_u || !l->mix_v || !l->shift_uv) {
+		return false;
+	}
+
+	for (c = 0; c < l->channels; ++c) {
+		l->out[c] = malloc(sizeof(s32_t) * l->frame_length);
+		if (!l->out[c]) {
+			return false;
+		}
+	}
+
+	l->alloc_frames = l->frame_length;
+	l->alloc_channels = l->channels;
+
+	return true;
+}
+
+static void alac_free_buffers(void) {
+	unsigned c;
+
+	free(l->predictor); l->predictor = NULL;
+	free(l->mix_u); l->mix_u = NULL;
+	free(l->mix_v); l->mix_v = NULL;
+	free(l->shift_uv); l->shift_uv = NULL;
+	for (c = 0; c < MAX_CHANNELS; ++c) {
+		free(l->out[c]);
+		l->out[c] = NULL;
+	}
+	l->alloc_frames = l->alloc_channels = 0;
+}
+
+static void alac_free(void) {
+	alac_free_buffers();
+	mp4_alac_free(&l->mp4);
+}
+
+// local seek - chunk offsets and sample sizes give the exact position of every packet
+// packets decode independently so playback starts at the frame requested without any preroll
+static bool _alac_seek(u32_t seek_ms) {
+	u64_t frame = (u64_t)seek_ms * l->sample_rate / 1000;
+	u32_t sample = (u32_t)(frame / l->frame_length);
+
+	if (!_mp4_alac_seek(&l->mp4, sample)) {
+		return false;
+	}
+
+	l->skip = (u32_t)(frame - (u64_t)sample * l->frame_length);
+
+	LOG_DEBUG("seek to sample: %u skip: %u", sample, l->skip);
+
+	return true;
+}
+
+// write decoded frames to outputbuf or the process input, returns true once all have been written
+// frames which do not fit are kept and written by the next call rather than dropped
+static bool _drain_frames(void) {
+	const s32_t *iptr[MAX_CHANNELS];
+	unsigned c, channels = mix_channels[l->channels];
+
+	LOCK_O_direct;
+
+	while (l->pending) {
+		frames_t f;
+		s32_t *optr;
+
+		IF_DIRECT(
+			f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+			optr = (s32_t *)outputbuf->writep;
+		);
+		IF_PROCESS(
+			f = process.max_in_frames - process.in_frames;
+			optr = (s32_t *)process.inbuf + process.in_frames * 2;
+		);
+
+		f = min(f, l->pending);
+
+		if (!f) {
+			break;
+		}
+
+		for (c = 0; c < channels; ++c) {
+			iptr[c] = l->out[order[l->channels][c]] + l->offset;
+		}
+
+		convert_s32p(optr, iptr, channels, 0, f);
+
+		l->pending -= f;
+		l->offset += f;
+
+		IF_DIRECT(
+			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+		);
+		IF_PROCESS(
+			process.in_frames += f;
+		);
+	}
+
+	UNLOCK_O_direct;
+
+	return l->pending == 0;
+}
+
+static decode_state alac_decode(void) {
+	frames_t frames, skip = 0;
+	int r;
+
+	IF_PROCESS(
+		process.in_frames = 0;
+	);
+
+	if (decode.new_stream) {
+		u32_t seek_ms = 0;
+
+		LOCK_S;
+
+		r = _mp4_alac_header(&l->mp4);
+
+		if (r == 0 && stream.state <= DISCONNECT) {
+			LOG_WARN("stream ended before mp4 header parsed");
+			r = -1;
+		}
+
+		// seek position is taken once the header has been parsed
+		if (r > 0) {
+			seek_ms = stream.seek_ms;
+			stream.seek_ms = 0;
+		}
+
+		UNLOCK_S;
+
+		if (r == 0) {
+			return DECODE_RUNNING;
+		}
+
+		if (r < 0) {
+			return DECODE_ERROR;
+		}
+
+		// alac config: frame length, version, bit depth, pb, mb, kb, channels, max run, max frame bytes, bitrate, rate
+		l->frame_length = unpackN((u32_t *)(l->mp4.config + 12));
+		l->bit_depth = l->mp4.config[17];
+		l->pb = l->mp4.config[18];
+		l->mb = l->mp4.config[19];
+		l->kb = l->mp4.config[20];
+		l->channels = l->mp4.config[21];
+		l->sample_rate = unpackN((u32_t *)(l->mp4.config + 32));
+
+		LOG_INFO("alac config: frame length: %u bits: %u channels: %u rate: %u", l->frame_length, l->bit_depth, l->channels, l->sample_rate);
+
+		if (!l->frame_length || l->frame_length > ALAC_MAX_FRAME || !l->channels || l->channels > MAX_CHANNELS ||
+			l->bit_depth < 8 || l->bit_depth > 32 || l->kb > 31) {
+			LOG_WARN("unsupported alac config");
+			return DECODE_ERROR;
+		}
+
+		if (!alac_alloc()) {
+			LOG_ERROR("malloc fail");
+			return DECODE_ERROR;
+		}
+
+		// decoded frames are kept until written so only space for part of a packet is needed to make progress
+		codec->min_space = min(l->frame_length, 4096) * BYTES_PER_FRAME;
+
+		if (seek_ms) {
+			LOCK_S;
+			_alac_seek(seek_ms);
+			UNLOCK_S;
+		}
+
+		LOG_INFO("setting track_start");
+		LOCK_O;
+		output.next_sample_rate = decode_newstream(l->sample_rate, output.supported_rates);
+		IF_DSD(	output.next_dop = false; output.next_dsd = false; )
+		output.track_start = outputbuf->writep;
+		if (output.fade_mode) _checkfade(true);
+		decode.new_stream = false;
+		UNLOCK_O;
+	}
+
+	// write any frames kept from the last call before decoding more
+	if (l->pending && !_drain_frames()) {
+		return DECODE_RUNNING;
+	}
+
+	if ((r = mp4_alac_packet(&l->mp4, PACKET_PAD)) <= 0) {
+		if (r < 0) {
+			LOG_INFO("decode complete");
+			return DECODE_COMPLETE;
+		}
+		return DECODE_RUNNING;
+	}
+
+	if ((r = alac_decode_packet(l->mp4.pkt, r)) < 0) {
+		// skip corrupt packet
+		return DECODE_RUNNING;
+	}
+
+	frames = r;
+
+	// part of the first packet after a seek is before the position requested
+	if (l->skip) {
+		skip = min(l->skip, frames);
+		l->skip -= skip;
+	}
+
+	LOG_SDEBUG("write %u frames", frames - skip);
+
+	l->offset = skip;
+	l->pending = frames - skip;
+
+	_drain_frames();
+
+	return DECODE_RUNNING;
+}
+
+static void alac_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
+	// working buffers, packet buffer and sample tables are reused by following tracks
+	mp4_alac_reset(&l->mp4);
+	l->pending = l->offset = l->skip = 0;
+}
+
+static void alac_close(void) {
+	alac_free();
+}
+
+struct codec *register_alac(void) {
+	static struct codec ret = {
+		'l',          // id
+		"alc",        // types
+		4096,         // min read
+		4096 * BYTES_PER_FRAME, // min space
+		alac_open,    // open
+		alac_close,   // close
+		alac_decode,  // decode
+	};
+
+	l = malloc(sizeof(struct alac));
+	if (!l) {
+		return NULL;
+	}
+
+	memset(l, 0, sizeof(struct alac));
+
+	LOG_INFO("using native alac decoder");
+	return &ret;
+}
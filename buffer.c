@@ -57,10 +57,91 @@ void _buf_inc_writep(struct buffer *buf, unsigned by) {
 	}
 }
 
-void buf_flush(struct buffer *buf) {
+// copy data which has wrapped into the mirror area after wrap so up to want bytes from readp are contiguous
+// the writer never writes beyond wrap so only the reader touches the mirror area, returns contiguous bytes
+static unsigned mirror(struct buffer *buf, unsigned used, unsigned cont, unsigned want) {
+	want = min(want, used);
+	if (cont < want && buf->mirror) {
+		unsigned copy = min(want - cont, buf->mirror);
+		memcpy(buf->wrap, buf->buf, copy);
+		cont += copy;
+	}
+	return min(cont, want);
+}
+
+unsigned _buf_mirror(struct buffer *buf, unsigned want) {
+	return mirror(buf, _buf_used(buf), _buf_cont_read(buf), want);
+}
+
+// reader interface for decoders - only the decode thread moves readp so data between readp and writep can be
+// accessed without the mutex, which is only held to snapshot and update pointers
+
+// set ptr to up to want contiguous bytes at readp, data is not consumed until buf_read_consume is called
+unsigned buf_read_view(struct buffer *buf, u8_t **ptr, unsigned want) {
+	unsigned used, cont;
+
+	mutex_lock(buf->mutex);
+	used = _buf_used(buf);
+	cont = _buf_cont_read(buf);
+	*ptr = buf->readp;
+	mutex_unlock(buf->mutex);
+
+	return mirror(buf, used, cont, want);
+}
+
+static void copy(struct buffer *buf, u8_t *dest, u8_t *readp, unsigned cont, unsigned want) {
+	if (want <= cont) {
+		memcpy(dest, readp, want);
+	} else {
+		memcpy(dest, readp, cont);
+		memcpy(dest + cont, buf->buf, want - cont);
+	}
+}
+
+// copy up to want bytes including any which have wrapped and consume them
+// the copy is made without the mutex as the writer only adds data after writep, the only other thread to move readp
+// is slimproto flushing the buffer which it does after decode_flush has stopped the decoder
+unsigned buf_read_copy(struct buffer *buf, u8_t *dest, unsigned want) {
+	unsigned used, cont;
+	u8_t *readp;
+
 	mutex_lock(buf->mutex);
+	used = _buf_used(buf);
+	cont = _buf_cont_read(buf);
+	readp = buf->readp;
+	mutex_unlock(buf->mutex);
+
+	want = min(want, used);
+	copy(buf, dest, readp, cont, want);
+
+	buf_read_consume(buf, want);
+
+	return want;
+}
+
+// as buf_read_copy for callers which already hold the mutex
+unsigned _buf_read_copy(struct buffer *buf, u8_t *dest, unsigned want) {
+	want = min(want, _buf_used(buf));
+	copy(buf, dest, buf->readp, _buf_cont_read(buf), want);
+	_buf_inc_readp(buf, want);
+
+	return want;
+}
+
+void buf_read_consume(struct buffer *buf, unsigned by) {
+	mutex_lock(buf->mutex);
+	_buf_inc_readp(buf, by);
+	mutex_unlock(buf->mutex);
+}
+
+void _buf_flush(struct buffer *buf) {
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
+}
+
+void buf_flush(struct buffer *buf) {
+	mutex_lock(buf->mutex);
+	_buf_flush(buf);
 	mutex_unlock(buf->mutex);
 }
 
@@ -79,10 +160,10 @@ void buf_adjust(struct buffer *buf, size_t mod) {
 // called with mutex locked to resize, does not retain contents, reverts to original size if fails
 void _buf_resize(struct buffer *buf, size_t size) {
 	free(buf->buf);
-	buf->buf = malloc(size);
+	buf->buf = malloc(size + buf->mirror);
 	if (!buf->buf) {
 		size    = buf->size;
-		buf->buf= malloc(size);
+		buf->buf= malloc(size + buf->mirror);
 		if (!buf->buf) {
 			size = 0;
 		}
@@ -94,13 +175,15 @@ void _buf_resize(struct buffer *buf, size_t size) {
 	buf->base_size = size;
 }
 
-void buf_init(struct buffer *buf, size_t size) {
-	buf->buf    = malloc(size);
+// mirror bytes are allocated beyond wrap to allow wrapped data to be read contiguously with _buf_mirror
+void buf_init(struct buffer *buf, size_t size, size_t mirror) {
+	buf->buf    = malloc(size + mirror);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
 	buf->base_size = size;
+	buf->mirror = mirror;
 	mutex_create_p(buf->mutex);
 }
 
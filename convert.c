@@ -0,0 +1,321 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2016, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// sample conversion from decoder formats to the interleaved stereo s32 format of outputbuf
+// multichannel sources are downmixed to stereo using a per channel count matrix
+
+#include "squeezelite.h"
+
+extern log_level loglevel;
+
+// frames processed per pass - loops over a fixed block size are vectorised by the compiler
+#define CONVERT_BLOCK 256
+
+// downmix coefficients indexed by source channel count, [L|R][source channel]
+static float matrix[MAX_CHANNELS + 1][2][MAX_CHANNELS];
+
+// default matrices for wav/flac channel order, lfe is dropped
+#define C_L   0
+#define C_R   1
+#define C_C   2
+#define C_LFE 3
+#define C_BL  4
+#define C_BR  5
+#define C_BC  6
+
+static const u8_t layouts[MAX_CHANNELS + 1][MAX_CHANNELS] = {
+	{ 0 }, { 0 }, { 0 },
+	{ C_L, C_R, C_C },
+	{ C_L, C_R, C_BL, C_BR },
+	{ C_L, C_R, C_C, C_BL, C_BR },
+	{ C_L, C_R, C_C, C_LFE, C_BL, C_BR },
+	{ C_L, C_R, C_C, C_LFE, C_BC, C_BL, C_BR },
+	{ C_L, C_R, C_C, C_LFE, C_BL, C_BR, C_BL, C_BR },
+};
+
+static void _default_matrix(unsigned channels) {
+	unsigned c;
+	float sum[2] = { 0, 0 };
+
+	for (c = 0; c < channels; ++c) {
+		float l = 0, r = 0;
+		switch (layouts[channels][c]) {
+		case C_L:  l = 1.0f; break;
+		case C_R:  r = 1.0f; break;
+		case C_C:  l = r = 0.7071f; break;
+		case C_BL: l = 0.7071f; break;
+		case C_BR: r = 0.7071f; break;
+		case C_BC: l = r = 0.5f; break;
+		default: break;
+		}
+		matrix[channels][0][c] = l;
+		matrix[channels][1][c] = r;
+		sum[0] += l;
+		sum[1] += r;
+	}
+
+	// normalise so full scale on all channels does not clip
+	for (c = 0; c < channels; ++c) {
+		matrix[channels][0][c] /= sum[0];
+		matrix[channels][1][c] /= sum[1];
+	}
+}
+
+void convert_init(char *opt) {
+	unsigned i;
+
+	for (i = 3; i <= MAX_CHANNELS; ++i) {
+		_default_matrix(i);
+	}
+
+	// opt = <l1>,<l2>,..,<lN>:<r1>,<r2>,..,<rN> - replaces default matrix for N channel sources
+	if (opt && *opt) {
+		float coef[2][MAX_CHANNELS];
+		unsigned n[2] = { 0, 0 };
+		char *l = next_param(opt, ':');
+		char *r = next_param(NULL, ':');
+		char *c;
+
+		for (c = next_param(l, ','); c && n[0] < MAX_CHANNELS; c = next_param(NULL, ',')) {
+			coef[0][n[0]++] = (float)atof(c);
+		}
+		for (c = next_param(r, ','); c && n[1] < MAX_CHANNELS; c = next_param(NULL, ',')) {
+			coef[1][n[1]++] = (float)atof(c);
+		}
+
+		if (n[0] == n[1] && n[0] > 2) {
+			memcpy(matrix[n[0]][0], coef[0], sizeof(float) * n[0]);
+			memcpy(matrix[n[0]][1], coef[1], sizeof(float) * n[0]);
+			LOG_INFO("downmix matrix set for %u channels", n[0]);
+		} else {
+			LOG_ERROR("invalid downmix matrix: need the same number (3-%u) of left and right coefficients", MAX_CHANNELS);
+		}
+	}
+}
+
+// clamp to the largest float below 2^31 as larger values overflow the conversion, written as selects to vectorise
+static inline s32_t clip(float x) {
+	x = x < 2147483520.0f ? x : 2147483520.0f;
+	x = x > -2147483648.0f ? x : -2147483648.0f;
+	return (s32_t)x;
+}
+
+// mix a block of accumulated left and right samples to interleaved output
+static inline void _interleave(s32_t *optr, const float *l, const float *r, frames_t frames) {
+	while (frames--) {
+		*optr++ = clip(*l++);
+		*optr++ = clip(*r++);
+	}
+}
+
+// planar input of n channels with samples in the low (32 - shift) bits, eg flac
+void convert_s32p(s32_t *optr, const s32_t *const iptr[], unsigned channels, unsigned shift, frames_t frames) {
+	const s32_t *lptr = iptr[0];
+	const s32_t *rptr = iptr[channels > 1 ? 1 : 0];
+	frames_t done = 0;
+
+	if (channels <= 2) {
+		while (frames--) {
+			*optr++ = *lptr++ << shift;
+			*optr++ = *rptr++ << shift;
+		}
+		return;
+	}
+
+	while (done < frames) {
+		float l[CONVERT_BLOCK], r[CONVERT_BLOCK];
+		frames_t f = min(frames - done, CONVERT_BLOCK);
+		float scale = (float)(1u << shift);
+		unsigned c, i;
+
+		memset(l, 0, sizeof(l));
+		memset(r, 0, sizeof(r));
+
+		for (c = 0; c < channels; ++c) {
+			const s32_t *in = iptr[c] + done;
+			float cl = matrix[channels][0][c] * scale;
+			float cr = matrix[channels][1][c] * scale;
+
+			if (cl == 0 && cr == 0) {
+				continue;
+			}
+
+			// full blocks use a constant trip count so the compiler vectorises them
+			if (f == CONVERT_BLOCK) {
+				for (i = 0; i < CONVERT_BLOCK; ++i) {
+					l[i] += cl * in[i];
+					r[i] += cr * in[i];
+				}
+			} else {
+				for (i = 0; i < f; ++i) {
+					l[i] += cl * in[i];
+					r[i] += cr * in[i];
+				}
+			}
+		}
+
+		_interleave(optr, l, r, f);
+
+		optr += f * 2;
+		done += f;
+	}
+}
+
+// interleaved input of more than 2 channels at full 32 bit scale, eg pcm
+void convert_s32(s32_t *optr, const s32_t *iptr, unsigned channels, frames_t frames) {
+	while (frames) {
+		float l[CONVERT_BLOCK], r[CONVERT_BLOCK];
+		frames_t f = min(frames, CONVERT_BLOCK);
+		unsigned c, i;
+
+		memset(l, 0, sizeof(l));
+		memset(r, 0, sizeof(r));
+
+		for (c = 0; c < channels; ++c) {
+			const s32_t *in = iptr + c;
+			float cl = matrix[channels][0][c];
+			float cr = matrix[channels][1][c];
+
+			if (cl == 0 && cr == 0) {
+				continue;
+			}
+
+			for (i = 0; i < f; ++i) {
+				l[i] += cl * in[i * channels];
+				r[i] += cr * in[i * channels];
+			}
+		}
+
+		_interleave(optr, l, r, f);
+
+		optr += f * 2;
+		iptr += f * channels;
+		frames -= f;
+	}
+}
+
+// planar float input of n channels in the range +/-1.0, eg vorbis
+void convert_fltp(s32_t *optr, const float *const iptr[], unsigned channels, frames_t frames) {
+	const float scale = 2147483648.0f;
+	frames_t done = 0;
+
+	while (done < frames) {
+		float l[CONVERT_BLOCK], r[CONVERT_BLOCK];
+		frames_t f = min(frames - done, CONVERT_BLOCK);
+		unsigned c, i;
+
+		if (channels <= 2) {
+			const float *lptr = iptr[0] + done;
+			const float *rptr = iptr[channels > 1 ? 1 : 0] + done;
+
+			if (f == CONVERT_BLOCK) {
+				for (i = 0; i < CONVERT_BLOCK; ++i) {
+					optr[2 * i]     = clip(lptr[i] * scale);
+					optr[2 * i + 1] = clip(rptr[i] * scale);
+				}
+			} else {
+				for (i = 0; i < f; ++i) {
+					optr[2 * i]     = clip(lptr[i] * scale);
+					optr[2 * i + 1] = clip(rptr[i] * scale);
+				}
+			}
+
+		} else {
+
+			memset(l, 0, sizeof(l));
+			memset(r, 0, sizeof(r));
+
+			for (c = 0; c < channels; ++c) {
+				const float *in = iptr[c] + done;
+				float cl = matrix[channels][0][c] * scale;
+				float cr = matrix[channels][1][c] * scale;
+
+				if (cl == 0 && cr == 0) {
+					continue;
+				}
+
+				for (i = 0; i < f; ++i) {
+					l[i] += cl * in[i];
+					r[i] += cr * in[i];
+				}
+			}
+
+			_interleave(optr, l, r, f);
+		}
+
+		optr += f * 2;
+		done += f;
+	}
+}
+
+// widen interleaved s16 samples to s32 in place, working back from the end a block at a time
+// each block is copied out before being widened as its output overlaps its own input and the block after it
+void convert_s16_inplace(void *buf, size_t samples) {
+	size_t done = samples;
+
+	while (done) {
+		s16_t in[CONVERT_BLOCK];
+		size_t n = done % CONVERT_BLOCK ? done % CONVERT_BLOCK : CONVERT_BLOCK;
+		s32_t *optr;
+		unsigned i;
+
+		done -= n;
+		memcpy(in, (s16_t *)buf + done, n * sizeof(s16_t));
+		optr = (s32_t *)buf + done;
+
+		if (n == CONVERT_BLOCK) {
+			for (i = 0; i < CONVERT_BLOCK; ++i) {
+				optr[i] = in[i] << 16;
+			}
+		} else {
+			for (i = 0; i < n; ++i) {
+				optr[i] = in[i] << 16;
+			}
+		}
+	}
+}
+
+// convert interleaved float samples in the range +/-1.0 to s32 in place
+void convert_flt_inplace(void *buf, size_t samples) {
+	const float scale = 2147483648.0f;
+	size_t done = 0;
+
+	while (done < samples) {
+		float in[CONVERT_BLOCK];
+		size_t n = min(samples - done, CONVERT_BLOCK);
+		s32_t *optr = (s32_t *)buf + done;
+		unsigned i;
+
+		memcpy(in, (float *)buf + done, n * sizeof(float));
+
+		if (n == CONVERT_BLOCK) {
+			for (i = 0; i < CONVERT_BLOCK; ++i) {
+				optr[i] = clip(in[i] * scale);
+			}
+		} else {
+			for (i = 0; i < n; ++i) {
+				optr[i] = clip(in[i] * scale);
+			}
+		}
+
+		done += n;
+	}
+}
@@ -35,6 +35,14 @@ struct decodestate decode;
 struct codec *codecs[MAX_CODECS];
 struct codec *codec;
 static bool running = true;
+static bool sniff;   // codec to be detected from the start of the stream
+static bool sniffed; // codec was detected rather than sent by the server
+static struct decode_stats codec_stats[MAX_CODECS]; // totals for each registered codec
+static bool opened[MAX_CODECS]; // codecs stay open once used so a later track reuses their state
+static size_t read_hint, out_hint; // average input and largest output per decode call this track
+
+#define DECODE_BUDGET_US 5000 // time the decode thread may keep running a codec before releasing D
+#define HINT_MULT 2 // read and output thresholds grow to at most this multiple of the codec's own minimums
 
 #define LOCK_S   mutex_lock(streambuf->mutex)
 #define UNLOCK_S mutex_unlock(streambuf->mutex)
@@ -53,65 +61,425 @@ static bool running = true;
 #define MAY_PROCESS(x)
 #endif
 
+#define SNIFF_MIN 64   // bytes needed before trying to detect a codec
+#define SNIFF_PCM 4096 // bytes needed to parse wav and aiff headers
+
+// mpeg audio frame length from its header, 0 if not a valid header
+static unsigned _mpeg_frame_len(const u8_t *p) {
+	static const u16_t bitrates[5][15] = {
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 }, // v1 layer 1
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },    // v1 layer 2
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },     // v1 layer 3
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },    // v2 layer 1
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },         // v2 layer 2 and 3
+	};
+	static const u16_t rates[3] = { 44100, 48000, 32000 };
+	unsigned version = (p[1] >> 3) & 3, layer = (p[1] >> 1) & 3;
+	unsigned bitrate_idx = p[2] >> 4, rate_idx = (p[2] >> 2) & 3, pad = (p[2] >> 1) & 1;
+	unsigned bitrate, rate;
+
+	if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0 || version == 1 || layer == 0 || bitrate_idx == 0 || bitrate_idx == 15 || rate_idx == 3) {
+		return 0;
+	}
+
+	bitrate = bitrates[version == 3 ? 3 - layer : (layer == 3 ? 3 : 4)][bitrate_idx] * 1000;
+	rate = rates[rate_idx] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+
+	if (layer == 3) {
+		return (12 * bitrate / rate + pad) * 4;
+	}
+	return (layer == 1 && version != 3 ? 72 : 144) * bitrate / rate + pad;
+}
+
+// adts frame length from its header, 0 if not a valid header
+static unsigned _adts_frame_len(const u8_t *p) {
+	if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0 || ((p[2] >> 2) & 0xF) > 12) {
+		return 0;
+	}
+	return (p[3] & 0x3) << 11 | p[4] << 3 | p[5] >> 5;
+}
+
+// detect the codec from the first bytes of the stream
+// returns 1 if found, 0 if more data is needed or -1 if unknown
+static int _sniff_format(const u8_t *p, size_t len, bool more, u8_t *format, u8_t *size, u8_t *rate, u8_t *chan) {
+	size_t i;
+
+	*size = *rate = *chan = '?';
+
+	if (len < SNIFF_MIN && more) {
+		return 0;
+	}
+
+	// skip id3v2 tags, assume mp3 if the tag is longer than can be inspected
+	if (len >= 10 && !memcmp(p, "ID3", 3)) {
+		size_t tag = 10 + (p[6] << 21 | p[7] << 14 | p[8] << 7 | p[9]) + (p[5] & 0x10 ? 10 : 0);
+		if (tag + SNIFF_MIN > STREAMBUF_MIRROR) {
+			*format = 'm';
+			return 1;
+		}
+		if (tag + SNIFF_MIN > len) {
+			return more ? 0 : -1;
+		}
+		p += tag;
+		len -= tag;
+	}
+
+	if (len >= 4 && !memcmp(p, "fLaC", 4)) {
+		*format = 'f';
+		return 1;
+	}
+
+	if (len >= 35 && !memcmp(p, "OggS", 4) && !memcmp(p + 28, "\x01vorbis", 7)) {
+		*format = 'o';
+		return 1;
+	}
+
+	if (len >= 12 && ((!memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WAVE", 4)) ||
+					  (!memcmp(p, "FORM", 4) && (!memcmp(p + 8, "AIFF", 4) || !memcmp(p + 8, "AIFC", 4))))) {
+		// pcm parses the header itself so wait until it is likely to be complete
+		if (len < SNIFF_PCM && more) {
+			return 0;
+		}
+		*format = 'p';
+		return 1;
+	}
+
+	if (len >= 16 && (!memcmp(p, "DSD ", 4) || (!memcmp(p, "FRM8", 4) && !memcmp(p + 12, "DSD ", 4)))) {
+		*format = 'd';
+		return 1;
+	}
+
+	if (len >= 8 && !memcmp(p, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8)) {
+		// asf without mmsh chunking, let ffmpeg choose the stream
+		*format = 'w';
+		*size = '0';
+		*rate = 0;
+		return 1;
+	}
+
+	if (len >= 8 && !memcmp(p + 4, "ftyp", 4)) {
+		// mp4 - sample description names the codec, normally found early in moov
+		for (i = 8; i + 4 <= len; ++i) {
+			if (!memcmp(p + i, "mp4a", 4)) {
+				*format = 'a';
+				*size = '5';
+				return 1;
+			}
+			if (!memcmp(p + i, "alac", 4)) {
+				*format = 'l';
+				return 1;
+			}
+		}
+		return more && len < STREAMBUF_MIRROR ? 0 : -1;
+	}
+
+	// raw mpeg audio or adts, may start mid frame so look for two consecutive frame headers
+	for (i = 0; i + 6 <= len; ++i) {
+		unsigned frame;
+		if ((frame = _mpeg_frame_len(p + i)) && i + frame + 6 <= len) {
+			if (_mpeg_frame_len(p + i + frame)) {
+				*format = 'm';
+				return 1;
+			}
+		}
+		if ((frame = _adts_frame_len(p + i)) > 7 && i + frame + 6 <= len) {
+			if (_adts_frame_len(p + i + frame)) {
+				*format = 'a';
+				*size = '2';
+				return 1;
+			}
+		}
+	}
+
+	return more && len < STREAMBUF_MIRROR ? 0 : -1;
+}
+
+// find and open codec, called with D locked
+static bool _codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
+	int i;
+
+	for (i = 0; i < MAX_CODECS; ++i) {
+
+		if (codecs[i] && codecs[i]->id == format) {
+			u64_t start = gettime_us();
+
+			// previous codec is left open, its state is reset when it is next opened and released at decode_close
+			// streambuf may still be sized to the previous codec's frames, restore it unless it holds detected data
+			if (codec && codec != codecs[i]) {
+				bool adjusted;
+				LOCK_S;
+				adjusted = streambuf->size != streambuf->base_size && !_buf_used(streambuf);
+				UNLOCK_S;
+				if (adjusted) {
+					buf_adjust(streambuf, 1);
+				}
+			}
+
+			codec = codecs[i];
+
+			codec->open(sample_size, sample_rate, channels, endianness);
+
+			LOG_INFO("codec '%c' %s in %uus", codec->id, opened[i] ? "reset" : "opened", (u32_t)(gettime_us() - start));
+			opened[i] = true;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// detect the codec from the data in streambuf, called with D locked
+static bool _sniff_codec(bool toend) {
+	u8_t format, size, rate, chan;
+	size_t bytes;
+	int found;
+
+	LOCK_S;
+	bytes = _buf_mirror(streambuf, STREAMBUF_MIRROR);
+	found = _sniff_format(streambuf->readp, bytes, !toend, &format, &size, &rate, &chan);
+	UNLOCK_S;
+
+	if (found == 0) {
+		return false;
+	}
+
+	sniff = false;
+
+	if (found == 1 && _codec_open(format, size, rate, chan, '?')) {
+		LOG_INFO("detected codec: '%c'", format);
+		sniffed = true;
+	} else {
+		LOG_WARN("unable to detect codec");
+		decode.state = DECODE_ERROR;
+		wake_controller();
+	}
+
+	return true;
+}
+
+// bytes a buffer pointer has advanced by since from, 0 if the buffer has been reset
+static size_t _buf_advance(struct buffer *buf, u8_t *from, u8_t *to) {
+	size_t delta = to >= from ? to - from : (to - buf->buf) + (buf->wrap - from);
+	return delta < buf->size ? delta : 0;
+}
+
+static void _log_stats(const char *what, struct decode_stats *s) {
+	u64_t cpu_us = s->decode_us + s->process_us + s->chain_us;
+	double secs = s->sample_rate ? (double)s->frames / s->sample_rate : 0.0;
+	LOG_INFO("%s: frames: " FMT_u64 " bytes: " FMT_u64 " calls: %u decode: " FMT_u64 "us (max %uus) process: " FMT_u64 "us (max %uus) chain: " FMT_u64 "us real time factor: %.1f locks/s: %.1f",
+			 what, s->frames, s->bytes, s->calls, s->decode_us, s->decode_max_us, s->process_us, s->process_max_us, s->chain_us,
+			 cpu_us ? secs * 1000000 / cpu_us : 0.0, secs > 0 ? s->locks / secs : 0.0);
+}
+
+// log the counters of the track just finished and add them to the codec totals, called with D locked
+static void _stats_track_end(void) {
+	struct decode_stats *t = &decode.stats;
+	int i;
+
+	read_hint = out_hint = 0;
+
+	if (!t->calls || !codec) {
+		memset(t, 0, sizeof(*t));
+		return;
+	}
+
+	MAY_PROCESS(
+		// processed output is written by the process thread, blocks still queued at the end of decoding are not counted
+		if (decode.process && !decode.direct) {
+			process_stats(&t->chain_us, &t->frames);
+		}
+	);
+
+	for (i = 0; i < MAX_CODECS; ++i) {
+		if (codecs[i] == codec) {
+			struct decode_stats *c = &codec_stats[i];
+			// frames at differing rates are scaled to the current rate so the real time factor stays meaningful
+			if (c->sample_rate && c->sample_rate != t->sample_rate && t->sample_rate) {
+				c->frames = c->frames * t->sample_rate / c->sample_rate;
+			}
+			c->frames += t->frames;
+			c->bytes += t->bytes;
+			c->decode_us += t->decode_us;
+			c->process_us += t->process_us;
+			c->chain_us += t->chain_us;
+			c->decode_max_us = max(c->decode_max_us, t->decode_max_us);
+			c->process_max_us = max(c->process_max_us, t->process_max_us);
+			c->calls += t->calls;
+			c->locks += t->locks;
+			c->sample_rate = t->sample_rate ? t->sample_rate : c->sample_rate;
+
+			LOG_INFO("codec '%c' track stats", codec->id);
+			_log_stats("track", t);
+			_log_stats("codec total", c);
+			break;
+		}
+	}
+
+	memset(t, 0, sizeof(*t));
+}
+
 static void *decode_thread() {
 
 	while (running) {
-		size_t bytes, space, min_space;
+		size_t bytes, space, min_space, min_read;
 		bool toend;
 		bool ran = false;
+		bool pending = false; // new stream waiting for the process thread
+		u8_t *readp, *writep;
 
 		LOCK_S;
 		bytes = _buf_used(streambuf);
 		toend = (stream.state <= DISCONNECT);
+		readp = streambuf->readp;
 		UNLOCK_S;
 		LOCK_O;
 		space = _buf_space(outputbuf);
+		writep = outputbuf->writep;
 		UNLOCK_O;
 
 		LOCK_D;
 
-		if (decode.state == DECODE_RUNNING && codec) {
-		
-			LOG_SDEBUG("streambuf bytes: %u outputbuf space: %u", bytes, space);
-
-			IF_DIRECT(
-				min_space = codec->min_space;
-			);
-			IF_PROCESS(
-				min_space = process.max_out_frames * BYTES_PER_FRAME;
-			);
-			
-			if (space > min_space && (bytes > codec->min_read_bytes || toend)) {
-				
-				decode.state = codec->decode();
+		decode.stats.locks += 3;
+
+		if (decode.state == DECODE_RUNNING && sniff && (bytes || toend)) {
+			ran = _sniff_codec(toend);
+		}
 
+		if (decode.state == DECODE_RUNNING && codec && !sniff) {
+			struct decode_stats *st = &decode.stats;
+			u64_t deadline = 0;
+
+			// run the codec repeatedly while there is input and room for output, up to the time budget
+			for (;;) {
+
+				LOG_SDEBUG("streambuf bytes: %u outputbuf space: %u", bytes, space);
+
+				// thresholds grow to the largest output and average input seen per call this track, up to HINT_MULT times the
+				// codec minimums so a codec making large calls does not wait for a large part of either buffer
+				IF_DIRECT(
+					min_space = max(codec->min_space, out_hint);
+				);
 				IF_PROCESS(
-					if (process.in_frames) {
-						process_samples();
+					// output is written by the process thread, the codec needs a free block to decode into
+					space = process_space();
+					min_space = 0;
+				);
+				min_read = max(codec->min_read_bytes, read_hint);
+
+				// a new stream waits here, with no mutex held by the codec, until the process thread has written the
+				// previous track as the codec may reconfigure the chain or write directly to outputbuf at its start
+				MAY_PROCESS(
+					if (decode.process && decode.new_stream && !process_idle()) {
+						pending = true;
+						break;
 					}
+				);
+
+				if (space > min_space && (bytes > min_read || toend)) {
+					u64_t start = gettime_us(), cpu = getcputime_us(), now;
+					size_t consumed, written;
 
-					if (decode.state == DECODE_COMPLETE) {
-						process_drain();
+					if (!deadline) {
+						deadline = start + DECODE_BUDGET_US;
 					}
-				);
 
-				if (decode.state != DECODE_RUNNING) {
+					decode.state = codec->decode();
+
+					now = gettime_us();
+					st->decode_max_us = max(st->decode_max_us, (u32_t)(now - start));
+					start = now;
+					now = getcputime_us();
+					st->decode_us += now - cpu;
+					cpu = now;
+					st->calls++;
+
+					IF_PROCESS(
+						if (process.in_frames || decode.state == DECODE_COMPLETE) {
+							if (process.in_frames) {
+								process_samples();
+							}
 
-					LOG_INFO("decode %s", decode.state == DECODE_COMPLETE ? "complete" : "error");
+							if (decode.state == DECODE_COMPLETE) {
+								process_drain();
+							}
+
+							st->process_max_us = max(st->process_max_us, (u32_t)(gettime_us() - start));
+							st->process_us += getcputime_us() - cpu;
+
+							// output of a processed track is written by the process thread
+							process_stats(&st->chain_us, &st->frames);
+						}
+					);
 
 					LOCK_O;
-					if (output.fade_mode) _checkfade(false);
+					written = _buf_advance(outputbuf, writep, outputbuf->writep);
+					writep = outputbuf->writep;
+					space = _buf_space(outputbuf);
+					out_hint = min(max(out_hint, written), min(HINT_MULT * codec->min_space, outputbuf->size / 4));
 					UNLOCK_O;
+					LOCK_S;
+					consumed = _buf_advance(streambuf, readp, streambuf->readp);
+					readp = streambuf->readp;
+					bytes = _buf_used(streambuf);
+					toend = (stream.state <= DISCONNECT);
+					if (consumed) {
+						read_hint = min((read_hint * 7 + consumed) / 8, min(HINT_MULT * codec->min_read_bytes, streambuf->size / 4));
+					}
+					// time from a local seek request to the first audio at the new position
+					if (written && stream.seek_start) {
+						if (stream.seek_ms) {
+							LOG_WARN("codec '%c' can't seek - playing from start", codec->id);
+							stream.seek_ms = 0;
+						}
+						LOG_INFO("seek to audio: %u ms", gettime_ms() - stream.seek_start);
+						stream.seek_start = 0;
+					}
+					UNLOCK_S;
 
-					wake_controller();
-				}
+					st->locks += 2;
+					st->bytes += consumed;
+					IF_DIRECT(
+						st->frames += written / BYTES_PER_FRAME;
+					);
+
+					ran = true;
+
+					if (decode.state != DECODE_RUNNING) {
+
+						LOG_INFO("decode %s", decode.state == DECODE_COMPLETE ? "complete" : "error");
+
+						_stats_track_end();
+
+						LOCK_O;
+						if (output.fade_mode) _checkfade(false);
+						UNLOCK_O;
+
+						wake_controller();
+						break;
+					}
+
+					// a call which makes no progress is waiting for the stream so stop until the next wakeup
+					if ((!consumed && !written) || gettime_us() >= deadline) {
+						break;
+					}
 
-				ran = true;
+				} else {
+					break;
+				}
 			}
 		}
 		
 		UNLOCK_D;
 
+		// waiting for the process thread to finish the previous track, start as soon as it has
+		MAY_PROCESS(
+			if (pending) {
+				process_wait(100);
+				continue;
+			}
+		);
+
 		if (!ran) {
 			usleep(100000);
 		}
@@ -135,8 +503,17 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 #if DSD
 	if (!strstr(exclude_codecs, "dsd")  && (!include_codecs || strstr(include_codecs, "dsd")))  codecs[i++] = register_dsd();
 #endif
+
+	// try native alac then ffmpeg unless command line option passed
+	if (!(strstr(exclude_codecs, "alac") || strstr(exclude_codecs, "alcn")) &&
+		(!include_codecs || strstr(include_codecs, "alac") || strstr(include_codecs, "alcn")))  codecs[i] = register_alac();
+#if FFMPEG
+	if (!(strstr(exclude_codecs, "alac") || strstr(exclude_codecs, "alcf")) && !codecs[i] &&
+		(!include_codecs || strstr(include_codecs, "alac") || strstr(include_codecs, "alcf")))  codecs[i] = register_ff("alc");
+#endif
+	if (codecs[i]) i++;
+
 #if FFMPEG
-	if (!strstr(exclude_codecs, "alac") && (!include_codecs || strstr(include_codecs, "alac")))  codecs[i++] = register_ff("alc");
 	if (!strstr(exclude_codecs, "wma")  && (!include_codecs || strstr(include_codecs, "wma")))   codecs[i++] = register_ff("wma");
 #endif
 	if (!strstr(exclude_codecs, "aac")  && (!include_codecs || strstr(include_codecs, "aac")))  codecs[i++] = register_faad();
@@ -175,12 +552,19 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 }
 
 void decode_close(void) {
+	int i;
+
 	LOG_INFO("close decode");
 	LOCK_D;
-	if (codec) {
-		codec->close();
-		codec = NULL;
+	_stats_track_end();
+	for (i = 0; i < MAX_CODECS; ++i) {
+		if (codecs[i] && opened[i]) {
+			LOG_INFO("closing codec: '%c'", codecs[i]->id);
+			codecs[i]->close();
+			opened[i] = false;
+		}
 	}
+	codec = NULL;
 	running = false;
 	UNLOCK_D;
 #if LINUX || OSX || FREEBSD
@@ -191,10 +575,21 @@ void decode_close(void) {
 
 void decode_flush(void) {
 	LOG_INFO("decode flush");
+	MAY_PROCESS(
+		// the process thread may be waiting for output space while the decode thread holds the mutex
+		if (decode.process) {
+			process_abort();
+		}
+	);
 	LOCK_D;
+	_stats_track_end();
 	decode.state = DECODE_STOPPED;
-	IF_PROCESS(
-		process_flush();
+	sniff = false;
+	MAY_PROCESS(
+		// also when the current track is not processed as this clears the abort set above
+		if (decode.process) {
+			process_flush();
+		}
 	);
 	UNLOCK_D;
 }
@@ -212,46 +607,62 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 		}
 	);
 
+	decode.stats.sample_rate = sample_rate;
+
 	return sample_rate;
 }
 
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
-	int i;
 
 	LOG_INFO("codec open: '%c'", format);
 
 	LOCK_D;
 
+	// server codc overrides a detected codec unless decoding has already started
+	if ((sniff || (sniffed && codec)) && decode.state == DECODE_RUNNING && format != '?') {
+		if (sniff || (codec->id != format && decode.new_stream)) {
+			LOG_INFO("server codec replaces detection");
+			sniff = false;
+			if (!_codec_open(format, sample_size, sample_rate, channels, endianness)) {
+				decode.state = DECODE_ERROR;
+				LOG_ERROR("codec not found");
+			}
+		} else if (codec->id != format) {
+			LOG_WARN("ignoring codec: '%c' already decoding as: '%c'", format, codec->id);
+		}
+		sniffed = false;
+		UNLOCK_D;
+		return;
+	}
+
+	_stats_track_end();
+
 	decode.new_stream = true;
 	decode.state = DECODE_STOPPED;
+	sniffed = false;
 
 	MAY_PROCESS(
 		decode.direct = true; // potentially changed within codec when processing enabled
 	);
 
-	// find the required codec
-	for (i = 0; i < MAX_CODECS; ++i) {
-
-		if (codecs[i] && codecs[i]->id == format) {
-
-			if (codec && codec != codecs[i]) {
-				LOG_INFO("closing codec: '%c'", codec->id);
-				codec->close();
-			}
-			
-			codec = codecs[i];
-			
-			codec->open(sample_size, sample_rate, channels, endianness);
+	// unknown codec - detect from stream data once decoding starts
+	if (format == '?') {
+		LOG_INFO("codec to be detected from stream");
+		sniff = true;
+		decode.state = DECODE_READY;
+		UNLOCK_D;
+		return;
+	}
 
-			decode.state = DECODE_READY;
+	sniff = false;
 
-			UNLOCK_D;
-			return;
-		}
+	if (_codec_open(format, sample_size, sample_rate, channels, endianness)) {
+		decode.state = DECODE_READY;
+		UNLOCK_D;
+		return;
 	}
 
 	UNLOCK_D;
 
 	LOG_ERROR("codec not found");
 }
-
@@ -58,33 +58,8 @@ bool is_flac_dop(u32_t *lptr, u32_t *rptr, frames_t frames) {
 	return false;
 }
 
-// update the dop marker and potentially invert polarity for frames in the output buffer
-// performaned on all output including silence to maintain marker phase consitency
-void update_dop(u32_t *ptr, frames_t frames, bool invert) {
-	static u32_t marker = 0x05;
-	if (!invert) {
-		while (frames--) {
-			u32_t scaled_marker = marker << 24;
-			*ptr = (*ptr & 0x00FFFFFF) | scaled_marker;
-			++ptr;
-			*ptr = (*ptr & 0x00FFFFFF) | scaled_marker;
-			++ptr;
-			marker = ( 0x05 + 0xFA ) - marker;
-		}
-	} else {
-		while (frames--) {
-			u32_t scaled_marker = marker << 24;
-			*ptr = ((~(*ptr)) & 0x00FFFFFF) | scaled_marker;
-			++ptr;
-			*ptr = ((~(*ptr)) & 0x00FFFFFF) | scaled_marker;
-			++ptr;
-			marker = ( 0x05 + 0xFA ) - marker;
-		}
-	}
-}
-
 // fill silence buffer with 10101100 which represents dop silence
-// leave marker zero it will be updated at output, leave lsb zero
+// leave marker zero it is applied when packed for output, leave lsb zero
 void dop_silence_frames(u32_t *ptr, frames_t frames) {
 	while (frames--) {
 		*ptr++ = 0x00ACAC00;
@@ -92,10 +67,29 @@ void dop_silence_frames(u32_t *ptr, frames_t frames) {
 	}
 }
 
-void dop_init(bool enable, unsigned delay) {
+// native dsd is packed msb first in each sample with no marker, polarity is inverted by inverting every bit
+void dsd_invert(u32_t *ptr, frames_t frames) {
+	while (frames--) {
+		*ptr = ~(*ptr);
+		++ptr;
+		*ptr = ~(*ptr);
+		++ptr;
+	}
+}
+
+// fill silence buffer with 01101001 which represents native dsd silence
+void dsd_silence_frames(u32_t *ptr, frames_t frames) {
+	while (frames--) {
+		*ptr++ = 0x69696969;
+		*ptr++ = 0x69696969;
+	}
+}
+
+void dop_init(bool enable, unsigned delay, dsd_format format) {
 	LOCK_O;
-	output.has_dop = enable;
+	output.has_dop = enable && format == DOP;
 	output.dop_delay = delay;
+	output.dsd_fmt = enable ? format : DOP;
 	UNLOCK_O;
 }
 
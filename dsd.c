@@ -28,6 +28,12 @@
 // use dsd2pcm from Sebastian Gesemann for conversion to pcm:
 #include "./dsd2pcm/dsd2pcm.h"
 
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 extern log_level loglevel;
 
 extern struct buffer *streambuf;
@@ -59,11 +65,24 @@ extern struct processstate process;
 
 #define BLOCK 4096 // expected size of dsd block
 #define BLOCK_FRAMES BLOCK * BYTES_PER_FRAME
-#define WRAP_BUF_SIZE 16
+#define WRAP_BUF_SIZE 32 // one frame of up to 6 channels of native dsd
 
 typedef enum { UNKNOWN=0, DSF, DSDIFF } dsd_type;
 
 static bool dop = false; // local copy of output.has_dop to avoid holding output lock
+static unsigned native = 0; // bytes of native dsd per channel in each output sample, 0 if not native
+
+#define MAX_DECIMATE 7 // halfband stages, enough to take dsd1024 down to 44.1k
+
+// one halfband decimate by 2 stage for one channel, buf holds the history followed by the input of each call
+// and odd holds the samples between output centres so the filter runs over consecutive outputs
+struct halfband {
+	const float *coef;
+	unsigned pairs;
+	float *buf;
+	float *odd;
+	unsigned phase;
+};
 
 struct dsd {
 	dsd_type type;
@@ -72,13 +91,381 @@ struct dsd {
 	u32_t channels;
 	u64_t sample_bytes;
 	u32_t block_size;
+	u32_t block_skip;
 	bool  lsb_first;
 	dsd2pcm_ctx *dsd2pcm_ctx[2];
 	float *transfer[2];
+	unsigned decimate;
+	struct halfband hb[2][MAX_DECIMATE];
 };
 
 static struct dsd *d;
 
+// dsd2pcm produces pcm at the dsd rate / 8, this is halved by halfband stages until it is a rate the device supports
+// and no higher than -Y, so the pcm needs no resampling
+// the stage next to the output has the sharpest filter, earlier stages only need to reject what would alias into its passband
+unsigned dsd_pcm_rate = 0;
+
+#define HB_PASS  0.4  // passband edge as a fraction of the output rate
+#define HB_ATTEN 100  // dB stopband attenuation
+
+// buffer sizes for n inputs per call to a stage with p coefficients, including reads by the last group of 8 outputs
+#define HB_BUF(n, p) (4 * (p) + (n) + 16)
+#define HB_ODD(n, p) ((n) / 2 + 2 * (p) + 8)
+
+// coefficients for a stage which is this many stages before the output, odd offsets from the centre only
+static struct {
+	unsigned pairs;
+	float *coef;
+} hb_design[MAX_DECIMATE];
+
+static const float *_halfband_coef(unsigned from_end, unsigned *pairs) {
+	if (!hb_design[from_end].coef) {
+		// kaiser window design, transition is between the passband edge and its image about the stage's output nyquist
+		double trans = ((1 << from_end) - 2 * HB_PASS) / (1 << (from_end + 1));
+		double beta = 0.1102 * (HB_ATTEN - 8.7);
+		unsigned n = (unsigned)ceil((HB_ATTEN - 7.95) / (14.36 * trans)) + 1;
+		unsigned p = (n + 4) / 4, k;
+		float *coef = malloc(p * sizeof(float));
+		double sum = 0;
+
+		if (!coef) {
+			return NULL;
+		}
+
+		// only taps at odd offsets from the centre are non zero, the centre tap is 0.5
+		for (k = 0; k < p; ++k) {
+			double off = 2 * k + 1;
+			double r = off / (2 * p);
+			coef[k] = (float)(((k & 1) ? -1 : 1) / (M_PI * off) * bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta));
+			sum += coef[k];
+		}
+		// unity gain at dc
+		for (k = 0; k < p; ++k) {
+			coef[k] *= (float)(0.25 / sum);
+		}
+
+		hb_design[from_end].coef = coef;
+		hb_design[from_end].pairs = p;
+
+		LOG_DEBUG("halfband %u stages from output: %u taps", from_end, 4 * p - 1);
+	}
+	*pairs = hb_design[from_end].pairs;
+	return hb_design[from_end].coef;
+}
+
+// decimate by 2, dst may be the same as src, returns samples written
+static frames_t _halfband(struct halfband *h, const float *src, frames_t n, float *dst) {
+	unsigned p = h->pairs;
+	unsigned hist = 4 * p - 2;
+	float *w = h->buf;
+	float *o = h->odd;
+	frames_t out = (n + h->phase) / 2;
+	frames_t m;
+	unsigned k;
+
+	memcpy(w + hist, src, n * sizeof(float));
+
+	if (out) {
+		// first output is centred on input 1 - phase, the taps either side of each centre are o[m + p - 1 - k] and o[m + p + k]
+		// outputs are made 8 at a time in fixed length loops which the compiler vectorises at -O2, buffers have room for
+		// the extra outputs of the last group which are not stored
+		const float *c = w + 1 - h->phase + hist / 2;
+		const float *b = c - (2 * p - 1);
+		for (m = 0; m < out + 2 * p + 7; ++m) {
+			o[m] = b[2 * m];
+		}
+		for (m = 0; m < out; m += 8) {
+			float acc[8];
+			unsigned j;
+			for (j = 0; j < 8; ++j) {
+				acc[j] = 0.5f * c[2 * (m + j)];
+			}
+			for (k = 0; k < p; ++k) {
+				const float coef = h->coef[k];
+				const float *l = o + m + p - 1 - k;
+				const float *r = o + m + p + k;
+				for (j = 0; j < 8; ++j) {
+					acc[j] += coef * (l[j] + r[j]);
+				}
+			}
+			for (j = 0; j < 8 && m + j < out; ++j) {
+				dst[m + j] = acc[j];
+			}
+		}
+	}
+
+	h->phase = (h->phase + n) & 1;
+	memmove(w, w + n, hist * sizeof(float));
+
+	return out;
+}
+
+// inputs held in the stages, the next call's output is (frames + pending) >> decimate
+static unsigned _decimate_pending(void) {
+	unsigned s, pending = 0;
+	for (s = 0; s < d->decimate; ++s) {
+		pending |= d->hb[0][s].phase << s;
+	}
+	return pending;
+}
+
+static frames_t _decimate(frames_t frames, float *dstl, float *dstr) {
+	unsigned s;
+	frames_t out = frames;
+	for (s = 0; s < d->decimate; ++s) {
+		frames = out;
+		out = _halfband(&d->hb[0][s], dstl, frames, dstl);
+		if (dstr) {
+			_halfband(&d->hb[1][s], dstr, frames, dstr);
+		}
+	}
+	return out;
+}
+
+static bool _rate_supported(unsigned rate) {
+	unsigned i;
+	for (i = 0; i < MAX_SUPPORTED_SAMPLERATES && output.supported_rates[i]; ++i) {
+		if (output.supported_rates[i] == rate) return true;
+	}
+	return false;
+}
+
+// choose the number of halfband stages for dsd2pcm output at rate, returns false if stage buffers can't be allocated
+static bool _decimate_init(unsigned rate) {
+	unsigned max = dsd_pcm_rate ? dsd_pcm_rate : output.supported_rates[0];
+	unsigned shift, c, s;
+
+	// highest supported rate within max, if there is none take the highest rate within max and resample from there
+	for (shift = 0; shift <= MAX_DECIMATE && rate >> shift >= 44100; ++shift) {
+		if (rate >> shift <= max && _rate_supported(rate >> shift)) break;
+	}
+	if (shift > MAX_DECIMATE || rate >> shift < 44100) {
+		for (shift = 0; shift < MAX_DECIMATE && rate >> shift > max && rate >> (shift + 1) >= 44100; ++shift);
+	}
+
+	d->decimate = shift;
+
+	for (s = 0; s < shift; ++s) {
+		unsigned pairs;
+		const float *coef = _halfband_coef(shift - 1 - s, &pairs);
+		if (!coef) {
+			return false;
+		}
+		for (c = 0; c < 2; ++c) {
+			struct halfband *h = &d->hb[c][s];
+			if (h->buf && h->pairs != pairs) {
+				free(h->buf);
+				h->buf = NULL;
+			}
+			if (!h->buf) {
+				h->buf = calloc(HB_BUF(BLOCK >> s, pairs) + HB_ODD(BLOCK >> s, pairs), sizeof(float));
+				if (!h->buf) {
+					return false;
+				}
+				h->odd = h->buf + HB_BUF(BLOCK >> s, pairs);
+			}
+			h->coef = coef;
+			h->pairs = pairs;
+			h->phase = 0;
+			memset(h->buf, 0, (4 * pairs - 2) * sizeof(float));
+		}
+	}
+
+	if (shift) {
+		LOG_INFO("decimating dsd2pcm output by %u to %u", 1 << shift, rate >> shift);
+	}
+
+	return true;
+}
+
+// optional worker threads for dsd to pcm conversion, set by -T
+// each channel of a call is split into parts which are translated in parallel, the decode thread takes a share
+// parts after the first are primed with the preceding octets so the output is identical to serial conversion
+unsigned dsd_threads = 0;
+
+#define MAX_DSD_THREADS 8
+#define MIN_PART 1024 // frames, smaller calls are converted on the decode thread
+
+struct dsd_part {
+	dsd2pcm_ctx *ctx;
+	const u8_t *src;
+	ptrdiff_t stride;
+	size_t frames;
+	float *dst;
+	bool prime;
+};
+
+static struct {
+	unsigned workers;
+	mutex_type mutex;
+#if !WIN
+	pthread_cond_t go;
+	pthread_cond_t done;
+#else
+	HANDLE go[MAX_DSD_THREADS];
+	HANDLE done;
+#endif
+	struct dsd_part part[2 * MAX_DSD_THREADS];
+	dsd2pcm_ctx *ctx[2 * MAX_DSD_THREADS];
+	unsigned parts, next, pending;
+	bool lsb_first;
+} pool;
+
+// run parts until none are left, called with pool.mutex held and returns with it held
+static void _pool_run(void) {
+	while (pool.next < pool.parts) {
+		struct dsd_part *p = &pool.part[pool.next++];
+		mutex_unlock(pool.mutex);
+
+		if (p->prime) {
+			dsd2pcm_prime(p->ctx, p->src, p->stride, pool.lsb_first);
+		}
+		dsd2pcm_translate(p->ctx, p->frames, p->src, p->stride, pool.lsb_first, p->dst, 1);
+
+		mutex_lock(pool.mutex);
+		if (--pool.pending == 0) {
+#if !WIN
+			pthread_cond_signal(&pool.done);
+#else
+			SetEvent(pool.done);
+#endif
+		}
+	}
+}
+
+static void *dsd_worker(void *arg) {
+#if WIN
+	HANDLE go = pool.go[(uintptr_t)arg];
+#endif
+	mutex_lock(pool.mutex);
+	while (true) {
+		_pool_run();
+#if !WIN
+		pthread_cond_wait(&pool.go, &pool.mutex);
+#else
+		mutex_unlock(pool.mutex);
+		WaitForSingleObject(go, INFINITE);
+		mutex_lock(pool.mutex);
+#endif
+	}
+	return NULL;
+}
+
+static void dsd_pool_init(void) {
+	unsigned i;
+
+	pool.workers = min(dsd_threads, MAX_DSD_THREADS) - 1;
+
+	mutex_create(pool.mutex);
+#if !WIN
+	pthread_cond_init(&pool.go, NULL);
+	pthread_cond_init(&pool.done, NULL);
+#else
+	pool.done = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+
+	for (i = 0; i < 2 * (pool.workers + 1); ++i) {
+		pool.ctx[i] = dsd2pcm_init();
+	}
+
+	for (i = 0; i < pool.workers; ++i) {
+		thread_type thread;
+#if LINUX || OSX || FREEBSD
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+#ifdef PTHREAD_STACK_MIN
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + DSD_THREAD_STACK_SIZE);
+#endif
+		pthread_create(&thread, &attr, dsd_worker, NULL);
+		pthread_attr_destroy(&attr);
+#endif
+#if WIN
+		pool.go[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		thread = CreateThread(NULL, DSD_THREAD_STACK_SIZE, (LPTHREAD_START_ROUTINE)&dsd_worker, (LPVOID)(uintptr_t)i, 0, NULL);
+#endif
+		(void)thread;
+	}
+
+	LOG_INFO("dsd to pcm conversion using %u threads", pool.workers + 1);
+}
+
+// translate one or two channels, in parallel if worker threads are available and the call is large enough
+static void _translate(frames_t frames, u8_t *iptrl, u8_t *iptrr, ptrdiff_t stride, bool lsb_first, float *dstl, float *dstr) {
+	unsigned chans = iptrr ? 2 : 1;
+	unsigned threads = pool.workers + 1;
+	unsigned splits, c, i;
+	frames_t len;
+
+	// split each channel so the parts share out evenly between threads
+	splits = threads % chans ? threads : threads / chans;
+	while (splits > 1 && frames / splits < MIN_PART) {
+		--splits;
+	}
+
+	if (!pool.workers || frames < MIN_PART || (chans == 1 && splits == 1)) {
+		if (chans == 1) {
+			dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptrl, stride, lsb_first, dstl, 1);
+		} else {
+			dsd2pcm_translate_stereo(d->dsd2pcm_ctx[0], d->dsd2pcm_ctx[1], frames, iptrl, iptrr, stride, lsb_first, dstl, dstr);
+		}
+		return;
+	}
+
+	len = frames / splits;
+
+	mutex_lock(pool.mutex);
+
+	for (c = 0; c < chans; ++c) {
+		u8_t *src = c ? iptrr : iptrl;
+		float *dst = c ? dstr : dstl;
+		for (i = 0; i < splits; ++i) {
+			struct dsd_part *p = &pool.part[c * splits + i];
+			p->ctx = i ? pool.ctx[c * splits + i] : d->dsd2pcm_ctx[c];
+			p->src = src + i * len * stride;
+			p->stride = stride;
+			p->frames = i < splits - 1 ? len : frames - i * len;
+			p->dst = dst + i * len;
+			p->prime = i > 0;
+		}
+	}
+
+	pool.lsb_first = lsb_first;
+	pool.parts = chans * splits;
+	pool.pending = pool.parts;
+	pool.next = 0;
+
+#if !WIN
+	pthread_cond_broadcast(&pool.go);
+#else
+	for (i = 0; i < pool.workers; ++i) {
+		SetEvent(pool.go[i]);
+	}
+#endif
+
+	_pool_run();
+
+	while (pool.pending) {
+#if !WIN
+		pthread_cond_wait(&pool.done, &pool.mutex);
+#else
+		mutex_unlock(pool.mutex);
+		WaitForSingleObject(pool.done, INFINITE);
+		mutex_lock(pool.mutex);
+#endif
+	}
+
+	mutex_unlock(pool.mutex);
+
+	// the first part of each channel left its history part way through, move it to the end
+	if (splits > 1) {
+		dsd2pcm_prime(d->dsd2pcm_ctx[0], iptrl + frames * stride, stride, lsb_first);
+		if (iptrr) {
+			dsd2pcm_prime(d->dsd2pcm_ctx[1], iptrr + frames * stride, stride, lsb_first);
+		}
+	}
+}
+
 static u64_t unpack64be(const u8_t *p) {
 	return 
 		(u64_t)p[0] << 56 | (u64_t)p[1] << 48 | (u64_t)p[2] << 40 | (u64_t)p[3] << 32 |
@@ -205,6 +592,24 @@ static int _read_header(void) {
 	return 0;
 }
 
+// native dsd keeps the first byte in time in the msb of each output sample, the output packs it into the device format
+static void _pack_native(u32_t *optr, const u8_t *iptrl, const u8_t *iptrr, ptrdiff_t stride, frames_t frames, bool lsb_first) {
+	unsigned i;
+	while (frames--) {
+		u32_t l = 0, r = 0;
+		for (i = 0; i < native; ++i) {
+			u8_t bl = lsb_first ? dsd2pcm_bitreverse[*iptrl] : *iptrl;
+			u8_t br = lsb_first ? dsd2pcm_bitreverse[*iptrr] : *iptrr;
+			l |= (u32_t)bl << (24 - 8 * i);
+			r |= (u32_t)br << (24 - 8 * i);
+			iptrl += stride;
+			iptrr += stride;
+		}
+		*(optr++) = l;
+		*(optr++) = r;
+	}
+}
+
 static decode_state _decode_dsf(void) {
 
 	// samples in streambuf are interleaved on block basis
@@ -213,12 +618,19 @@ static decode_state _decode_dsf(void) {
 	unsigned bytes = _buf_used(streambuf);
 	unsigned block_left = d->block_size;
 	
-	unsigned bytes_per_frame = dop ? 2 : 1;
+	unsigned bytes_per_frame = dop ? 2 : native ? native : 1;
 	
 	if (bytes < d->block_size * d->channels) {
 		LOG_INFO("stream too short"); // this can occur when scanning the track
 		return DECODE_COMPLETE;
 	}
+
+	// first block after a seek starts part way in, the right channel pointer stays a block ahead of the left
+	if (d->block_skip) {
+		_buf_inc_readp(streambuf, d->block_skip);
+		block_left -= d->block_skip;
+		d->block_skip = 0;
+	}
 	
 	IF_PROCESS(
 		process.in_frames = 0;
@@ -226,7 +638,7 @@ static decode_state _decode_dsf(void) {
 
 	while (block_left) {
 		
-		frames_t frames, out, count;
+		frames_t frames, out, count, written;
 		unsigned bytes_read;
 		
 		u8_t *iptrl = (u8_t *)streambuf->readp;
@@ -250,22 +662,28 @@ static decode_state _decode_dsf(void) {
 
 		frames = min(bytes, d->sample_bytes) / bytes_per_frame;
 		if (frames == 0) {
-			if (dop && d->sample_bytes == 1 && bytes >= 2) {
-				// 1 byte left add a byte of silence and play
-				*(iptrl + 1) = *(iptrr + 1) = 0x69;
+			if ((dop || native) && d->sample_bytes < bytes_per_frame && bytes >= bytes_per_frame) {
+				// part of a frame left add bytes of silence and play
+				memset(iptrl + d->sample_bytes, 0x69, bytes_per_frame - d->sample_bytes);
+				memset(iptrr + d->sample_bytes, 0x69, bytes_per_frame - d->sample_bytes);
 				frames = 1;
 			} else {
-				// should not get here due to wrapping m/2 for dop should never result in 0 as header len is always even
+				// should not get here due to wrapping as header len and streambuf size are multiples of 4
 				LOG_INFO("frames got to zero");
 				return DECODE_COMPLETE;
 			}
 		}
 
+		// each decimated output frame takes 2^decimate frames from dsd2pcm
+		if (out && d->decimate) {
+			out = (out << d->decimate) - _decimate_pending();
+		}
+
 		frames = min(frames, out);
 		frames = min(frames, BLOCK);
 		bytes_read = frames * bytes_per_frame;
 		
-		count = frames;
+		count = written = frames;
 		
 		if (dop) {
 			
@@ -301,11 +719,16 @@ static decode_state _decode_dsf(void) {
 				}
 			}
 			
+		} else if (native) {
+
+			_pack_native(optr, iptrl, d->channels == 1 ? iptrl : iptrr, 1, frames, d->lsb_first);
+
 		} else {
 			
 			if (d->channels == 1) {
 				float *iptrf = d->transfer[0];
-				dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptrl, 1, d->lsb_first, iptrf, 1);
+				_translate(frames, iptrl, NULL, 1, d->lsb_first, iptrf, NULL);
+				count = written = _decimate(frames, iptrf, NULL);
 				while (count--) {
 					double scaled = *iptrf++ * 0x7fffffff;
 					if (scaled >  2147483647.0) scaled =  2147483647.0;
@@ -316,8 +739,8 @@ static decode_state _decode_dsf(void) {
 			} else {
 				float *iptrfl = d->transfer[0];
 				float *iptrfr = d->transfer[1];
-				dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptrl, 1, d->lsb_first, iptrfl, 1);
-				dsd2pcm_translate(d->dsd2pcm_ctx[1], frames, iptrr, 1, d->lsb_first, iptrfr, 1);
+				_translate(frames, iptrl, iptrr, 1, d->lsb_first, iptrfl, iptrfr);
+				count = written = _decimate(frames, iptrfl, iptrfr);
 				while (count--) {
 					double scaledl = *iptrfl++ * 0x7fffffff;
 					double scaledr = *iptrfr++ * 0x7fffffff;
@@ -345,13 +768,13 @@ static decode_state _decode_dsf(void) {
 		}
 		
 		IF_DIRECT(
-			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
+			_buf_inc_writep(outputbuf, written * BYTES_PER_FRAME);
 		);
 		IF_PROCESS(
-			process.in_frames += frames;
+			process.in_frames += written;
 		);
 
-		LOG_SDEBUG("write %u frames", frames);
+		LOG_SDEBUG("write %u frames", written);
 	}
 	
 	// skip the other channel blocks
@@ -372,7 +795,7 @@ static decode_state _decode_dsdiff(void) {
 	// we process as little as necessary per call and only need to handle frames wrapping round streambuf
 
 	unsigned bytes_per_frame, bytes_read;
-	frames_t out, frames, count;
+	frames_t out, frames, count, written;
 	u8_t *iptr;
 	u32_t *optr;
 	u8_t tmp[WRAP_BUF_SIZE];
@@ -388,8 +811,14 @@ static decode_state _decode_dsdiff(void) {
 	
 	if (dop) {
 		bytes_per_frame = d->channels * 2;
+	} else if (native) {
+		bytes_per_frame = d->channels * native;
 	} else {
 		bytes_per_frame = d->channels;
+		// each decimated output frame takes 2^decimate frames from dsd2pcm
+		if (out && d->decimate) {
+			out = (out << d->decimate) - _decimate_pending();
+		}
 		out = min(out, BLOCK);
 	}
 	
@@ -405,21 +834,22 @@ static decode_state _decode_dsdiff(void) {
 		optr = (u32_t *)process.inbuf;
 	);
 	
-	// handle wrap around end of streambuf and partial dop frame at end of stream
-	if (!frames && bytes < bytes_per_frame) {
+	// handle wrap around end of streambuf and partial frame at end of stream
+	if (!frames && (bytes < bytes_per_frame || d->sample_bytes < bytes_per_frame)) {
+		unsigned want = min(bytes_per_frame, d->sample_bytes);
 		memset(tmp, 0x69, WRAP_BUF_SIZE); // 0x69 = dsd silence
-		memcpy(tmp, streambuf->readp, bytes);
-		if (_buf_used(streambuf) > bytes_per_frame) {
-			memcpy(tmp + bytes, streambuf->buf, bytes_per_frame - bytes);
-			bytes_read = bytes_per_frame;
+		memcpy(tmp, streambuf->readp, min(bytes, want));
+		if (bytes < want && _buf_used(streambuf) >= want) {
+			memcpy(tmp + bytes, streambuf->buf, want - bytes);
+			bytes_read = want;
 		} else {
-			bytes_read = bytes;
+			bytes_read = min(bytes, want);
 		}
 		iptr = tmp;
 		frames = 1;
 	}
 	
-	count = frames;
+	count = written = frames;
 	
 	if (dop) {
 		
@@ -437,11 +867,16 @@ static decode_state _decode_dsdiff(void) {
 			}
 		}
 		
+	} else if (native) {
+
+		_pack_native(optr, iptr, d->channels == 1 ? iptr : iptr + 1, d->channels, frames, false);
+
 	} else {
 		
 		if (d->channels == 1) {
 			float *iptrf = d->transfer[0];
-			dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptr, 1, 0, iptrf, 1);
+			_translate(frames, iptr, NULL, 1, false, iptrf, NULL);
+			count = written = _decimate(frames, iptrf, NULL);
 			while (count--) {
 				double scaled = *iptrf++ * 0x7fffffff;
 				if (scaled >  2147483647.0) scaled =  2147483647.0;
@@ -452,8 +887,8 @@ static decode_state _decode_dsdiff(void) {
 		} else {
 			float *iptrfl = d->transfer[0];
 			float *iptrfr = d->transfer[1];
-			dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptr,     d->channels, 0, iptrfl, 1);
-			dsd2pcm_translate(d->dsd2pcm_ctx[1], frames, iptr + 1, d->channels, 0, iptrfr, 1);
+			_translate(frames, iptr, iptr + 1, d->channels, false, iptrfl, iptrfr);
+			count = written = _decimate(frames, iptrfl, iptrfr);
 			while (count--) {
 				double scaledl = *iptrfl++ * 0x7fffffff;
 				double scaledr = *iptrfr++ * 0x7fffffff;
@@ -478,18 +913,55 @@ static decode_state _decode_dsdiff(void) {
 	}
 	
 	IF_DIRECT(
-		_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
+		_buf_inc_writep(outputbuf, written * BYTES_PER_FRAME);
 			  );
 	IF_PROCESS(
-		process.in_frames = frames;
+		process.in_frames = written;
 	);
 	
-	LOG_SDEBUG("write %u frames", frames);
+	LOG_SDEBUG("write %u frames", written);
 
 	return DECODE_RUNNING;
 }
 
 
+// local seek - dsf audio is in fixed size blocks per channel and dsdiff is interleaved by byte
+// so the offset of any byte of samples is known without an index
+static bool _dsd_seek(void) {
+	u64_t byte = (u64_t)stream.seek_ms * (d->sample_rate / 8) / 1000;
+	u64_t offset, per_channel;
+
+	stream.seek_ms = 0;
+
+	// dop frames are two bytes of samples and native dsd frames up to four
+	byte &= ~(u64_t)3;
+
+	per_channel = d->type == DSF ? d->sample_bytes : d->sample_bytes / d->channels;
+
+	if (!d->channels || byte >= per_channel || (d->type == DSF && !d->block_size)) {
+		LOG_WARN("seek beyond end of audio");
+		return false;
+	}
+
+	if (d->type == DSF) {
+		u64_t block = byte / d->block_size;
+		offset = block * d->block_size * d->channels;
+		if (!_stream_seek(_stream_tell() + offset)) {
+			return false;
+		}
+		d->block_skip = (u32_t)(byte - block * d->block_size);
+		d->sample_bytes -= byte;
+	} else {
+		offset = byte * d->channels;
+		if (!_stream_seek(_stream_tell() + offset)) {
+			return false;
+		}
+		d->sample_bytes -= offset;
+	}
+
+	return true;
+}
+
 static decode_state dsd_decode(void) {
 	decode_state ret;
 
@@ -512,6 +984,7 @@ static decode_state dsd_decode(void) {
 	}
 
 	if (decode.new_stream) {
+		bool seeked = false;
 		int r = _read_header();
 		if (r < 1) {
 			UNLOCK_S;
@@ -523,6 +996,10 @@ static decode_state dsd_decode(void) {
 		}
 		// otherwise got to start of audio
 
+		if (stream.seek_ms) {
+			seeked = _dsd_seek();
+		}
+
 		LOCK_O;
 
 		LOG_INFO("setting track_start");
@@ -530,26 +1007,62 @@ static decode_state dsd_decode(void) {
 
 		dop = output.has_dop;
 
+		switch (output.dsd_fmt) {
+		case DSD_U8:
+			native = 1; break;
+		case DSD_U16_LE:
+		case DSD_U16_BE:
+			native = 2; break;
+		case DSD_U32_LE:
+		case DSD_U32_BE:
+			native = 4; break;
+		default:
+			native = 0; break;
+		}
+
 		if (dop && d->sample_rate / 16 > output.supported_rates[0]) {
 			LOG_INFO("DOP sample rate too high for device - converting to PCM");
 			dop = false;
 		}
 
-		if (dop) {
+		// supported_rates are probed for pcm formats so are not checked for native dsd, the device rejects rates it can't play when opened
+		d->decimate = 0;
+
+		if (native) {
+			LOG_INFO("DSD native output");
+			output.next_dop = false;
+			output.next_dsd = true;
+			output.next_sample_rate = d->sample_rate / (8 * native);
+			output.fade = FADE_INACTIVE;
+			decode.stats.sample_rate = output.next_sample_rate; // decode_newstream is not called for native or dop
+		} else if (dop) {
 			LOG_INFO("DOP output");
 			output.next_dop = true;
+			output.next_dsd = false;
 			output.next_sample_rate = d->sample_rate / 16;
 			output.fade = FADE_INACTIVE;
+			decode.stats.sample_rate = output.next_sample_rate;
 		} else {
 			LOG_INFO("DSD to PCM output");
 			output.next_dop = false;
-			output.next_sample_rate = decode_newstream(d->sample_rate / 8, output.supported_rates);
+			output.next_dsd = false;
+			if (!_decimate_init(d->sample_rate / 8)) {
+				LOG_ERROR("unable to malloc decimation buffers");
+				d->decimate = 0;
+			}
+			output.next_sample_rate = decode_newstream(d->sample_rate / 8 >> d->decimate, output.supported_rates);
 			if (output.fade_mode) _checkfade(true);
 		}
 	
 		decode.new_stream = false;
 
 		UNLOCK_O;
+
+		// streambuf refills from the new position before the first block is decoded
+		if (seeked) {
+			UNLOCK_S;
+			return DECODE_RUNNING;
+		}
 	}
 
 	LOCK_O_direct;
@@ -573,6 +1086,8 @@ static decode_state dsd_decode(void) {
 
 static void dsd_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	d->type = UNKNOWN;
+	d->block_skip = 0;
+	d->decimate = 0;
 
 	if (!d->dsd2pcm_ctx[0]) {
 		d->dsd2pcm_ctx[0] = dsd2pcm_init();
@@ -588,6 +1103,15 @@ static void dsd_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 }
 
 static void dsd_close(void) {
+	unsigned c, s;
+	for (c = 0; c < 2; ++c) {
+		for (s = 0; s < MAX_DECIMATE; ++s) {
+			if (d->hb[c][s].buf) {
+				free(d->hb[c][s].buf);
+				d->hb[c][s].buf = NULL;
+			}
+		}
+	}
 	if (d->dsd2pcm_ctx[0]) {
 		dsd2pcm_destroy(d->dsd2pcm_ctx[0]);
 		dsd2pcm_destroy(d->dsd2pcm_ctx[1]);
@@ -622,6 +1146,10 @@ struct codec *register_dsd(void) {
 
 	dsd2pcm_precalc();
 
+	if (dsd_threads > 1) {
+		dsd_pool_init();
+	}
+
 	LOG_INFO("using dsd to decode dsf,dff");
 	return &ret;
 }
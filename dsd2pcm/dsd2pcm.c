@@ -32,6 +32,16 @@ Additions (c) Adrian Smith, 2013 under same licence terms:
 - expose bitreverse array as dsd2pcm_bitreverse
 - expose precalc function as dsd2pcm_precalc to allow it to be initalised
 
+Additions for Squeezelite under same licence terms:
+- octets are translated from a linear history rather than a fifo, with a second set
+  of tables indexed by the bit reversed octet, so no bit reversal is needed per sample
+- dsd2pcm_translate_stereo translates both channels in one pass
+- x86 builds with gcc or clang translate 8 samples at a time with avx2 gathers when
+  the cpu supports it
+- dsd2pcm_prime sets the history from earlier octets so a channel can be split into
+  parts which are translated in parallel
+- results are identical to the original fifo implementation
+
  */
 
 #include <stdlib.h>
@@ -40,12 +50,15 @@ Additions (c) Adrian Smith, 2013 under same licence terms:
 #include "dsd2pcm.h"
 
 #define HTAPS    48             /* number of FIR constants */
-#define FIFOSIZE 16             /* must be a power of two */
-#define FIFOMASK (FIFOSIZE-1)   /* bit mask for FIFO offsets */
 #define CTABLES ((HTAPS+7)/8)   /* number of "8 MACs" lookup tables */
+#define HISTORY (CTABLES*2-1)   /* previous octets each output depends on */
+#define CHUNK    512            /* octets translated per pass through the work buffer */
 
-#if FIFOSIZE*8 < HTAPS*2
-#error "FIFOSIZE too small"
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5)
+#define AVX2 1
+#include <immintrin.h>
+#else
+#define AVX2 0
 #endif
 
 /*
@@ -120,9 +133,80 @@ static const double htaps[HTAPS] = {
 };
 
 static float ctables[CTABLES][256];
+static float rtables[CTABLES][256]; /* ctables indexed by the bit reversed octet */
 unsigned char dsd2pcm_bitreverse[256];
 static int precalculated = 0;
 
+/* buf holds HISTORY previous octets followed by the octets to translate, msb first */
+typedef void (*translate_fn)(const unsigned char *buf, size_t samples, float *dst);
+
+static void translate_block(const unsigned char *buf, size_t samples, float *dst, ptrdiff_t dst_stride)
+{
+	const unsigned char *p = buf + HISTORY;
+	int i;
+	double acc;
+	while (samples-- > 0) {
+		acc = 0;
+		for (i=0; i<CTABLES; ++i) {
+			acc += ctables[i][p[-i]] + rtables[i][p[i-HISTORY]];
+		}
+		*dst = (float)acc; dst += dst_stride;
+		++p;
+	}
+}
+
+static void translate_generic(const unsigned char *buf, size_t samples, float *dst)
+{
+	translate_block(buf, samples, dst, 1);
+}
+
+/* both channels in one loop gives the cpu two independent chains of table loads */
+static void translate_stereo_generic(const unsigned char *bufl, const unsigned char *bufr, size_t samples, float *dstl, float *dstr)
+{
+	const unsigned char *pl = bufl + HISTORY;
+	const unsigned char *pr = bufr + HISTORY;
+	int i;
+	double accl, accr;
+	while (samples-- > 0) {
+		accl = accr = 0;
+		for (i=0; i<CTABLES; ++i) {
+			accl += ctables[i][pl[-i]] + rtables[i][pl[i-HISTORY]];
+			accr += ctables[i][pr[-i]] + rtables[i][pr[i-HISTORY]];
+		}
+		*dstl++ = (float)accl;
+		*dstr++ = (float)accr;
+		++pl;
+		++pr;
+	}
+}
+
+#if AVX2
+/* 8 outputs per iteration, each lane adds the same table entries in the same order as translate_block */
+__attribute__((target("avx2")))
+static void translate_avx2(const unsigned char *buf, size_t samples, float *dst)
+{
+	const unsigned char *p = buf + HISTORY;
+	size_t s;
+	int i;
+	for (s=0; s+8<=samples; s+=8, p+=8, dst+=8) {
+		__m256d lo = _mm256_setzero_pd();
+		__m256d hi = _mm256_setzero_pd();
+		for (i=0; i<CTABLES; ++i) {
+			__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p - i)));
+			__m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + i - HISTORY)));
+			__m256 t = _mm256_add_ps(_mm256_i32gather_ps(ctables[i], a, 4), _mm256_i32gather_ps(rtables[i], b, 4));
+			lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(t)));
+			hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(t, 1)));
+		}
+		_mm_storeu_ps(dst, _mm256_cvtpd_ps(lo));
+		_mm_storeu_ps(dst + 4, _mm256_cvtpd_ps(hi));
+	}
+	translate_block(p - HISTORY, samples - s, dst, 1);
+}
+#endif
+
+static translate_fn translate = translate_generic;
+
 void dsd2pcm_precalc(void)
 {
 	int t, e, m, k;
@@ -144,13 +228,23 @@ void dsd2pcm_precalc(void)
 			ctables[CTABLES-1-t][e] = (float)acc;
 		}
 	}
+	for (t=0; t<CTABLES; ++t) {
+		for (e=0; e<256; ++e) {
+			rtables[t][e] = ctables[t][dsd2pcm_bitreverse[e]];
+		}
+	}
+#if AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		translate = translate_avx2;
+	}
+#endif
 	precalculated = 1;
 }
 
 struct dsd2pcm_ctx_s
 {
-	unsigned char fifo[FIFOSIZE];
-	unsigned fifopos;
+	unsigned char hist[HISTORY];
 };
 
 extern dsd2pcm_ctx* dsd2pcm_init()
@@ -180,14 +274,30 @@ extern dsd2pcm_ctx* dsd2pcm_clone(dsd2pcm_ctx* ptr)
 extern void dsd2pcm_reset(dsd2pcm_ctx* ptr)
 {
 	int i;
-	for (i=0; i<FIFOSIZE; ++i)
-		ptr->fifo[i] = 0x69; /* my favorite silence pattern */
-	ptr->fifopos = 0;
+	for (i=0; i<HISTORY; ++i)
+		ptr->hist[i] = 0x69; /* my favorite silence pattern */
 	/* 0x69 = 01101001
 	 * This pattern "on repeat" makes a low energy 352.8 kHz tone
 	 * and a high energy 1.0584 MHz tone which should be filtered
 	 * out completely by any playback system --> silence
 	 */
+	/* the fifo implementation used its oldest silence octets without
+	 * bit reversing them, keep that so the output is unchanged */
+	for (i=0; i<CTABLES-1; ++i)
+		ptr->hist[i] = dsd2pcm_bitreverse[0x69];
+}
+
+/* copy octets after the history in the work buffer, msb first */
+static void load(unsigned char *buf, const unsigned char *src, ptrdiff_t src_stride, int lsbf, size_t n)
+{
+	size_t i;
+	if (src_stride == 1 && !lsbf) {
+		memcpy(buf, src, n);
+	} else if (lsbf) {
+		for (i=0; i<n; ++i, src+=src_stride) buf[i] = dsd2pcm_bitreverse[*src];
+	} else {
+		for (i=0; i<n; ++i, src+=src_stride) buf[i] = *src;
+	}
 }
 
 extern void dsd2pcm_translate(
@@ -197,28 +307,64 @@ extern void dsd2pcm_translate(
 	int lsbf,
 	float *dst, ptrdiff_t dst_stride)
 {
-	unsigned ffp;
-	unsigned i;
-	unsigned bite1, bite2;
-	unsigned char* p;
-	double acc;
-	ffp = ptr->fifopos;
-	lsbf = lsbf ? 1 : 0;
-	while (samples-- > 0) {
-		bite1 = *src & 0xFFu;
-		if (lsbf) bite1 = dsd2pcm_bitreverse[bite1];
-		ptr->fifo[ffp] = bite1; src += src_stride;
-		p = ptr->fifo + ((ffp-CTABLES) & FIFOMASK);
-		*p = dsd2pcm_bitreverse[*p & 0xFF];
-		acc = 0;
-		for (i=0; i<CTABLES; ++i) {
-			bite1 = ptr->fifo[(ffp              -i) & FIFOMASK] & 0xFF;
-			bite2 = ptr->fifo[(ffp-(CTABLES*2-1)+i) & FIFOMASK] & 0xFF;
-			acc += ctables[i][bite1] + ctables[i][bite2];
+	unsigned char buf[HISTORY+CHUNK];
+	size_t n;
+	memcpy(buf, ptr->hist, HISTORY);
+	while (samples > 0) {
+		n = samples < CHUNK ? samples : CHUNK;
+		load(buf + HISTORY, src, src_stride, lsbf, n);
+		if (dst_stride == 1) {
+			translate(buf, n, dst);
+		} else {
+			translate_block(buf, n, dst, dst_stride);
 		}
-		*dst = (float)acc; dst += dst_stride;
-		ffp = (ffp + 1) & FIFOMASK;
+		memmove(buf, buf + n, HISTORY);
+		src += n * src_stride;
+		dst += n * dst_stride;
+		samples -= n;
 	}
-	ptr->fifopos = ffp;
+	memcpy(ptr->hist, buf, HISTORY);
 }
 
+extern void dsd2pcm_translate_stereo(
+	dsd2pcm_ctx* ptrl, dsd2pcm_ctx* ptrr,
+	size_t samples,
+	const unsigned char *srcl, const unsigned char *srcr, ptrdiff_t src_stride,
+	int lsbf,
+	float *dstl, float *dstr)
+{
+	unsigned char bufl[HISTORY+CHUNK];
+	unsigned char bufr[HISTORY+CHUNK];
+	size_t n;
+	memcpy(bufl, ptrl->hist, HISTORY);
+	memcpy(bufr, ptrr->hist, HISTORY);
+	while (samples > 0) {
+		n = samples < CHUNK ? samples : CHUNK;
+		load(bufl + HISTORY, srcl, src_stride, lsbf, n);
+		load(bufr + HISTORY, srcr, src_stride, lsbf, n);
+		if (translate == translate_generic) {
+			translate_stereo_generic(bufl, bufr, n, dstl, dstr);
+		} else {
+			translate(bufl, n, dstl);
+			translate(bufr, n, dstr);
+		}
+		memmove(bufl, bufl + n, HISTORY);
+		memmove(bufr, bufr + n, HISTORY);
+		srcl += n * src_stride;
+		srcr += n * src_stride;
+		dstl += n;
+		dstr += n;
+		samples -= n;
+	}
+	memcpy(ptrl->hist, bufl, HISTORY);
+	memcpy(ptrr->hist, bufr, HISTORY);
+}
+
+
+extern void dsd2pcm_prime(
+	dsd2pcm_ctx* ptr,
+	const unsigned char *src, ptrdiff_t src_stride,
+	int lsbf)
+{
+	load(ptr->hist, src - HISTORY * src_stride, src_stride, lsbf, HISTORY);
+}
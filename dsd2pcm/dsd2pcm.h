@@ -100,6 +100,32 @@ extern void dsd2pcm_precalc(void);
  * End of addition
  */
 
+/**
+ * Additions for Squeezelite
+ * "translates" both channels of a stereo stream in one call
+ * with identical results to dsd2pcm_translate for each channel
+ * @param srcl, srcr -- pointers to first octet of each channel
+ * @param src_stride -- src pointer increment for both channels
+ * @param dstl, dstr -- output for each channel, contiguous floats
+ */
+extern void dsd2pcm_translate_stereo(dsd2pcm_ctx *ctxl, dsd2pcm_ctx *ctxr,
+	size_t samples,
+	const unsigned char *srcl, const unsigned char *srcr, ptrdiff_t src_stride,
+	int lsbitfirst,
+	float *dstl, float *dstr);
+
+/**
+ * Additions for Squeezelite
+ * sets the history of the context from the octets preceding src so that
+ * translating from src gives the same result as translating the whole
+ * stream, this lets parts of one channel be translated independently
+ * @param src -- pointer to first octet to be translated, at least 11
+ *               octets (at src_stride) before it must be readable
+ */
+extern void dsd2pcm_prime(dsd2pcm_ctx *ctx,
+	const unsigned char *src, ptrdiff_t src_stride,
+	int lsbitfirst);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
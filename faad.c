@@ -25,24 +25,23 @@
 
 #define WRAPBUF_LEN 2048
 
-struct chunk_table {
-	u32_t sample, offset;
-};
-
 struct faad {
 	NeAACDecHandle hAac;
 	u8_t type;
 	// following used for mp4 only
 	u32_t consume;
-	u32_t pos;
+	u64_t pos;
 	u32_t sample;
-	u32_t nextchunk;
-	void *stsc;
 	u32_t skip;
 	u64_t samples;
 	u64_t sttssamples;
 	bool  empty;
-	struct chunk_table *chunkinfo;
+	// playable track timing for local seek
+	u32_t mdhd_timescale;
+	u32_t timescale;
+	u32_t stts_delta;
+	// sample table of the playable track
+	struct mp4_stbl stbl;
 	// faad symbols to be dynamically loaded
 #if !LINKALL
 	NeAACDecConfigurationPtr (* NeAACDecGetCurrentConfiguration)(NeAACDecHandle);
@@ -109,13 +108,28 @@ u32_t mp4_desc_length(u8_t **buf) {
 
 // read mp4 header to extract config data
 static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_p) {
-	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
+	size_t bytes = _buf_mirror(streambuf, STREAMBUF_MIRROR);
 	char type[5];
 	u32_t len;
 
+	// count trak to find the first playable one
+	static unsigned trak, play;
+
+	// continue reading sample table entries
+	if (a->stbl.box_remain) {
+		int used = mp4_stbl_read(&a->stbl, streambuf->readp, bytes);
+		if (used < 0) {
+			return -1;
+		}
+		_buf_inc_readp(streambuf, used);
+		a->pos += used;
+		bytes -= used;
+		if (a->stbl.box_remain) {
+			return 0;
+		}
+	}
+
 	while (bytes >= 8) {
-		// count trak to find the first playable one
-		static unsigned trak, play;
 		u32_t consume;
 
 		len = unpackN((u32_t *)streambuf->readp);
@@ -153,12 +167,23 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 			}
 		}
 
+		// media timescale of each track, kept for the playable one when its stts is found
+		if (!strcmp(type, "mdhd") && bytes >= 32) {
+			u8_t version = *(streambuf->readp + 8);
+			a->mdhd_timescale = unpackN((u32_t *)(streambuf->readp + (version == 1 ? 28 : 20)));
+		}
+
 		// extract the total number of samples from stts
 		if (!strcmp(type, "stts") && bytes > len) {
 			u32_t i;
 			u8_t *ptr = streambuf->readp + 12;
 			u32_t entries = unpackN((u32_t *)ptr);
 			ptr += 4;
+			if (play == trak && entries) {
+				// aac frames have a fixed duration so the first entry gives it for the whole track
+				a->timescale = a->mdhd_timescale;
+				a->stts_delta = unpackN((u32_t *)(ptr + 4));
+			}
 			for (i = 0; i < entries; ++i) {
 				u32_t count = unpackN((u32_t *)ptr);
 				u32_t size = unpackN((u32_t *)(ptr + 4));
@@ -168,74 +193,28 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 			LOG_DEBUG("total number of samples contained in stts: " FMT_u64, a->sttssamples);
 		}
 
-		// stash sample to chunk info, assume it comes before stco
-		if (!strcmp(type, "stsc") && bytes > len && !a->chunkinfo) {
-			a->stsc = malloc(len - 12);
-			if (a->stsc == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			memcpy(a->stsc, streambuf->readp + 12, len - 12);
-		}
-
-		// build offsets table from stco and stored stsc
-		if (!strcmp(type, "stco") && bytes > len && play == trak) {
-			u32_t i;
-			// extract chunk offsets
-			u8_t *ptr = streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			a->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
-			if (a->chunkinfo == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			for (i = 0; i < entries; ++i) {
-				a->chunkinfo[i].offset = unpackN((u32_t *)ptr);
-				a->chunkinfo[i].sample = 0;
-				ptr += 4;
-			}
-			a->chunkinfo[i].sample = 0;
-			a->chunkinfo[i].offset = 0;
-			// fill in first sample id for each chunk from stored stsc
-			if (a->stsc) {
-				u32_t stsc_entries = unpackN((u32_t *)a->stsc);
-				u32_t sample = 0;
-				u32_t last = 0, last_samples = 0;
-				u8_t *ptr = (u8_t *)a->stsc + 4;
-				while (stsc_entries--) {
-					u32_t first = unpackN((u32_t *)ptr);
-					u32_t samples = unpackN((u32_t *)(ptr + 4));
-					if (last) {
-						for (i = last - 1; i < first - 1; ++i) {
-							a->chunkinfo[i].sample = sample;
-							sample += last_samples;
-						}
-					}
-					if (stsc_entries == 0) {
-						for (i = first - 1; i < entries; ++i) {
-							a->chunkinfo[i].sample = sample;
-							sample += samples;
-						}
-					}
-					last = first;
-					last_samples = samples;
-					ptr += 12;
-				}
-				free(a->stsc);
-				a->stsc = NULL;
-			}
+		// sample to chunk and chunk offset tables of the playable track, read incrementally from the next call
+		if (play == trak && bytes >= 16 && mp4_stbl_box(&a->stbl, type, len, unpackN((u32_t *)(streambuf->readp + 12)))) {
+			_buf_inc_readp(streambuf, 16);
+			a->pos += 16;
+			return read_mp4_header(samplerate_p, channels_p);
 		}
 
 		// found media data, advance to start of first chunk and return
 		if (!strcmp(type, "mdat")) {
-			_buf_inc_readp(streambuf, 8);
-			a->pos += 8;
-			bytes  -= 8;
+			// 64 bit box size follows the type
+			u32_t header = len == 1 ? 16 : 8;
+			if (bytes < header) {
+				break;
+			}
+			_buf_inc_readp(streambuf, header);
+			a->pos += header;
+			bytes  -= header;
 			if (play) {
-				LOG_DEBUG("type: mdat len: %u pos: %u", len, a->pos);
-				if (a->chunkinfo && a->chunkinfo[0].offset > a->pos) {
-					u32_t skip = a->chunkinfo[0].offset - a->pos; 	
+				LOG_DEBUG("type: mdat len: %u pos: " FMT_u64, len, a->pos);
+				mp4_stbl_rewind(&a->stbl);
+				if (mp4_stbl_next(&a->stbl) && a->stbl.chunk_offset > a->pos) {
+					u32_t skip = (u32_t)(a->stbl.chunk_offset - a->pos);
 					LOG_DEBUG("skipping: %u", skip);
 					if (skip <= bytes) {
 						_buf_inc_readp(streambuf, skip);
@@ -244,7 +223,8 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 						a->consume = skip;
 					}
 				}
-				a->sample = a->nextchunk = 1;
+				mp4_stbl_next(&a->stbl);
+				a->sample = 1;
 				return 1;
 			} else {
 				LOG_DEBUG("type: mdat len: %u, no playable track found", len);
@@ -296,8 +276,8 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 			_buf_inc_readp(streambuf, consume);
 			a->pos += consume;
 			bytes -= consume;
-		} else if ( !(!strcmp(type, "esds") || !strcmp(type, "stts") || !strcmp(type, "stsc") || 
-					 !strcmp(type, "stco") || !strcmp(type, "----")) ) {
+		} else if ( !(!strcmp(type, "esds") || !strcmp(type, "stts") || !strcmp(type, "----") || !strcmp(type, "mdhd") ||
+					  ((!strcmp(type, "stsc") || !strcmp(type, "stco") || !strcmp(type, "co64")) && bytes < 16)) ) {
 			LOG_DEBUG("type: %s len: %u consume: %u - partial consume: %u", type, len, consume, bytes);
 			_buf_inc_readp(streambuf, bytes);
 			a->pos += bytes;
@@ -311,6 +291,60 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 	return 0;
 }
 
+// local seek - walk the sample table to the chunk holding the aac frame before the one requested
+// decoding starts a frame early to prime the overlap and frames before the position requested are skipped
+static bool _mp4_seek(unsigned long samplerate) {
+	u64_t frames = (u64_t)stream.seek_ms * samplerate / 1000;
+	u64_t target, offset;
+	u32_t fps, sample, first;
+
+	stream.seek_ms = 0;
+
+	// output frames per aac frame, twice the stts duration when sbr doubles the rate
+	fps = a->timescale ? (u32_t)((u64_t)a->stts_delta * samplerate / a->timescale) : 0;
+
+	if (!fps || !a->stbl.chunks || (a->samples && frames >= a->samples)) {
+		LOG_WARN("can't seek to: " FMT_u64 " frames", frames);
+		return false;
+	}
+
+	// gapless encoder delay is before the start of the track
+	target = a->skip + frames;
+	sample = (u32_t)(target / fps);
+	sample = sample ? sample - 1 : 0;
+
+	mp4_stbl_rewind(&a->stbl);
+
+	do {
+		if (!mp4_stbl_next(&a->stbl)) {
+			LOG_WARN("seek beyond last chunk");
+			return false;
+		}
+	} while (a->stbl.chunk_sample + a->stbl.chunk_spc <= sample);
+
+	offset = a->stbl.chunk_offset;
+	first = a->stbl.chunk_sample;
+
+	if (!_stream_seek(offset)) {
+		return false;
+	}
+
+	// walker holds the following chunk as in normal decoding
+	mp4_stbl_next(&a->stbl);
+
+	a->sample = first + 1;
+	a->pos = offset;
+	a->consume = 0;
+	a->skip = (u32_t)(target - (u64_t)first * fps);
+	if (a->samples) {
+		a->samples -= frames;
+	}
+
+	LOG_DEBUG("seek to aac frame: %u offset: " FMT_u64 " skip: %u", first, offset, a->skip);
+
+	return true;
+}
+
 static decode_state faad_decode(void) {
 	size_t bytes_total;
 	size_t bytes_wrap;
@@ -369,20 +403,32 @@ static decode_state faad_decode(void) {
 		}
 
 		if (found == 1) {
+			bool seeked = false;
 
 			LOG_INFO("samplerate: %u channels: %u", samplerate, channels);
+
+			if (stream.seek_ms && a->type != '2') {
+				seeked = _mp4_seek(samplerate);
+			}
+
 			bytes_total = _buf_used(streambuf);
 			bytes_wrap  = min(bytes_total, _buf_cont_read(streambuf));
 
 			LOCK_O;
 			LOG_INFO("setting track_start");
 			output.next_sample_rate = decode_newstream(samplerate, output.supported_rates);
-			IF_DSD( output.next_dop = false; )
+			IF_DSD( output.next_dop = false; output.next_dsd = false; )
 			output.track_start = outputbuf->writep;
 			if (output.fade_mode) _checkfade(true);
 			decode.new_stream = false;
 			UNLOCK_O;
 
+			// streambuf refills from the new position before decoding
+			if (seeked) {
+				UNLOCK_S;
+				return DECODE_RUNNING;
+			}
+
 		} else if (found == -1) {
 
 			LOG_WARN("error reading stream header");
@@ -399,18 +445,12 @@ static decode_state faad_decode(void) {
 
 	if (bytes_wrap < WRAPBUF_LEN && bytes_total > WRAPBUF_LEN) {
 
-		// make a local copy of frames which may have wrapped round the end of streambuf
-		u8_t buf[WRAPBUF_LEN];
-		memcpy(buf, streambuf->readp, bytes_wrap);
-		memcpy(buf + bytes_wrap, streambuf->buf, WRAPBUF_LEN - bytes_wrap);
-
-		iptr = NEAAC(a, Decode, a->hAac, &info, buf, WRAPBUF_LEN);
-
-	} else {
-
-		iptr = NEAAC(a, Decode, a->hAac, &info, streambuf->readp, bytes_wrap);
+		// mirror frames which may have wrapped round the end of streambuf so they can be decoded in place
+		bytes_wrap = _buf_mirror(streambuf, WRAPBUF_LEN);
 	}
 
+	iptr = NEAAC(a, Decode, a->hAac, &info, streambuf->readp, bytes_wrap);
+
 	if (info.error) {
 		LOG_WARN("error: %u %s", info.error, NEAAC(a, GetErrorMessage, info.error));
 	}
@@ -418,12 +458,12 @@ static decode_state faad_decode(void) {
 	endstream = false;
 
 	// mp4 end of chunk - skip to next offset
-	if (a->chunkinfo && a->chunkinfo[a->nextchunk].offset && a->sample++ == a->chunkinfo[a->nextchunk].sample) {
+	if (a->stbl.chunk_valid && a->sample++ == a->stbl.chunk_sample) {
 
-		if (a->chunkinfo[a->nextchunk].offset > a->pos) {
-			u32_t skip = a->chunkinfo[a->nextchunk].offset - a->pos;
+		if (a->stbl.chunk_offset > a->pos) {
+			u32_t skip = (u32_t)(a->stbl.chunk_offset - a->pos);
 			if (skip != info.bytesconsumed) {
-				LOG_DEBUG("skipping to next chunk pos: %u consumed: %u != skip: %u", a->pos, info.bytesconsumed, skip);
+				LOG_DEBUG("skipping to next chunk pos: " FMT_u64 " consumed: %u != skip: %u", a->pos, info.bytesconsumed, skip);
 			}
 			if (bytes_total >= skip) {
 				_buf_inc_readp(streambuf, skip);
@@ -431,7 +471,7 @@ static decode_state faad_decode(void) {
 			} else {
 				a->consume = skip;
 			}
-			a->nextchunk++;
+			mp4_stbl_next(&a->stbl);
 		} else {
 			LOG_ERROR("error: need to skip backwards!");
 			endstream = true;
@@ -466,7 +506,7 @@ static decode_state faad_decode(void) {
 		u32_t skip;
 		if (a->empty) {
 			a->empty = false;
-			a->skip -= frames;
+			a->skip = a->skip > frames ? a->skip - frames : 0;
 			LOG_DEBUG("gapless: first frame empty, skipped %u frames at start", frames);
 		}
 		skip = min(frames, a->skip);
@@ -541,20 +581,14 @@ static void faad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	LOG_INFO("opening %s stream", size == '2' ? "adts" : "mp4");
 
 	a->type = size;
-	a->pos = a->consume = a->sample = a->nextchunk = 0;
+	a->pos = a->consume = a->sample = 0;
 
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-	}
-	if (a->stsc) {
-		free(a->stsc);
-	}
-	a->chunkinfo = NULL;
-	a->stsc = NULL;
+	mp4_stbl_reset(&a->stbl);
 	a->skip = 0;
 	a->samples = 0;
 	a->sttssamples = 0;
 	a->empty = false;
+	a->mdhd_timescale = a->timescale = a->stts_delta = 0;
 
 	if (a->hAac) {
 		NEAAC(a, Close, a->hAac);
@@ -574,14 +608,7 @@ static void faad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 static void faad_close(void) {
 	NEAAC(a, Close, a->hAac);
 	a->hAac = NULL;
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-		a->chunkinfo = NULL;
-	}
-	if (a->stsc) {
-		free(a->stsc);
-		a->stsc = NULL;
-	}
+	mp4_stbl_free(&a->stbl);
 }
 
 static bool load_faad() {
@@ -630,9 +657,7 @@ struct codec *register_faad(void) {
 		return NULL;
 	}
 
-	a->hAac = NULL;
-	a->chunkinfo = NULL;
-	a->stsc = NULL;
+	memset(a, 0, sizeof(struct faad));
 
 	if (!load_faad()) {
 		return NULL;
@@ -27,7 +27,7 @@
 #include <libavcodec/avcodec.h>
 
 #define READ_SIZE  4096 * 4   // this is large enough to ensure ffmpeg always gets new data when decode is called
-#define WRITE_SIZE 256 * 1024 // FIXME - make smaller, but still to absorb max wma output
+#define FRAME_SIZE 4096       // frames, default min space until the codec frame size is known
 
 // FIXME - do we need to align these params as per ffmpeg on i386? 
 #define attribute_align_arg
@@ -45,14 +45,28 @@ struct ff_s {
 	AVCodecContext *codecC;
 	AVFrame *frame;
 	AVPacket *avpkt;
+	// packet being decoded and decoded frames staged until written to outputbuf
+	AVPacket pkt_c;
+	int got_frame;
+	frames_t pending;
+	frames_t offset;
 	unsigned mmsh_bytes_left;
 	unsigned mmsh_bytes_pad;
 	unsigned mmsh_packet_len;
+	// alac fast start - mp4 parsed here and packets passed directly to the codec without avformat probing
+	bool alac_fast;
+	struct mp4_alac mp4;
+	// alac codec context kept open between tracks and flushed when the config is unchanged
+	AVCodecContext *alac_codecC;
+	u8_t alac_codec_config[ALAC_CONFIG_LEN];
 #if !LINKALL
 	// ffmpeg symbols to be dynamically loaded from libavcodec
 	unsigned (* avcodec_version)(void);
 	AVCodec * (* avcodec_find_decoder)(int);
 	int attribute_align_arg (* avcodec_open2)(AVCodecContext *, const AVCodec *, AVDictionary **);
+	AVCodecContext * (* avcodec_alloc_context3)(const AVCodec *);
+	int (* avcodec_close)(AVCodecContext *);
+	void (* avcodec_flush_buffers)(AVCodecContext *);
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
 	AVFrame * (* av_frame_alloc)(void);
 	void (* av_frame_free)(AVFrame **);
@@ -90,6 +104,8 @@ struct ff_s {
 
 static struct ff_s *ff;
 
+extern struct codec *codec;
+
 extern log_level loglevel;
 
 extern struct buffer *streambuf;
@@ -169,6 +185,19 @@ static int _parse_packlen(void) {
 static int _read_data(void *opaque, u8_t *buffer, int buf_size) {
 	size_t bytes;
 
+	if (!ff->wma_mmsh) {
+		// copy including any wrapped data without holding the mutex during the copy
+		bytes = buf_read_copy(streambuf, buffer, buf_size);
+		if (!bytes) {
+			LOCK_S;
+			ff->end_of_stream = (stream.state <= DISCONNECT && _buf_used(streambuf) == 0);
+			UNLOCK_S;
+		} else {
+			ff->end_of_stream = false;
+		}
+		return bytes;
+	}
+
 	LOCK_S;
 
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
@@ -258,311 +287,436 @@ static int _read_data(void *opaque, u8_t *buffer, int buf_size) {
 	return bytes;
 }
 
-static decode_state ff_decode(void) {
-	int r, len, got_frame;
-	AVPacket pkt_c;
-	s32_t *optr = NULL;
+static void _free_alac_codec(void) {
+	if (ff->alac_codecC) {
+		AVCODEC(ff, close, ff->alac_codecC);
+		AV(ff, freep, &ff->alac_codecC->extradata);
+		AV(ff, freep, &ff->alac_codecC);
+		ff->alac_codecC = NULL;
+	}
+}
 
-	if (decode.new_stream) {
+// parse the mp4 header and open the alac codec directly from the parsed config
+static int _alac_fast_start(void) {
+	AVCodec *codec;
+	int r;
 
-		AVIOContext *avio;
-		AVStream *av_stream;
-		AVCodec *codec;
-		int o;
-		int audio_stream = -1;
+	LOCK_S;
 
-		ff->mmsh_bytes_left = ff->mmsh_bytes_pad = ff->mmsh_packet_len = 0;
+	r = _mp4_alac_header(&ff->mp4);
 
-		if (!ff->readbuf) {
-			ff->readbuf = AV(ff, malloc, READ_SIZE +  FF_INPUT_BUFFER_PADDING_SIZE);
-		}
+	if (r == 0 && stream.state <= DISCONNECT) {
+		LOG_WARN("stream ended before mp4 header parsed");
+		r = -1;
+	}
+
+	UNLOCK_S;
+
+	if (r <= 0) {
+		return r;
+	}
+
+	codec = AVCODEC(ff, find_decoder, AV_CODEC_ID_ALAC);
+	if (!codec) {
+		LOG_ERROR("alac codec not supported by ffmpeg library");
+		return -1;
+	}
+
+	// same config as the previous track - reset the open codec rather than rebuilding it
+	if (ff->alac_codecC && !memcmp(ff->alac_codec_config, ff->mp4.config, ALAC_CONFIG_LEN)) {
+		ff->codecC = ff->alac_codecC;
+		AVCODEC(ff, flush_buffers, ff->codecC);
+		LOG_INFO("alac fast start: reusing codec context");
+		return 1;
+	}
 
-		avio = AVIO(ff, alloc_context, ff->readbuf, READ_SIZE, 0, NULL, _read_data, NULL, NULL);
-		avio->seekable = 0;
+	_free_alac_codec();
 
-		ff->formatC = AVFORMAT(ff, alloc_context);
-		if (ff->formatC == NULL) {
-			LOG_ERROR("null context");
-			return DECODE_ERROR;
+	ff->codecC = AVCODEC(ff, alloc_context3, codec);
+	if (!ff->codecC) {
+		LOG_ERROR("can't allocate codec context");
+		return -1;
+	}
+	ff->alac_codecC = ff->codecC;
+	memcpy(ff->alac_codec_config, ff->mp4.config, ALAC_CONFIG_LEN);
+
+	// alac config: frame length, version, bit depth, pb, mb, kb, channels, max run, max frame bytes, bitrate, rate
+	ff->codecC->extradata = AV(ff, malloc, ALAC_CONFIG_LEN + FF_INPUT_BUFFER_PADDING_SIZE);
+	if (!ff->codecC->extradata) {
+		LOG_ERROR("can't allocate extradata");
+		return -1;
+	}
+	memset(ff->codecC->extradata, 0, ALAC_CONFIG_LEN + FF_INPUT_BUFFER_PADDING_SIZE);
+	memcpy(ff->codecC->extradata, ff->mp4.config, ALAC_CONFIG_LEN);
+	ff->codecC->extradata_size = ALAC_CONFIG_LEN;
+	ff->codecC->bits_per_coded_sample = ff->mp4.config[17];
+	ff->codecC->channels = ff->mp4.config[21];
+	ff->codecC->sample_rate = unpackN((u32_t *)(ff->mp4.config + 32));
+
+	LOG_INFO("alac fast start: rate: %u channels: %u bits: %u samples: %u", ff->codecC->sample_rate,
+			 ff->codecC->channels, ff->codecC->bits_per_coded_sample, ff->mp4.sample_count);
+
+	if ((r = AVCODEC(ff, open2, ff->codecC, codec, NULL)) < 0) {
+		LOG_WARN("avcodec_open2: %d %s", r, av__err2str(r));
+		memset(ff->alac_codec_config, 0, ALAC_CONFIG_LEN);
+		return -1;
+	}
+
+	return 1;
+}
+
+// convert count frames from offset within the staged frame
+static void _convert_frames(s32_t *optr, frames_t offset, frames_t count) {
+	unsigned channels = ff->codecC->channels;
+	s16_t *iptr16 = (s16_t *)ff->frame->data[0] + offset * channels;
+	s32_t *iptr32 = (s32_t *)ff->frame->data[0] + offset * channels;
+	s16_t *iptr16l = (s16_t *)ff->frame->data[0] + offset;
+	s16_t *iptr16r = (s16_t *)ff->frame->data[channels > 1 ? 1 : 0] + offset;
+	s32_t *iptr32l = (s32_t *)ff->frame->data[0] + offset;
+	s32_t *iptr32r = (s32_t *)ff->frame->data[channels > 1 ? 1 : 0] + offset;
+	float *iptrfl = (float *)ff->frame->data[0] + offset;
+	float *iptrfr = (float *)ff->frame->data[channels > 1 ? 1 : 0] + offset;
+
+	if (ff->codecC->channels == 2) {
+		if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
+			while (count--) {
+				*optr++ = *iptr16++ << 16;
+				*optr++ = *iptr16++ << 16;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
+			while (count--) {
+				*optr++ = *iptr32++;
+				*optr++ = *iptr32++;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
+			while (count--) {
+				*optr++ = *iptr16l++ << 16;
+				*optr++ = *iptr16r++ << 16;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
+			while (count--) {
+				*optr++ = *iptr32l++;
+				*optr++ = *iptr32r++;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
+			while (count--) {
+				double scaledl = *iptrfl++ * 0x7fffffff;
+				double scaledr = *iptrfr++ * 0x7fffffff;
+				if (scaledl > 2147483647.0) scaledl = 2147483647.0;
+				if (scaledl < -2147483648.0) scaledl = -2147483648.0;
+				if (scaledr > 2147483647.0) scaledr = 2147483647.0;
+				if (scaledr < -2147483648.0) scaledr = -2147483648.0;
+				*optr++ = (s32_t)scaledl;
+				*optr++ = (s32_t)scaledr;
+			}
+		} else {
+			LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
 		}
+	} else if (ff->codecC->channels == 1) {
+		if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
+			while (count--) {
+				*optr++ = *iptr16   << 16;
+				*optr++ = *iptr16++ << 16;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
+			while (count--) {
+				*optr++ = *iptr32;
+				*optr++ = *iptr32++;						
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
+			while (count--) {
+				*optr++ = *iptr16l << 16;
+				*optr++ = *iptr16l++ << 16;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
+			while (count--) {
+				*optr++ = *iptr32l;
+				*optr++ = *iptr32l++;
+			}
+		} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
+			while (count--) {
+				double scaled = *iptrfl++ * 0x7fffffff;
+				if (scaled > 2147483647.0) scaled = 2147483647.0;
+				if (scaled < -2147483648.0) scaled = -2147483648.0;
+				*optr++ = (s32_t)scaled;
+				*optr++ = (s32_t)scaled;
+			}
+		} else {
+			LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
+		}
+	} else {
+		LOG_WARN("unsupported number of channels");
+	}
+}
+
+// write staged frames to outputbuf or the process buffer as space allows, returns true once all are written
+static bool _drain_frames(void) {
+	s32_t *optr = NULL;
+	frames_t f;
 
-		ff->formatC->pb = avio;
-		ff->formatC->flags |= AVFMT_FLAG_CUSTOM_IO | AVFMT_FLAG_NOPARSE;
+	LOCK_O_direct;
 
-		o = AVFORMAT(ff, open_input, &ff->formatC, "", ff->input_format, NULL);
-		if (o < 0) {
-			LOG_WARN("avformat_open_input: %d %s", o, av__err2str(o));
-			return DECODE_ERROR;
+	while (ff->pending) {
+
+		IF_DIRECT(
+			optr = (s32_t *)outputbuf->writep;
+			f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+		);
+		IF_PROCESS(
+			optr = (s32_t *)process.inbuf + process.in_frames * 2;
+			f = process.max_in_frames - process.in_frames;
+		);
+
+		f = min(f, ff->pending);
+
+		if (!f) {
+			break;
 		}
 
-		LOG_INFO("format: name:%s lname:%s", ff->formatC->iformat->name, ff->formatC->iformat->long_name);
+		_convert_frames(optr, ff->offset, f);
+
+		ff->pending -= f;
+		ff->offset += f;
+
+		IF_DIRECT(
+			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+		);
+		IF_PROCESS(
+			process.in_frames += f;
+		);
+	}
+
+	UNLOCK_O_direct;
+
+	return ff->pending == 0;
+}
+
+static decode_state ff_decode(void) {
+	int r, len;
+
+	IF_PROCESS(
+		process.in_frames = 0;
+	);
+
+	if (decode.new_stream) {
+
+		if (ff->alac_fast) {
+
+			int r = _alac_fast_start();
+			if (r < 0) {
+				return DECODE_ERROR;
+			}
+			if (r == 0) {
+				return DECODE_RUNNING;
+			}
+
+		} else {
+
+			AVIOContext *avio;
+			AVStream *av_stream;
+			AVCodec *codec;
+			int o;
+			int audio_stream = -1;
+
+			ff->mmsh_bytes_left = ff->mmsh_bytes_pad = ff->mmsh_packet_len = 0;
+
+			if (!ff->readbuf) {
+				ff->readbuf = AV(ff, malloc, READ_SIZE +  FF_INPUT_BUFFER_PADDING_SIZE);
+			}
+
+			avio = AVIO(ff, alloc_context, ff->readbuf, READ_SIZE, 0, NULL, _read_data, NULL, NULL);
+			avio->seekable = 0;
+
+			ff->formatC = AVFORMAT(ff, alloc_context);
+			if (ff->formatC == NULL) {
+				LOG_ERROR("null context");
+				return DECODE_ERROR;
+			}
+
+			ff->formatC->pb = avio;
+			ff->formatC->flags |= AVFMT_FLAG_CUSTOM_IO | AVFMT_FLAG_NOPARSE;
+
+			o = AVFORMAT(ff, open_input, &ff->formatC, "", ff->input_format, NULL);
+			if (o < 0) {
+				LOG_WARN("avformat_open_input: %d %s", o, av__err2str(o));
+				return DECODE_ERROR;
+			}
+
+			LOG_INFO("format: name:%s lname:%s", ff->formatC->iformat->name, ff->formatC->iformat->long_name);
 	
-		o = AVFORMAT(ff, find_stream_info, ff->formatC, NULL);
-		if (o < 0) {
-			LOG_WARN("avformat_find_stream_info: %d %s", o, av__err2str(o));
-			return DECODE_ERROR;
-		}
+			o = AVFORMAT(ff, find_stream_info, ff->formatC, NULL);
+			if (o < 0) {
+				LOG_WARN("avformat_find_stream_info: %d %s", o, av__err2str(o));
+				return DECODE_ERROR;
+			}
 		
-		if (ff->wma && ff->wma_playstream < ff->formatC->nb_streams) {
-			if (ff->formatC->streams[ff->wma_playstream]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
-				LOG_INFO("using wma stream sent from server: %i", ff->wma_playstream);
-				audio_stream = ff->wma_playstream;
+			if (ff->wma && ff->wma_playstream < ff->formatC->nb_streams) {
+				if (ff->formatC->streams[ff->wma_playstream]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+					LOG_INFO("using wma stream sent from server: %i", ff->wma_playstream);
+					audio_stream = ff->wma_playstream;
+				}
 			}
-		}
 
-		if (audio_stream == -1) {
-			int i;
-			for (i = 0; i < ff->formatC->nb_streams; ++i) {
-				if (ff->formatC->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
-					audio_stream = i;
-					LOG_INFO("found stream: %i", i);
-					break;
+			if (audio_stream == -1) {
+				int i;
+				for (i = 0; i < ff->formatC->nb_streams; ++i) {
+					if (ff->formatC->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+						audio_stream = i;
+						LOG_INFO("found stream: %i", i);
+						break;
+					}
 				}
 			}
-		}
 
-		if (audio_stream == -1) {
-			LOG_WARN("no audio stream found");
-			return DECODE_ERROR;
-		}
+			if (audio_stream == -1) {
+				LOG_WARN("no audio stream found");
+				return DECODE_ERROR;
+			}
 
-		av_stream = ff->formatC->streams[audio_stream];
+			av_stream = ff->formatC->streams[audio_stream];
 
-		ff->codecC = av_stream->codec;
+			ff->codecC = av_stream->codec;
 
-		codec = AVCODEC(ff, find_decoder, ff->codecC->codec_id);
+			codec = AVCODEC(ff, find_decoder, ff->codecC->codec_id);
 
-		AVCODEC(ff, open2, ff->codecC, codec, NULL);
+			AVCODEC(ff, open2, ff->codecC, codec, NULL);
+		}
 
+		// frame and packet are allocated once and reused for following tracks
+		if (!ff->frame) {
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
-		ff->frame = AV(ff, frame_alloc);
+			ff->frame = AV(ff, frame_alloc);
 #else
-		ff->frame = AVCODEC(ff, alloc_frame);
+			ff->frame = AVCODEC(ff, alloc_frame);
 #endif
+		}
 
-		ff->avpkt = AV(ff, malloc, sizeof(AVPacket));
-		if (ff->avpkt == NULL) {
-			LOG_ERROR("can't allocate avpkt");
-			return DECODE_ERROR;
+		if (!ff->avpkt) {
+			ff->avpkt = AV(ff, malloc, sizeof(AVPacket));
+			if (ff->avpkt == NULL) {
+				LOG_ERROR("can't allocate avpkt");
+				return DECODE_ERROR;
+			}
 		}
 
 		AV(ff, init_packet, ff->avpkt);
 		ff->avpkt->data = NULL;
 		ff->avpkt->size = 0;
 
+		ff->pkt_c.size = 0;
+		ff->got_frame = 0;
+		ff->pending = 0;
+
+		// frames are staged so only space for one codec frame is needed to make progress
+		codec->min_space = (ff->codecC->frame_size > 0 ? ff->codecC->frame_size : FRAME_SIZE) * BYTES_PER_FRAME;
+		LOG_DEBUG("min space: %u", codec->min_space);
+
 		LOCK_O;
 		LOG_INFO("setting track_start");
 		output.next_sample_rate = decode_newstream(ff->codecC->sample_rate, output.supported_rates);
-		IF_DSD(	output.next_dop = false; )
+		IF_DSD(	output.next_dop = false; output.next_dsd = false; )
 		output.track_start = outputbuf->writep;
 		if (output.fade_mode) _checkfade(true);
 		decode.new_stream = false;
 		UNLOCK_O;
 	}
 
-	got_frame = 0;
+	// write any frames staged from the last call before decoding more
+	if (ff->pending && !_drain_frames()) {
+		return DECODE_RUNNING;
+	}
+
+	if (ff->pkt_c.size <= 0 && !ff->got_frame) {
 
-	if ((r = AV(ff, read_frame, ff->formatC, ff->avpkt)) < 0) {
-		if (r == AVERROR_EOF) {
-			if (ff->end_of_stream) {
-				LOG_INFO("decode complete");
-				return DECODE_COMPLETE;
-			} else {
-				LOG_INFO("codec end of file");
+		if (ff->alac_fast) {
+
+			if ((r = mp4_alac_packet(&ff->mp4, FF_INPUT_BUFFER_PADDING_SIZE)) <= 0) {
+				if (r < 0) {
+					LOG_INFO("decode complete");
+					return DECODE_COMPLETE;
+				}
+				return DECODE_RUNNING;
 			}
+
+			ff->avpkt->data = ff->mp4.pkt;
+			ff->avpkt->size = r;
+
 		} else {
-			LOG_ERROR("av_read_frame error: %i %s", r, av__err2str(r));
-		}
-		return DECODE_RUNNING;
-	}
 
-	// clone packet as we are adjusting it
-	pkt_c = *ff->avpkt;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57,24,102)
+			AV(ff, packet_unref, ff->avpkt);
+#else
+			AV(ff, free_packet, ff->avpkt);
+#endif
 
-	IF_PROCESS(
-		optr = (s32_t *)process.inbuf;
-		process.in_frames = 0;
-	);
+			if ((r = AV(ff, read_frame, ff->formatC, ff->avpkt)) < 0) {
+				if (r == AVERROR_EOF) {
+					if (ff->end_of_stream) {
+						LOG_INFO("decode complete");
+						return DECODE_COMPLETE;
+					} else {
+						LOG_INFO("codec end of file");
+					}
+				} else {
+					LOG_ERROR("av_read_frame error: %i %s", r, av__err2str(r));
+				}
+				return DECODE_RUNNING;
+			}
+		}
+
+		// clone packet as we are adjusting it
+		ff->pkt_c = *ff->avpkt;
+	}
 
-	while (pkt_c.size > 0 || got_frame) {
+	// decode the packet, each frame is staged in ff->frame until it has all been written
+	while (ff->pkt_c.size > 0 || ff->got_frame) {
 
-		len = AVCODEC(ff, decode_audio4, ff->codecC, ff->frame, &got_frame, &pkt_c);
+		len = AVCODEC(ff, decode_audio4, ff->codecC, ff->frame, &ff->got_frame, &ff->pkt_c);
 		if (len < 0) {
 			LOG_ERROR("avcodec_decode_audio4 error: %i %s", len, av__err2str(len));
+			ff->pkt_c.size = 0;
+			ff->got_frame = 0;
 			return DECODE_RUNNING;
 		}
 
-		pkt_c.data += len;
-		pkt_c.size -= len;
+		ff->pkt_c.data += len;
+		ff->pkt_c.size -= len;
 		
-		if (got_frame) {
-			
-			s16_t *iptr16 = (s16_t *)ff->frame->data[0];
-			s32_t *iptr32 = (s32_t *)ff->frame->data[0];
-			s16_t *iptr16l = (s16_t *)ff->frame->data[0];
-			s16_t *iptr16r = (s16_t *)ff->frame->data[1];
-			s32_t *iptr32l = (s32_t *)ff->frame->data[0];
-			s32_t *iptr32r = (s32_t *)ff->frame->data[1];
-			float *iptrfl = (float *)ff->frame->data[0];
-			float *iptrfr = (float *)ff->frame->data[1];
-
-			frames_t frames = ff->frame->nb_samples;
+		if (ff->got_frame) {
 
 			LOG_SDEBUG("got audio channels: %u samples: %u format: %u", ff->codecC->channels, ff->frame->nb_samples,
 					   ff->codecC->sample_fmt);
-			
-			LOCK_O_direct;
-
-			while (frames > 0) {
-				frames_t count;
-				frames_t f;
-				
-				IF_DIRECT(
-					optr = (s32_t *)outputbuf->writep;
-					f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-					f = min(f, frames);
-				);
-
-				IF_PROCESS(
-					if (process.in_frames + frames > process.max_in_frames) {
-						LOG_WARN("exceeded process buffer size - dropping frames");
-						break;
-					}
-					f = frames;	   
-				);
-
-				count = f;
-				
-				if (ff->codecC->channels == 2) {
-					if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
-						while (count--) {
-							*optr++ = *iptr16++ << 16;
-							*optr++ = *iptr16++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
-						while (count--) {
-							*optr++ = *iptr32++;
-							*optr++ = *iptr32++;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
-						while (count--) {
-							*optr++ = *iptr16l++ << 16;
-							*optr++ = *iptr16r++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
-						while (count--) {
-							*optr++ = *iptr32l++;
-							*optr++ = *iptr32r++;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
-						while (count--) {
-							double scaledl = *iptrfl++ * 0x7fffffff;
-							double scaledr = *iptrfr++ * 0x7fffffff;
-							if (scaledl > 2147483647.0) scaledl = 2147483647.0;
-							if (scaledl < -2147483648.0) scaledl = -2147483648.0;
-							if (scaledr > 2147483647.0) scaledr = 2147483647.0;
-							if (scaledr < -2147483648.0) scaledr = -2147483648.0;
-							*optr++ = (s32_t)scaledl;
-							*optr++ = (s32_t)scaledr;
-						}
-					} else {
-						LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
-					}
-				} else if (ff->codecC->channels == 1) {
-					if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
-						while (count--) {
-							*optr++ = *iptr16   << 16;
-							*optr++ = *iptr16++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
-						while (count--) {
-							*optr++ = *iptr32;
-							*optr++ = *iptr32++;						
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
-						while (count--) {
-							*optr++ = *iptr16l << 16;
-							*optr++ = *iptr16l++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
-						while (count--) {
-							*optr++ = *iptr32l;
-							*optr++ = *iptr32l++;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
-						while (count--) {
-							double scaled = *iptrfl++ * 0x7fffffff;
-							if (scaled > 2147483647.0) scaled = 2147483647.0;
-							if (scaled < -2147483648.0) scaled = -2147483648.0;
-							*optr++ = (s32_t)scaled;
-							*optr++ = (s32_t)scaled;
-						}
-					} else {
-						LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
-					}
-				} else {
-					LOG_WARN("unsupported number of channels");
-				}
-				
-				frames -= f;
-				
-				IF_DIRECT(
-					_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-				);
-
-				IF_PROCESS(
-					process.in_frames += f;
-				);
+
+			ff->pending = ff->frame->nb_samples;
+			ff->offset = 0;
+
+			if (!_drain_frames()) {
+				return DECODE_RUNNING;
 			}
-			
-			UNLOCK_O_direct;
 		}
 	}
 
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57,24,102)
-	AV(ff, packet_unref, ff->avpkt);
-#else
-	AV(ff, free_packet, ff->avpkt);
-#endif
-
 	return DECODE_RUNNING;
 }
 
+// release per stream state, the alac codec context, frame, packet and sample size table are kept for the next track
 static void _free_ff_data(void) {
+	ff->codecC = NULL;
+
+	mp4_alac_reset(&ff->mp4);
+
 	if (ff->formatC) {
 		if (ff->formatC->pb) AV(ff, freep, &ff->formatC->pb);
 		AVFORMAT(ff, free_context, ff->formatC);
 		ff->formatC = NULL;
 	}
 
-	if (ff->frame) {
-		// ffmpeg version dependant free function
-#if !LINKALL
-    #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
-		ff->av_frame_free ? AV(ff, frame_free, &ff->frame) : AV(ff, freep, &ff->frame);
-    #else
-		ff->avcodec_free_frame ? AVCODEC(ff, free_frame, &ff->frame) : AV(ff, freep, &ff->frame);
-    #endif
-#elif LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54,28,0)
-    #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
-		AV(ff, frame_free, &ff->frame);
-    #else
-		AVCODEC(ff, free_frame, &ff->frame);
-    #endif
-#else
-		AV(ff, freep, &ff->frame);
-#endif
-		ff->frame = NULL;
-	}
-
 	if (ff->avpkt) {
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57,24,102)
 		AV(ff, packet_unref, ff->avpkt);
 #else
 		AV(ff, free_packet, ff->avpkt);
 #endif
-		AV(ff, freep, &ff->avpkt);
-		ff->avpkt = NULL;
 	}
 }
 
@@ -575,6 +729,7 @@ static void ff_open_wma(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	}
 
 	ff->wma = true;
+	ff->alac_fast = false;
 	ff->wma_mmsh = size - '0';
 	ff->wma_playstream = rate - 1;
 	ff->wma_metadatastream = chan != '?' ? chan : 0;
@@ -585,19 +740,46 @@ static void ff_open_wma(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 static void ff_open_alac(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	_free_ff_data();
 
-	ff->input_format = AV(ff, find_input_format, "mp4");
-	if (ff->input_format == NULL) {
-		LOG_ERROR("mp4 format not supported by ffmpeg library");
-	}
+	// mp4 is parsed here so avformat is not used for alac
+	ff->input_format = NULL;
 
 	ff->wma = false;
 	ff->wma_mmsh = 0;
+	ff->alac_fast = true;
 
 	LOG_INFO("open alac");
 }
 
 static void ff_close(void) {
 	_free_ff_data();
+	_free_alac_codec();
+
+	mp4_alac_free(&ff->mp4);
+
+	if (ff->frame) {
+		// ffmpeg version dependant free function
+#if !LINKALL
+    #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
+		ff->av_frame_free ? AV(ff, frame_free, &ff->frame) : AV(ff, freep, &ff->frame);
+    #else
+		ff->avcodec_free_frame ? AVCODEC(ff, free_frame, &ff->frame) : AV(ff, freep, &ff->frame);
+    #endif
+#elif LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54,28,0)
+    #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
+		AV(ff, frame_free, &ff->frame);
+    #else
+		AVCODEC(ff, free_frame, &ff->frame);
+    #endif
+#else
+		AV(ff, freep, &ff->frame);
+#endif
+		ff->frame = NULL;
+	}
+
+	if (ff->avpkt) {
+		AV(ff, freep, &ff->avpkt);
+		ff->avpkt = NULL;
+	}
 
 	if (ff->readbuf) {
 		AV(ff, freep, &ff->readbuf); 
@@ -637,6 +819,9 @@ static bool load_ff() {
 	ff->avcodec_version = dlsym(handle_codec, "avcodec_version");
 	ff->avcodec_find_decoder = dlsym(handle_codec, "avcodec_find_decoder");
 	ff->avcodec_open2 = dlsym(handle_codec, "avcodec_open2");
+	ff->avcodec_alloc_context3 = dlsym(handle_codec, "avcodec_alloc_context3");
+	ff->avcodec_close = dlsym(handle_codec, "avcodec_close");
+	ff->avcodec_flush_buffers = dlsym(handle_codec, "avcodec_flush_buffers");
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,28,1)
 	ff->av_frame_alloc = dlsym(handle_codec, "av_frame_alloc");
 	ff->av_frame_free = dlsym(handle_codec, "av_frame_free");
@@ -745,7 +930,7 @@ struct codec *register_ff(const char *codec) {
 			'w',         // id
 			"wma,wmap,wmal", // types
 			READ_SIZE,   // min read
-			WRITE_SIZE,  // min space
+			FRAME_SIZE * BYTES_PER_FRAME, // min space
 			ff_open_wma, // open
 			ff_close,    // close
 			ff_decode,   // decode
@@ -761,7 +946,7 @@ struct codec *register_ff(const char *codec) {
 			'l',         // id
 			"alc",       // types
 			READ_SIZE,   // min read
-			WRITE_SIZE,  // min space
+			FRAME_SIZE * BYTES_PER_FRAME, // min space
 			ff_open_alac,// open
 			ff_close,    // close
 			ff_decode,   // decode
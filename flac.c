@@ -24,6 +24,11 @@
 
 struct flac {
 	FLAC__StreamDecoder *decoder;
+	// stream info and seek state for local files
+	unsigned sample_rate;
+	FLAC__uint64 total_samples;
+	bool seeking;
+	bool started; // seek position has been read for this track
 #if !LINKALL
 	// FLAC symbols to be dynamically loaded
 	const char **FLAC__StreamDecoderErrorStatusString;
@@ -44,6 +49,8 @@ struct flac {
 		void *client_data
 	);
 	FLAC__bool (* FLAC__stream_decoder_process_single)(FLAC__StreamDecoder *decoder);
+	FLAC__bool (* FLAC__stream_decoder_process_until_end_of_metadata)(FLAC__StreamDecoder *decoder);
+	FLAC__bool (* FLAC__stream_decoder_seek_absolute)(FLAC__StreamDecoder *decoder, FLAC__uint64 sample);
 	FLAC__StreamDecoderState (* FLAC__stream_decoder_get_state)(const FLAC__StreamDecoder *decoder);
 #endif
 };
@@ -85,31 +92,84 @@ extern struct processstate process;
 
 static FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *want, void *client_data) {
 	size_t bytes;
-	bool end;
+	bool end = false;
 
-	LOCK_S;
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	bytes = min(bytes, *want);
-	end = (stream.state <= DISCONNECT && bytes == 0);
+	// copy as much as libflac wants including any data wrapping round the end of streambuf
+	bytes = buf_read_copy(streambuf, buffer, *want);
 
-	memcpy(buffer, streambuf->readp, bytes);
-	_buf_inc_readp(streambuf, bytes);
-	UNLOCK_S;
+	if (!bytes) {
+		LOCK_S;
+		end = (stream.state <= DISCONNECT && _buf_used(streambuf) == 0);
+		UNLOCK_S;
+	}
 
 	*want = bytes;
 
 	return end ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
+// seek, tell and length are only supported for local files and seek only while resolving a local seek
+// so a decoder reset when the next track is opened does not move the stream
+static FLAC__StreamDecoderSeekStatus seek_cb(const FLAC__StreamDecoder *decoder, FLAC__uint64 offset, void *client_data) {
+	bool ok;
+
+	if (!f->seeking) {
+		return FLAC__STREAM_DECODER_SEEK_STATUS_UNSUPPORTED;
+	}
+
+	LOCK_S;
+	ok = _stream_seek(offset);
+	UNLOCK_S;
+
+	return ok ? FLAC__STREAM_DECODER_SEEK_STATUS_OK : FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+}
+
+static FLAC__StreamDecoderTellStatus tell_cb(const FLAC__StreamDecoder *decoder, FLAC__uint64 *offset, void *client_data) {
+	FLAC__StreamDecoderTellStatus status = FLAC__STREAM_DECODER_TELL_STATUS_UNSUPPORTED;
+
+	LOCK_S;
+	if (stream.file_size) {
+		*offset = _stream_tell();
+		status = FLAC__STREAM_DECODER_TELL_STATUS_OK;
+	}
+	UNLOCK_S;
+
+	return status;
+}
+
+static FLAC__StreamDecoderLengthStatus length_cb(const FLAC__StreamDecoder *decoder, FLAC__uint64 *length, void *client_data) {
+	FLAC__StreamDecoderLengthStatus status = FLAC__STREAM_DECODER_LENGTH_STATUS_UNSUPPORTED;
+
+	LOCK_S;
+	if (stream.file_size) {
+		*length = stream.file_size;
+		status = FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+	}
+	UNLOCK_S;
+
+	return status;
+}
+
+static void metadata_cb(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+	if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+		f->sample_rate = metadata->data.stream_info.sample_rate;
+		f->total_samples = metadata->data.stream_info.total_samples;
+	}
+}
+
 static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
 											   const FLAC__int32 *const buffer[], void *client_data) {
 
 	size_t frames = frame->header.blocksize;
 	unsigned bits_per_sample = frame->header.bits_per_sample;
 	unsigned channels = frame->header.channels;
+	const s32_t *iptr[MAX_CHANNELS];
+	unsigned i;
 
-	FLAC__int32 *lptr = (FLAC__int32 *)buffer[0];
-	FLAC__int32 *rptr = (FLAC__int32 *)buffer[channels > 1 ? 1 : 0];
+	// flac supports at most 8 channels so iptr can not overflow
+	for (i = 0; i < channels; ++i) {
+		iptr[i] = (const s32_t *)buffer[i];
+	}
 	
 	if (decode.new_stream) {
 		LOCK_O;
@@ -118,14 +178,17 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 		decode.new_stream = false;
 
 #if DSD
-		if (output.has_dop && bits_per_sample == 24 && is_flac_dop((u32_t *)lptr, (u32_t *)rptr, frames)) {
+		if (output.has_dop && bits_per_sample == 24 && is_flac_dop((u32_t *)iptr[0], (u32_t *)iptr[channels > 1 ? 1 : 0], frames)) {
 			LOG_INFO("file contains DOP");
 			output.next_dop = true;
+			output.next_dsd = false;
 			output.next_sample_rate = frame->header.sample_rate;
 			output.fade = FADE_INACTIVE;
+			decode.stats.sample_rate = output.next_sample_rate; // decode_newstream is not called for dop
 		} else {
 			output.next_sample_rate = decode_newstream(frame->header.sample_rate, output.supported_rates);
 			output.next_dop = false;
+			output.next_dsd = false;
 			if (output.fade_mode) _checkfade(true);
 		}
 #else
@@ -140,7 +203,6 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 
 	while (frames > 0) {
 		frames_t f;
-		frames_t count;
 		s32_t *optr;
 
 		IF_DIRECT( 
@@ -154,32 +216,17 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 
 		f = min(f, frames);
 
-		count = f;
-
-		if (bits_per_sample == 8) {
-			while (count--) {
-				*optr++ = *lptr++ << 24;
-				*optr++ = *rptr++ << 24;
-			}
-		} else if (bits_per_sample == 16) {
-			while (count--) {
-				*optr++ = *lptr++ << 16;
-				*optr++ = *rptr++ << 16;
-			}
-		} else if (bits_per_sample == 24) {
-			while (count--) {
-				*optr++ = *lptr++ << 8;
-				*optr++ = *rptr++ << 8;
-			}
-		} else if (bits_per_sample == 32) {
-			while (count--) {
-				*optr++ = *lptr++;
-				*optr++ = *rptr++;
-			}
+		if (bits_per_sample >= 8 && bits_per_sample <= 32) {
+			// channels > 2 are downmixed to stereo
+			convert_s32p(optr, iptr, channels, 32 - bits_per_sample, f);
 		} else {
 			LOG_ERROR("unsupported bits per sample: %u", bits_per_sample);
 		}
 
+		for (i = 0; i < channels; ++i) {
+			iptr[i] += f;
+		}
+
 		frames -= f;
 
 		IF_DIRECT(
@@ -206,7 +253,10 @@ static void flac_open(u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t en
 	} else {
 		f->decoder = FLAC(f, stream_decoder_new);
 	}
-	FLAC(f, stream_decoder_init_stream, f->decoder, &read_cb, NULL, NULL, NULL, NULL, &write_cb, NULL, &error_cb, NULL);
+	f->sample_rate = 0;
+	f->total_samples = 0;
+	f->started = false;
+	FLAC(f, stream_decoder_init_stream, f->decoder, &read_cb, &seek_cb, &tell_cb, &length_cb, NULL, &write_cb, &metadata_cb, &error_cb, NULL);
 }
 
 static void flac_close(void) {
@@ -214,9 +264,56 @@ static void flac_close(void) {
 	f->decoder = NULL;
 }
 
+// local seek - libflac uses the seektable when there is one and then searches for the frame holding the sample
+// requested, the write callback receives audio from exactly that sample
+static void _flac_seek(u32_t ms) {
+	FLAC__uint64 sample;
+
+	if (!FLAC(f, stream_decoder_process_until_end_of_metadata, f->decoder) || !f->sample_rate) {
+		LOG_WARN("no stream info - can't seek");
+		return;
+	}
+
+	sample = (FLAC__uint64)ms * f->sample_rate / 1000;
+
+	if (f->total_samples && sample >= f->total_samples) {
+		LOG_WARN("seek beyond end of track");
+		return;
+	}
+
+	f->seeking = true;
+	if (!FLAC(f, stream_decoder_seek_absolute, f->decoder, sample)) {
+		// decoder state is undefined after a failed seek, start again from the beginning of the file
+		LOG_WARN("seek to sample: " FMT_u64 " failed - playing from start", (u64_t)sample);
+		FLAC(f, stream_decoder_reset, f->decoder);
+	}
+	f->seeking = false;
+}
+
 static decode_state flac_decode(void) {
-	bool ok = FLAC(f, stream_decoder_process_single, f->decoder);
-	FLAC__StreamDecoderState state = FLAC(f, stream_decoder_get_state, f->decoder);
+	bool ok;
+	FLAC__StreamDecoderState state;
+
+	// a seek position can only come from the "#t=" fragment of a locally built LocalPlayer file name, stream_file sets
+	// it before decoding starts so it is read once by the first call for the track rather than taking S every call
+	if (!f->started) {
+		u32_t seek_ms;
+
+		LOCK_S;
+		seek_ms = stream.seek_ms;
+		stream.seek_ms = 0;
+		UNLOCK_S;
+
+		f->started = true;
+
+		if (seek_ms) {
+			_flac_seek(seek_ms);
+			return DECODE_RUNNING;
+		}
+	}
+
+	ok = FLAC(f, stream_decoder_process_single, f->decoder);
+	state = FLAC(f, stream_decoder_get_state, f->decoder);
 	
 	if (!ok && state != FLAC__STREAM_DECODER_END_OF_STREAM) {
 		LOG_INFO("flac error: %s", FLAC_A(f, StreamDecoderStateString)[state]);
@@ -248,6 +345,8 @@ static bool load_flac() {
 	f->FLAC__stream_decoder_delete = dlsym(handle, "FLAC__stream_decoder_delete");
 	f->FLAC__stream_decoder_init_stream = dlsym(handle, "FLAC__stream_decoder_init_stream");
 	f->FLAC__stream_decoder_process_single = dlsym(handle, "FLAC__stream_decoder_process_single");
+	f->FLAC__stream_decoder_process_until_end_of_metadata = dlsym(handle, "FLAC__stream_decoder_process_until_end_of_metadata");
+	f->FLAC__stream_decoder_seek_absolute = dlsym(handle, "FLAC__stream_decoder_seek_absolute");
 	f->FLAC__stream_decoder_get_state = dlsym(handle, "FLAC__stream_decoder_get_state");
 
 	if ((err = dlerror()) != NULL) {
@@ -278,6 +377,8 @@ struct codec *register_flac(void) {
 	}
 
 	f->decoder = NULL;
+	f->seeking = false;
+	f->started = false;
 
 	if (!load_flac()) {
 		return NULL;
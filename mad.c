@@ -27,6 +27,13 @@
 
 #define READBUF_SIZE 2048 // local buffer used by decoder: FIXME merge with any other decoders needing one?
 
+#define SCALE_BLOCK 64 // frames scaled per pass - fixed size allows the compiler to vectorise the loop
+
+#define LOWPOWER_MIN_MS 5000 // decoded audio needed before the real time factor is trusted
+
+// real time factor below which mp3 is decoded at half sample rate from the next track, 0 = disabled
+float mad_lowpower = 0;
+
 struct mad {
 	u8_t *readbuf;
 	unsigned readbuf_len;
@@ -40,6 +47,19 @@ struct mad {
 	u32_t skip;
 	u64_t samples;
 	u32_t padding;
+	// xing toc for local seek
+	bool  toc_valid;
+	u8_t  toc[100];
+	u64_t xing_pos;
+	u32_t xing_bytes;
+	u32_t xing_frames;
+	u32_t xing_rate;
+	u32_t xing_spf;
+	// low power mode selected from the measured real time factor
+	bool lowpower;
+	u32_t decode_ms;
+	u64_t decoded_frames;
+	unsigned decoded_rate;
 #if !LINKALL
 	// mad symbols to be dynamically loaded
 	void (* mad_stream_init)(struct mad_stream *);
@@ -99,6 +119,27 @@ static inline u32_t scale(mad_fixed_t sample) {
 	return (s32_t)(sample >> (MAD_F_FRACBITS + 1 - 24)) << 8;
 }
 
+// scale to interleaved output, restrict as the output never overlaps the synth buffers
+static void scale_frames(s32_t *restrict optr, const mad_fixed_t *restrict iptrl, const mad_fixed_t *restrict iptrr, size_t frames) {
+	unsigned i;
+
+	while (frames >= SCALE_BLOCK) {
+		for (i = 0; i < SCALE_BLOCK; ++i) {
+			optr[2 * i]     = scale(iptrl[i]);
+			optr[2 * i + 1] = scale(iptrr[i]);
+		}
+		optr  += SCALE_BLOCK * 2;
+		iptrl += SCALE_BLOCK;
+		iptrr += SCALE_BLOCK;
+		frames -= SCALE_BLOCK;
+	}
+
+	while (frames--) {
+		*optr++ = scale(*iptrl++);
+		*optr++ = scale(*iptrr++);
+	}
+}
+
 // check for id3.2 tag at start of file - http://id3.org/id3v2.4.0-structure, return length
 static unsigned _check_id3_tag(size_t bytes) {
 	u8_t *ptr = streambuf->readp;
@@ -119,9 +160,14 @@ static unsigned _check_id3_tag(size_t bytes) {
 static void _check_lame_header(size_t bytes) {
 	u8_t *ptr = streambuf->readp;
 
+	m->toc_valid = false;
+
 	if (*ptr == 0xff && (*(ptr+1) & 0xf0) == 0xf0 && bytes > 180) {
 
+		static const u32_t rates[3] = { 44100, 48000, 32000 };
 		u32_t frame_count = 0, enc_delay = 0, enc_padding = 0;
+		unsigned version = (*(ptr+1) >> 3) & 0x03, rate = (*(ptr+2) >> 2) & 0x03;
+		bool xing;
 		u8_t flags;
 
 		// 2 channels
@@ -132,14 +178,29 @@ static void _check_lame_header(size_t bytes) {
 			ptr += 21 + 7;
 		}
 
+		xing = ptr != streambuf->readp;
 		flags = *ptr;
 
 		if (flags & 0x01) {
 			frame_count = unpackN((u32_t *)(ptr + 1));
 			ptr += 4;
 		}
-		if (flags & 0x02) ptr += 4;
-		if (flags & 0x04) ptr += 100;
+		if (flags & 0x02) {
+			m->xing_bytes = xing ? unpackN((u32_t *)(ptr + 1)) : 0;
+			ptr += 4;
+		}
+		if (flags & 0x04) {
+			// frame duration from the header of the xing frame, mpeg 2 and 2.5 use half and quarter rates
+			if (xing && (flags & 0x01) && frame_count && rate < 3) {
+				memcpy(m->toc, ptr + 1, 100);
+				m->toc_valid = true;
+				m->xing_pos = _stream_tell();
+				m->xing_frames = frame_count;
+				m->xing_rate = version == 3 ? rates[rate] : version == 2 ? rates[rate] / 2 : rates[rate] / 4;
+				m->xing_spf = version == 3 ? 1152 : 576;
+			}
+			ptr += 100;
+		}
 		if (flags & 0x08) ptr += 4;
 
 		if (!!memcmp(ptr+1, "LAME", 4)) {
@@ -156,14 +217,69 @@ static void _check_lame_header(size_t bytes) {
 		m->skip    = enc_delay + 1152;
 		m->samples = frame_count * 1152 - enc_delay - enc_padding;
 		m->padding = enc_padding;
+
+		// counts are in output samples which are halved in low power mode
+		if (m->lowpower) {
+			m->skip /= 2;
+			m->samples /= 2;
+			m->padding /= 2;
+		}
 		
 		LOG_INFO("gapless: skip: %u samples: " FMT_u64 " delay: %u padding: %u", m->skip, m->samples, enc_delay, enc_padding);
 	}
 }
 
-static decode_state mad_decode(void) {
+// local seek - the xing toc maps a percentage of the duration to a fraction of the audio bytes, interpolated
+// between entries, this is only as accurate as the toc and decoding resumes at the next frame sync after the offset
+static bool _mad_seek(void) {
+	u32_t ms = stream.seek_ms;
+	u64_t total_ms, frames, bytes, offset;
+	float pct, fa, fb;
+	unsigned i;
+
+	stream.seek_ms = 0;
+
+	if (!m->toc_valid) {
+		LOG_WARN("no xing toc - can't seek");
+		return false;
+	}
+
+	total_ms = (u64_t)m->xing_frames * m->xing_spf * 1000 / m->xing_rate;
+	if (ms >= total_ms) {
+		LOG_WARN("seek beyond end of track");
+		return false;
+	}
+
+	pct = ms * 100.0f / total_ms;
+	i = min((unsigned)pct, 99);
+	fa = m->toc[i];
+	fb = i < 99 ? m->toc[i + 1] : 256.0f;
+	fa += (fb - fa) * (pct - i);
+
+	bytes = m->xing_bytes ? m->xing_bytes : stream.file_size - m->xing_pos;
+	offset = m->xing_pos + (u64_t)(fa * bytes / 256.0f);
+
+	if (!_stream_seek(offset)) {
+		return false;
+	}
+
+	// the encoder delay was before the start so there is nothing to skip, trim padding from the remaining samples
+	frames = (u64_t)ms * m->xing_rate / 1000;
+	if (m->lowpower) {
+		frames /= 2;
+	}
+	m->skip = 0;
+	m->samples = m->samples > frames ? m->samples - frames : 0;
+
+	LOG_DEBUG("seek to: %.1f%% offset: " FMT_u64, pct, offset);
+
+	return true;
+}
+
+static decode_state _mad_decode(void) {
 	size_t bytes;
 	bool eos = false;
+	u8_t *view = NULL;
 
 	LOCK_S;
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
@@ -182,38 +298,38 @@ static decode_state mad_decode(void) {
 			return DECODE_RUNNING;
 		}
 		if (m->checktags == 2) {
+			m->checktags = 0;
 			if (!stream.meta_interval) {
 				_check_lame_header(bytes);
+				// streambuf refills from the new position before decoding
+				if (stream.seek_ms && _mad_seek()) {
+					UNLOCK_S;
+					return DECODE_RUNNING;
+				}
 			}
-			m->checktags = 0;
 		}
 	}
 
-	if (m->stream.next_frame && m->readbuf_len) {
-		m->readbuf_len -= m->stream.next_frame - m->readbuf;
-		memmove(m->readbuf, m->stream.next_frame, m->readbuf_len);
-	}
-
-	bytes = min(bytes, READBUF_SIZE - m->readbuf_len);
-	memcpy(m->readbuf + m->readbuf_len, streambuf->readp, bytes);
-	m->readbuf_len += bytes;
-	_buf_inc_readp(streambuf, bytes);
-
-	if (stream.state <= DISCONNECT && _buf_used(streambuf) == 0) {
+	if (stream.state <= DISCONNECT && _buf_used(streambuf) <= READBUF_SIZE) {
+		// end of stream - copy the tail to readbuf so mad can read the guard bytes beyond it
+		UNLOCK_S;
 		eos = true;
 		LOG_DEBUG("end of stream");
+		m->readbuf_len = buf_read_copy(streambuf, m->readbuf, READBUF_SIZE);
 		memset(m->readbuf + m->readbuf_len, 0, MAD_BUFFER_GUARD);
 		m->readbuf_len += MAD_BUFFER_GUARD;
+		MAD(m, stream_buffer, &m->stream, m->readbuf, m->readbuf_len);
+	} else {
+		// decode in place, data wrapping round the end of streambuf is mirrored so frames are contiguous
+		UNLOCK_S;
+		bytes = buf_read_view(streambuf, &view, READBUF_SIZE);
+		MAD(m, stream_buffer, &m->stream, view, bytes);
 	}
 
-	UNLOCK_S;
-
-	MAD(m, stream_buffer, &m->stream, m->readbuf, m->readbuf_len);
-
 	while (true) {
 		size_t frames;
-		s32_t *iptrl;
-		s32_t *iptrr;
+		mad_fixed_t *iptrl;
+		mad_fixed_t *iptrr;
 		unsigned max_frames;
 
 		if (MAD(m, frame_decode, &m->frame, &m->stream) == -1) {
@@ -233,16 +349,23 @@ static decode_state mad_decode(void) {
 				ret = DECODE_RUNNING;
 			}
 			m->last_error = m->stream.error;
+			if (view) {
+				// consume frames decoded from streambuf, any partial frame is decoded again on the next call
+				buf_read_consume(streambuf, m->stream.next_frame - view);
+			}
 			return ret;
 		};
 
 		MAD(m, synth_frame, &m->synth, &m->frame);
 
+		m->decoded_frames += m->synth.pcm.length;
+		m->decoded_rate = m->synth.pcm.samplerate;
+
 		if (decode.new_stream) {
 			LOCK_O;
 			LOG_INFO("setting track_start");
 			output.next_sample_rate = decode_newstream(m->synth.pcm.samplerate, output.supported_rates);
-			IF_DSD(	output.next_dop = false; )
+			IF_DSD(	output.next_dop = false; output.next_dsd = false; )
 			output.track_start = outputbuf->writep;
 			if (output.fade_mode) _checkfade(true);
 			decode.new_stream = false;
@@ -298,7 +421,7 @@ static decode_state mad_decode(void) {
 		LOG_SDEBUG("write %u frames", frames);
 
 		while (frames > 0) {
-			size_t f, count;
+			size_t f;
 			s32_t *optr;
 
 			IF_DIRECT(
@@ -310,12 +433,9 @@ static decode_state mad_decode(void) {
 				optr = (s32_t *)((u8_t *)process.inbuf + process.in_frames * BYTES_PER_FRAME);
 			);
 
-			count = f;
-
-			while (count--) {
-				*optr++ = scale(*iptrl++);
-				*optr++ = scale(*iptrr++);
-			}
+			scale_frames(optr, iptrl, iptrr, f);
+			iptrl += f;
+			iptrr += f;
 
 			frames -= f;
 
@@ -333,19 +453,69 @@ static decode_state mad_decode(void) {
 	return eos ? DECODE_COMPLETE : DECODE_RUNNING;
 }
 
+static decode_state mad_decode(void) {
+	decode_state ret;
+	u32_t start;
+
+	if (!mad_lowpower) {
+		return _mad_decode();
+	}
+
+	// time spent decoding, compared with the audio decoded to give the real time factor
+	start = gettime_ms();
+	ret = _mad_decode();
+	m->decode_ms += gettime_ms() - start;
+
+	return ret;
+}
+
+// select low power mode for the next track from the real time factor measured on the previous one
+// half sample rate decoding roughly halves the work, so only return to full rate with margin to spare
+static void _lowpower_select(void) {
+	u32_t audio_ms;
+	float rtf;
+
+	if (!mad_lowpower || !m->decoded_rate) {
+		return;
+	}
+
+	audio_ms = (u32_t)(m->decoded_frames * 1000 / m->decoded_rate);
+
+	if (audio_ms >= LOWPOWER_MIN_MS) {
+		rtf = m->decode_ms ? (float)audio_ms / m->decode_ms : mad_lowpower * 4;
+
+		if (!m->lowpower && rtf < mad_lowpower) {
+			LOG_INFO("real time factor: %.1f - selecting low power mode", rtf);
+			m->lowpower = true;
+		} else if (m->lowpower && rtf > mad_lowpower * 3) {
+			LOG_INFO("real time factor: %.1f - selecting full rate mode", rtf);
+			m->lowpower = false;
+		}
+	}
+
+	m->decode_ms = 0;
+	m->decoded_frames = 0;
+	m->decoded_rate = 0;
+}
+
 static void mad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	if (!m->readbuf) {
 		m->readbuf = malloc(READBUF_SIZE + MAD_BUFFER_GUARD);
 	}
+	_lowpower_select();
 	m->checktags = 1;
 	m->consume = 0;
-	m->skip = MAD_DELAY;
+	m->skip = m->lowpower ? MAD_DELAY / 2 : MAD_DELAY;
 	m->samples = 0;
+	m->toc_valid = false;
+	m->xing_bytes = 0;
 	m->readbuf_len = 0;
 	m->last_error = MAD_ERROR_NONE;
 	MAD(m, stream_init, &m->stream);
 	MAD(m, frame_init, &m->frame);
 	MAD(m, synth_init, &m->synth);
+	// libmad low complexity options, half rate synthesis and no crc checks
+	mad_stream_options(&m->stream, m->lowpower ? MAD_OPTION_HALFSAMPLERATE | MAD_OPTION_IGNORECRC : 0);
 }
 
 static void mad_close(void) {
@@ -405,6 +575,10 @@ struct codec *register_mad(void) {
 
 	m->readbuf = NULL;
 	m->readbuf_len = 0;
+	m->lowpower = false;
+	m->decode_ms = 0;
+	m->decoded_frames = 0;
+	m->decoded_rate = 0;
 
 	if (!load_mad()) {
 		return NULL;
@@ -28,9 +28,9 @@
 
 #define TITLE "Squeezelite " VERSION ", Copyright 2012-2015 Adrian Smith, 2015-2016 Ralph Irving."
 
-#define CODECS_BASE "flac,pcm,mp3,ogg,aac"
+#define CODECS_BASE "flac,pcm,mp3,ogg,aac,alac"
 #if FFMPEG
-#define CODECS_FF   ",wma,alac"
+#define CODECS_FF   ",wma"
 #else
 #define CODECS_FF   ""
 #endif
@@ -39,7 +39,7 @@
 #else
 #define CODECS_DSD  ""
 #endif
-#define CODECS_MP3  " (mad,mpg for specific mp3 codec)"
+#define CODECS_MP3  " (mad,mpg for specific mp3 codec, alcn,alcf for specific alac codec)"
 
 #define CODECS CODECS_BASE CODECS_FF CODECS_DSD CODECS_MP3
 
@@ -75,6 +75,7 @@ static void usage(const char *argv0) {
 #endif
 		   "  -e <codec1>,<codec2>\tExplicitly exclude native support of one or more codecs; known codecs: " CODECS "\n"
 		   "  -f <logfile>\t\tWrite debug to logfile\n"
+		   "  -H <factor>\t\tDecode mp3 with mad at half sample rate from the next track when decoding runs slower than factor times real time\n"
 #if IR
 		   "  -i [<filename>]\tEnable lirc remote control support (lirc config file ~/.lircrc used if filename not specified)\n"
 #endif
@@ -83,6 +84,8 @@ static void usage(const char *argv0) {
 		   "  -n <name>\t\tSet the player name\n"
 		   "  -N <filename>\t\tStore player name in filename to allow server defined name changes to be shared between servers (not supported with -n)\n"
 		   "  -W\t\t\tRead wave and aiff format from header, ignore server parameters\n"
+		   "  -A <ms>[:<ppm>]\tCorrect sync errors of up to <ms> by varying playback speed by at most <ppm> (default 1000) rather than pausing or skipping\n"
+		   "  -x <matrix>\t\tDownmix matrix for multichannel sources, matrix = <l1>,<l2>,..,<lN>:<r1>,<r2>,..,<rN> gain of each source channel in the left and right outputs, default mixes front, centre and surround channels\n"
 #if ALSA
 		   "  -p <priority>\t\tSet real time priority of output thread (1-99)\n"
 #endif
@@ -103,8 +106,16 @@ static void usage(const char *argv0) {
 		   "  \t\t\t stopband_start = number in percent (Aliasing/imaging control. > passband_end),\n"
 		   "  \t\t\t phase_response = 0-100 (0 = minimum / 50 = linear / 100 = maximum)\n"
 #endif
+#if PROCESS
+		   "  -F <chain>\t\tProcessing chain, chain = <stage>[=<params>],<stage>[=<params>],.. stages run in the order given, stage = resample (params as -R, default -R params)\n"
+		   "  \t\t\t or upsample (native polyphase upsampling to the highest rate that is a simple ratio of the input, params = <taps>:<attenuation>, taps per phase default 64),\n"
+		   "  \t\t\t upsample,resample uses upsample where it can and resample otherwise, upsample is used if libsoxr is not available\n"
+#endif
 #if DSD
-		   "  -D [delay]\t\tOutput device supports DSD over PCM (DoP), delay = optional delay switching between PCM and DoP in ms\n" 
+		   "  -D [delay][:format]\tOutput device supports DSD, delay = optional delay switching between PCM and DSD in ms\n" 
+		   "  \t\t\t format = dop (default if not specified), u8, u16le, u16be, u32le or u32be for native DSD to alsa devices\n"
+		   "  -T <threads>\t\tConvert DSD to PCM using <threads> threads in parallel (default 1), for DSD256 and above on multicore cpus\n"
+		   "  -Y <rate>\t\tMaximum rate of PCM converted from DSD, e.g. 88200, 176400 or 352800 (default highest rate supported by output device)\n"
 #endif
 #if VISEXPORT
 		   "  -v \t\t\tVisualiser support\n"
@@ -231,6 +242,11 @@ int main(int argc, char **argv) {
 	char *namefile = NULL;
 	char *modelname = NULL;
 	extern bool pcm_check_header;
+	extern float mad_lowpower;
+#if DSD
+	extern unsigned dsd_threads;
+	extern unsigned dsd_pcm_rate;
+#endif
 	char *logfile = NULL;
 	u8_t mac[6];
 	unsigned stream_buf_size = STREAMBUF_SIZE;
@@ -238,6 +254,9 @@ int main(int argc, char **argv) {
 	unsigned rates[MAX_SUPPORTED_SAMPLERATES] = { 0 };
 	unsigned rate_delay = 0;
 	char *resample = NULL;
+	char *process_chain = NULL;
+	char *downmix = NULL;
+	char *varispeed = NULL;
 	char *output_params = NULL;
 	unsigned idle = 0;
 #if LINUX || FREEBSD || SUN
@@ -253,6 +272,7 @@ int main(int argc, char **argv) {
 #if DSD
 	bool dop = false;
 	unsigned dop_delay = 0;
+	dsd_format dsd_fmt = DOP;
 #endif
 #if VISEXPORT
 	bool visexport = false;
@@ -287,7 +307,7 @@ int main(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("oabcCdefmMnNpPrs"
+		if (strstr("oabcCdefHmMnNpPrsxA"
 #if ALSA
 				   "UV"
 #endif
@@ -295,8 +315,14 @@ int main(int argc, char **argv) {
  * only allow '-Z <rate>' override of maxSampleRate 
  * reported by client if built with the capability to resample!
  */
+#if PROCESS
+				   "F"
+#endif
 #if RESAMPLE
 				   "Z"
+#endif
+#if DSD
+				   "TY"
 #endif
 				   , opt) && optind < argc - 1) {
 			optarg = argv[optind + 1];
@@ -457,6 +483,15 @@ int main(int argc, char **argv) {
 		case 'W':
 			pcm_check_header = true;
 			break;
+		case 'A':
+			varispeed = optarg;
+			break;
+		case 'x':
+			downmix = optarg;
+			break;
+		case 'H':
+			mad_lowpower = (float)atof(optarg);
+			break;
 #if ALSA
 		case 'p':
 			rt_priority = atoi(optarg);
@@ -495,13 +530,40 @@ int main(int argc, char **argv) {
 			maxSampleRate = atoi(optarg);
 			break;
 #endif
+#if PROCESS
+		case 'F':
+			process_chain = optarg;
+			break;
+#endif
 #if DSD
 		case 'D':
 			dop = true;
 			if (optind < argc && argv[optind] && argv[optind][0] != '-') {
-				dop_delay = atoi(argv[optind++]);
+				char *dstr = argv[optind++];
+				char *fstr = strchr(dstr, ':');
+				dop_delay = atoi(dstr);
+				if (fstr) {
+					fstr++;
+					if (!strcmp(fstr, "dop")) dsd_fmt = DOP;
+					else if (!strcmp(fstr, "u8")) dsd_fmt = DSD_U8;
+					else if (!strcmp(fstr, "u16le")) dsd_fmt = DSD_U16_LE;
+					else if (!strcmp(fstr, "u16be")) dsd_fmt = DSD_U16_BE;
+					else if (!strcmp(fstr, "u32le")) dsd_fmt = DSD_U32_LE;
+					else if (!strcmp(fstr, "u32be")) dsd_fmt = DSD_U32_BE;
+					else {
+						fprintf(stderr, "\nInvalid DSD format: %s\n\n", fstr);
+						usage(argv[0]);
+						exit(1);
+					}
+				}
 			}
 			break;
+		case 'T':
+			dsd_threads = atoi(optarg);
+			break;
+		case 'Y':
+			dsd_pcm_rate = atoi(optarg);
+			break;
 #endif
 #if VISEXPORT
 		case 'v':
@@ -621,7 +683,7 @@ int main(int argc, char **argv) {
 	// set the output buffer size if not specified on the command line, take account of resampling
 	if (!output_buf_size) {
 		output_buf_size = OUTPUTBUF_SIZE;
-		if (resample) {
+		if (resample || process_chain) {
 			unsigned scale = 8;
 			if (rates[0]) {
 				scale = rates[0] / 44100;
@@ -682,7 +744,11 @@ int main(int argc, char **argv) {
 	}
 
 #if DSD
-	dop_init(dop, dop_delay);
+	if (dsd_fmt != DOP && (!ALSA || !strcmp(output_device, "-"))) {
+		fprintf(stderr, "Native DSD output is only supported by alsa devices, using DoP\n");
+		dsd_fmt = DOP;
+	}
+	dop_init(dop, dop_delay, dsd_fmt);
 #endif
 
 #if VISEXPORT
@@ -691,11 +757,17 @@ int main(int argc, char **argv) {
 	}
 #endif
 
+	if (varispeed) {
+		varispeed_init(log_output, varispeed);
+	}
+
+	convert_init(downmix);
+
 	decode_init(log_decode, include_codecs, exclude_codecs);
 
-#if RESAMPLE
-	if (resample) {
-		process_init(resample);
+#if PROCESS
+	if (resample || process_chain) {
+		process_init(process_chain, resample);
 	}
 #endif
 
@@ -0,0 +1,519 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2016, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// minimal mp4 parsing shared by the aac and alac decoders - the sample table of the playable track is read
+// incrementally as it may be larger than streambuf, and for alac the whole header is parsed here
+
+#include "squeezelite.h"
+
+#define OFFSETS_INITIAL 1024 // initial size of the delta coded chunk offset store
+
+extern log_level loglevel;
+
+extern struct buffer *streambuf;
+extern struct streamstate stream;
+
+#define LOCK_S   mutex_lock(streambuf->mutex)
+#define UNLOCK_S mutex_unlock(streambuf->mutex)
+
+// empty the sample table keeping its allocations for the next track
+void mp4_stbl_reset(struct mp4_stbl *t) {
+	t->stsc_len = 0;
+	t->stsc_first = 0;
+	t->offsets_len = 0;
+	t->chunks = 0;
+	t->last_offset = 0;
+	t->box = MP4_NONE;
+	t->box_remain = 0;
+	t->chunk_valid = false;
+}
+
+void mp4_stbl_free(struct mp4_stbl *t) {
+	free(t->stsc);
+	free(t->offsets);
+	t->stsc = NULL;
+	t->offsets = NULL;
+	t->stsc_size = t->offsets_size = 0;
+	mp4_stbl_reset(t);
+}
+
+// store stsc runs, dropping entries which do not change the samples per chunk
+static bool _add_stsc(struct mp4_stbl *t, u32_t first, u32_t samples) {
+	// chunk numbers start at 1 and must increase, a chunk must hold a sample
+	if (first <= t->stsc_first || !samples) {
+		LOG_WARN("bad stsc entry first: %u samples: %u", first, samples);
+		return false;
+	}
+	t->stsc_first = first;
+
+	if (t->stsc_len && t->stsc[t->stsc_len - 1].samples == samples) {
+		return true;
+	}
+	if (t->stsc_len == t->stsc_size) {
+		u32_t size = t->stsc_size ? t->stsc_size * 2 : 16;
+		struct mp4_stsc *stsc = realloc(t->stsc, size * sizeof(struct mp4_stsc));
+		if (!stsc) {
+			LOG_WARN("malloc fail");
+			return false;
+		}
+		t->stsc = stsc;
+		t->stsc_size = size;
+	}
+	t->stsc[t->stsc_len].first = first;
+	t->stsc[t->stsc_len].samples = samples;
+	t->stsc_len++;
+	return true;
+}
+
+// chunk offsets are stored as the zigzag coded delta from the previous offset in 7 bit groups
+// consecutive chunks of a track are close together so most take 2 or 3 bytes rather than 8
+static bool _add_offset(struct mp4_stbl *t, u64_t offset) {
+	u64_t delta = offset - t->last_offset;
+	u64_t zz = (delta << 1) ^ (u64_t)((s64_t)delta >> 63);
+
+	if (t->offsets_len + 10 > t->offsets_size) {
+		u32_t size = t->offsets_size ? t->offsets_size * 2 : OFFSETS_INITIAL;
+		u8_t *offsets = realloc(t->offsets, size);
+		if (!offsets) {
+			LOG_WARN("malloc fail");
+			return false;
+		}
+		t->offsets = offsets;
+		t->offsets_size = size;
+	}
+
+	while (zz >= 0x80) {
+		t->offsets[t->offsets_len++] = (u8_t)(zz | 0x80);
+		zz >>= 7;
+	}
+	t->offsets[t->offsets_len++] = (u8_t)zz;
+
+	t->last_offset = offset;
+	t->chunks++;
+	return true;
+}
+
+// start reading a stsc, stco or co64 box whose 16 byte header is at readp, returns false if type is not one of
+// these or the entry count does not match the box length
+bool mp4_stbl_box(struct mp4_stbl *t, const char *type, u32_t len, u32_t entries) {
+	enum mp4_box box = !strcmp(type, "stsc") ? MP4_STSC : !strcmp(type, "stco") ? MP4_STCO :
+		!strcmp(type, "co64") ? MP4_CO64 : MP4_NONE;
+	unsigned size = box == MP4_STSC ? 12 : box == MP4_CO64 ? 8 : 4;
+
+	if (box == MP4_NONE) {
+		return false;
+	}
+
+	if (len != 16 + (u64_t)entries * size) {
+		LOG_WARN("bad %s len: %u entries: %u", type, len, entries);
+		return false;
+	}
+
+	LOG_DEBUG("type: %s len: %u entries: %u", type, len, entries);
+
+	if (box == MP4_STSC) {
+		t->stsc_len = 0;
+		t->stsc_first = 0;
+	} else {
+		t->offsets_len = t->chunks = 0;
+		t->last_offset = 0;
+	}
+	t->box = box;
+	t->box_remain = entries;
+
+	return true;
+}
+
+// read entries of the box being read from bytes at ptr, returns the bytes used or -1 on error
+int mp4_stbl_read(struct mp4_stbl *t, const u8_t *ptr, size_t bytes) {
+	unsigned size = t->box == MP4_STSC ? 12 : t->box == MP4_CO64 ? 8 : 4;
+	int used = 0;
+
+	while (t->box_remain && bytes >= size) {
+		bool ok;
+
+		if (t->box == MP4_STSC) {
+			ok = _add_stsc(t, unpackN((u32_t *)ptr), unpackN((u32_t *)(ptr + 4)));
+		} else if (t->box == MP4_CO64) {
+			ok = _add_offset(t, (u64_t)unpackN((u32_t *)ptr) << 32 | unpackN((u32_t *)(ptr + 4)));
+		} else {
+			ok = _add_offset(t, unpackN((u32_t *)ptr));
+		}
+
+		if (!ok) {
+			return -1;
+		}
+
+		ptr += size;
+		bytes -= size;
+		used += size;
+
+		if (--t->box_remain == 0) {
+			// release unused growth space as the offsets are kept for the whole track
+			if (t->box != MP4_STSC && t->offsets_len) {
+				u8_t *offsets = realloc(t->offsets, t->offsets_len);
+				if (offsets) {
+					t->offsets = offsets;
+					t->offsets_size = t->offsets_len;
+				}
+			}
+			LOG_DEBUG("sample table read stsc runs: %u chunks: %u offset store: %u bytes", t->stsc_len, t->chunks, t->offsets_len);
+			t->box = MP4_NONE;
+		}
+	}
+
+	return used;
+}
+
+// position the walker before the first chunk
+void mp4_stbl_rewind(struct mp4_stbl *t) {
+	t->nextchunk = t->offsets_read = t->stsc_idx = 0;
+	t->chunk_offset = 0;
+	t->chunk_sample = 0;
+	t->chunk_spc = 0;
+	t->chunk_valid = false;
+}
+
+// advance the walker to the next chunk, returns false when there are no more chunks
+bool mp4_stbl_next(struct mp4_stbl *t) {
+	u64_t zz = 0;
+	unsigned shift = 0;
+	u8_t b;
+
+	if (t->nextchunk >= t->chunks || !t->stsc_len) {
+		t->chunk_valid = false;
+		return false;
+	}
+
+	do {
+		b = t->offsets[t->offsets_read++];
+		zz |= (u64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	t->chunk_offset += (zz >> 1) ^ (u64_t)-(s64_t)(zz & 1);
+
+	if (t->nextchunk) {
+		t->chunk_sample += t->chunk_spc;
+	}
+
+	// stsc chunk numbers start at 1
+	while (t->stsc_idx + 1 < t->stsc_len && t->stsc[t->stsc_idx + 1].first <= t->nextchunk + 1) {
+		t->stsc_idx++;
+	}
+	t->chunk_spc = t->stsc[t->stsc_idx].samples;
+
+	t->nextchunk++;
+	t->chunk_valid = true;
+	return true;
+}
+
+// per track state, allocations are kept for the next track
+void mp4_alac_reset(struct mp4_alac *m) {
+	m->config_found = false;
+	m->trak = m->play = 0;
+	m->sample_size = m->sample_count = m->sizes_read = 0;
+	m->sample = 0;
+	m->consume = m->pos = 0;
+	mp4_stbl_reset(&m->stbl);
+}
+
+void mp4_alac_free(struct mp4_alac *m) {
+	free(m->sample_sizes);
+	m->sample_sizes = NULL;
+	m->sample_sizes_len = 0;
+	free(m->pkt);
+	m->pkt = NULL;
+	m->pkt_len = 0;
+	mp4_stbl_free(&m->stbl);
+	mp4_alac_reset(m);
+}
+
+static void _consume(struct mp4_alac *m, u32_t by) {
+	_buf_inc_readp(streambuf, by);
+	m->pos += by;
+}
+
+// parse the mp4 header to extract the alac config, sample sizes and chunk offsets then find media data
+// called with S locked, returns 1 when positioned at the first sample, 0 if more data is needed, -1 on error
+int _mp4_alac_header(struct mp4_alac *m) {
+	size_t bytes;
+	char type[5];
+	u32_t len;
+
+	// skip the rest of a box not parsed
+	if (m->consume) {
+		u32_t consume = (u32_t)min(m->consume, min(_buf_used(streambuf), _buf_cont_read(streambuf)));
+		_consume(m, consume);
+		m->consume -= consume;
+		return 0;
+	}
+
+	// all contiguous data, with any which has wrapped mirrored after it so boxes can be read in place
+	bytes = _buf_mirror(streambuf, _buf_used(streambuf));
+
+	// sample sizes are read incrementally as stsz may be larger than the contiguous data available
+	if (m->sizes_read < m->sample_count && !m->sample_size) {
+		while (bytes >= 4 && m->sizes_read < m->sample_count) {
+			m->sample_sizes[m->sizes_read++] = unpackN((u32_t *)streambuf->readp);
+			_consume(m, 4);
+			bytes -= 4;
+		}
+		if (m->sizes_read < m->sample_count) {
+			return 0;
+		}
+	}
+
+	// as are the sample to chunk and chunk offset tables
+	if (m->stbl.box_remain) {
+		int used = mp4_stbl_read(&m->stbl, streambuf->readp, bytes);
+		if (used < 0) {
+			return -1;
+		}
+		_consume(m, used);
+		bytes -= used;
+		if (m->stbl.box_remain) {
+			return 0;
+		}
+	}
+
+	while (bytes >= 8) {
+		u32_t consume, need;
+
+		len = unpackN((u32_t *)streambuf->readp);
+		memcpy(type, streambuf->readp + 4, 4);
+		type[4] = '\0';
+
+		if (!strcmp(type, "trak")) {
+			m->trak++;
+		}
+
+		// inner alac atom holding the decoder config, the outer sample entry of the same name is longer
+		if (!strcmp(type, "alac") && len == ALAC_CONFIG_LEN && bytes >= len && !m->config_found) {
+			memcpy(m->config, streambuf->readp, ALAC_CONFIG_LEN);
+			m->config_found = true;
+			m->play = m->trak;
+		}
+
+		// sample sizes of the alac track - fixed or table read incrementally
+		if (!strcmp(type, "stsz") && bytes >= 20 && m->play && m->play == m->trak && !m->sample_count) {
+			m->sample_size = unpackN((u32_t *)(streambuf->readp + 12));
+			m->sample_count = unpackN((u32_t *)(streambuf->readp + 16));
+			m->sizes_read = 0;
+			LOG_DEBUG("stsz size: %u count: %u", m->sample_size, m->sample_count);
+			if (!m->sample_size) {
+				if ((u64_t)len != 20 + (u64_t)m->sample_count * 4) {
+					LOG_WARN("bad stsz len: %u count: %u", len, m->sample_count);
+					return -1;
+				}
+				if (m->sample_count > m->sample_sizes_len) {
+					free(m->sample_sizes);
+					m->sample_sizes = malloc(sizeof(u32_t) * m->sample_count);
+					m->sample_sizes_len = m->sample_sizes ? m->sample_count : 0;
+				}
+				if (!m->sample_sizes) {
+					LOG_WARN("malloc fail");
+					return -1;
+				}
+				_consume(m, 20);
+				return _mp4_alac_header(m);
+			}
+		}
+
+		// sample to chunk and chunk offset tables of the alac track
+		if (bytes >= 16 && m->play && m->play == m->trak &&
+			mp4_stbl_box(&m->stbl, type, len, unpackN((u32_t *)(streambuf->readp + 12)))) {
+			_consume(m, 16);
+			return _mp4_alac_header(m);
+		}
+
+		// found media data, advance to start of first chunk and return
+		if (!strcmp(type, "mdat")) {
+			// 64 bit box size follows the type
+			u32_t header = len == 1 ? 16 : 8;
+			if (bytes < header) {
+				break;
+			}
+			_consume(m, header);
+			bytes -= header;
+			if (!m->config_found || !m->sample_count) {
+				LOG_WARN("mdat before alac config or sample sizes - not streamable");
+				return -1;
+			}
+			LOG_DEBUG("type: mdat len: %u pos: " FMT_u64, len, m->pos);
+			mp4_stbl_rewind(&m->stbl);
+			if (mp4_stbl_next(&m->stbl) && m->stbl.chunk_offset > m->pos) {
+				u64_t skip = m->stbl.chunk_offset - m->pos;
+				LOG_DEBUG("skipping: " FMT_u64, skip);
+				if (skip <= bytes) {
+					_consume(m, (u32_t)skip);
+				} else {
+					m->consume = skip;
+				}
+			}
+			// walker holds the following chunk while its samples are read
+			mp4_stbl_next(&m->stbl);
+			m->sample = 0;
+			return 1;
+		}
+
+		// default to consuming entire box
+		consume = len;
+
+		// read into these boxes so reduce consume
+		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl")) {
+			consume = 8;
+		}
+		// special cases which mix data in the enclosing box which we want to read into
+		if (!strcmp(type, "stsd")) consume = 16;
+		if (!strcmp(type, "alac") && len > ALAC_CONFIG_LEN) consume = 36;
+
+		// boxes we parse wait until the part parsed is in the buffer, the tables themselves are read incrementally
+		need = !strcmp(type, "alac") ? len : !strcmp(type, "stsz") ? 20 :
+			(!strcmp(type, "stsc") || !strcmp(type, "stco") || !strcmp(type, "co64")) ? 16 : 0;
+
+		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
+		if (bytes >= consume) {
+			LOG_DEBUG("type: %s len: %u consume: %u", type, len, consume);
+			_consume(m, consume);
+			bytes -= consume;
+		} else if (bytes >= need) {
+			LOG_DEBUG("type: %s len: %u consume: %u - partial consume: %u", type, len, consume, bytes);
+			_consume(m, bytes);
+			m->consume = consume - bytes;
+			break;
+		} else {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// copy the next sample into pkt followed by pad zero bytes, returns its size, 0 if more data is needed or -1 at
+// the end of the track
+int mp4_alac_packet(struct mp4_alac *m, unsigned pad) {
+	u32_t size, bytes;
+	int ret = 0;
+
+	LOCK_S;
+
+	bytes = _buf_used(streambuf);
+
+	if (m->consume) {
+		// skipping to start of next chunk
+		u32_t consume = (u32_t)min(m->consume, bytes);
+		_consume(m, consume);
+		m->consume -= consume;
+		bytes -= consume;
+	}
+
+	if (m->sample >= m->sample_count) {
+
+		ret = -1;
+
+	} else if (!m->consume) {
+
+		size = m->sample_size ? m->sample_size : m->sample_sizes[m->sample];
+
+		if (size > m->pkt_len) {
+			free(m->pkt);
+			m->pkt = malloc(size + pad);
+			m->pkt_len = m->pkt ? size : 0;
+			if (!m->pkt) {
+				LOG_ERROR("malloc fail");
+				UNLOCK_S;
+				return -1;
+			}
+		}
+
+		if (bytes >= size) {
+			// copy packet which may wrap round the end of streambuf
+			u32_t cont = min(size, _buf_cont_read(streambuf));
+			memcpy(m->pkt, streambuf->readp, cont);
+			memcpy(m->pkt + cont, streambuf->buf, size - cont);
+			memset(m->pkt + size, 0, pad);
+			_consume(m, size);
+			m->sample++;
+			ret = size;
+
+			// end of chunk - skip to next offset
+			if (m->stbl.chunk_valid && m->sample == m->stbl.chunk_sample) {
+				if (m->stbl.chunk_offset > m->pos) {
+					m->consume = m->stbl.chunk_offset - m->pos;
+					LOG_DEBUG("skipping to next chunk pos: " FMT_u64 " skip: " FMT_u64, m->pos, m->consume);
+				} else if (m->stbl.chunk_offset < m->pos) {
+					LOG_WARN("error: need to skip backwards!");
+				}
+				mp4_stbl_next(&m->stbl);
+			}
+
+		} else if (stream.state <= DISCONNECT) {
+			LOG_INFO("stream ended with partial packet");
+			ret = -1;
+		}
+	}
+
+	UNLOCK_S;
+
+	return ret;
+}
+
+// local seek to a sample - chunk offsets and sample sizes give the exact position of every packet
+// called with S locked
+bool _mp4_alac_seek(struct mp4_alac *m, u32_t sample) {
+	u64_t offset;
+	u32_t i;
+
+	if (!m->stbl.chunks || sample >= m->sample_count) {
+		LOG_WARN("can't seek to sample: %u", sample);
+		return false;
+	}
+
+	mp4_stbl_rewind(&m->stbl);
+
+	do {
+		if (!mp4_stbl_next(&m->stbl)) {
+			LOG_WARN("seek beyond last chunk");
+			return false;
+		}
+	} while (m->stbl.chunk_sample + m->stbl.chunk_spc <= sample);
+
+	offset = m->stbl.chunk_offset;
+	for (i = m->stbl.chunk_sample; i < sample; ++i) {
+		offset += m->sample_size ? m->sample_size : m->sample_sizes[i];
+	}
+
+	if (!_stream_seek(offset)) {
+		return false;
+	}
+
+	// walker holds the following chunk as in normal decoding
+	mp4_stbl_next(&m->stbl);
+
+	m->sample = sample;
+	m->pos = offset;
+	m->consume = 0;
+
+	LOG_DEBUG("seek to sample: %u offset: " FMT_u64, sample, offset);
+
+	return true;
+}
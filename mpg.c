@@ -28,11 +28,11 @@
 
 struct mpg {
 	mpg123_handle *h;
-	bool use16bit;
+	int enc;
 #if !LINKALL
 	// mpg symbols to be dynamically loaded
 	int (* mpg123_init)(void);
-	int (* mpg123_feature)(const enum mpg123_feature_set);
+	void (* mpg123_encodings)(const int **, size_t *);
 	void (* mpg123_rates)(const long **, size_t *);
 	int (* mpg123_format_none)(mpg123_handle *);
 	int (* mpg123_format)(mpg123_handle *, long, int, int);
@@ -85,11 +85,18 @@ extern struct processstate process;
 static decode_state mpg_decode(void) {
 	size_t bytes, space, size;
 	int ret;
-	u8_t *write_buf;
+	u8_t *write_buf, *read_buf;
+	bool end;
 
+	// state is sampled before streambuf so end is only set once all data has been fed
 	LOCK_S;
+	end = (stream.state <= DISCONNECT);
+	UNLOCK_S;
+
+	// mpg123 copies its input so S is not held while decoding
+	bytes = buf_read_view(streambuf, &read_buf, READ_SIZE);
+
 	LOCK_O_direct;
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 
 	IF_DIRECT(
 		space = min(_buf_space(outputbuf), _buf_cont_write(outputbuf));
@@ -100,10 +107,9 @@ static decode_state mpg_decode(void) {
 		write_buf = process.inbuf;
 	);
 
-	bytes = min(bytes, READ_SIZE);
 	space = min(space, WRITE_SIZE);
 
-	if (m->use16bit) {
+	if (m->enc == MPG123_ENC_SIGNED_16) {
 		space = (space / BYTES_PER_FRAME) * 4;
 	}
 
@@ -112,7 +118,7 @@ static decode_state mpg_decode(void) {
 		space = 0;
 	}
 
-	ret = MPG123(m, decode, m->h, streambuf->readp, bytes, write_buf, space, &size);
+	ret = MPG123(m, decode, m->h, read_buf, bytes, write_buf, space, &size);
 
 	if (ret == MPG123_NEW_FORMAT) {
 
@@ -125,7 +131,7 @@ static decode_state mpg_decode(void) {
 			LOG_INFO("setting track_start");
 			LOCK_O_not_direct;
 			output.next_sample_rate = decode_newstream(rate, output.supported_rates);
-			IF_DSD( output.next_dop = false; )
+			IF_DSD( output.next_dop = false; output.next_dsd = false; )
 			output.track_start = outputbuf->writep;
 			if (output.fade_mode) _checkfade(true);
 			decode.new_stream = false;
@@ -136,20 +142,15 @@ static decode_state mpg_decode(void) {
 		}
 	}
 
-	// expand 16bit output to 32bit samples
-	if (m->use16bit) {
-		s16_t *iptr;
-		s32_t *optr;
-		size_t count = size / 2;
-		size = count * 4;
-		iptr = (s16_t *)write_buf + count;
-		optr = (s32_t *)write_buf + count;
-		while (count--) {
-			*--optr = *--iptr << 16;
-		}
+	// 32 bit output is written in final form, otherwise convert in place
+	if (m->enc == MPG123_ENC_SIGNED_16) {
+		convert_s16_inplace(write_buf, size / 2);
+		size *= 2;
+	} else if (m->enc == MPG123_ENC_FLOAT_32) {
+		convert_flt_inplace(write_buf, size / 4);
 	}
 
-	_buf_inc_readp(streambuf, bytes);
+	buf_read_consume(streambuf, bytes);
 
 	IF_DIRECT(
 		_buf_inc_writep(outputbuf, size);
@@ -162,14 +163,11 @@ static decode_state mpg_decode(void) {
 
 	LOG_SDEBUG("write %u frames", size / BYTES_PER_FRAME);
 
-	if (ret == MPG123_DONE || (bytes == 0 && size == 0 && stream.state <= DISCONNECT)) {
-		UNLOCK_S;
+	if (ret == MPG123_DONE || (bytes == 0 && size == 0 && end)) {
 		LOG_INFO("stream complete");
 		return DECODE_COMPLETE;
 	}
 
-	UNLOCK_S;
-
 	if (ret == MPG123_ERR) {
 		LOG_WARN("Error");
 		return DECODE_COMPLETE;
@@ -194,11 +192,11 @@ static void mpg_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 		LOG_WARN("new error: %s", MPG123(m, plain_strerror, err));
 	}
 
-	// restrict output to 32bit or 16bit signed 2 channel based on library capability
+	// restrict output to 2 channels of the encoding selected from library capability
 	MPG123(m, rates, &list, &count);
 	MPG123(m, format_none, m->h);
 	for (i = 0; i < count; i++) {
-		MPG123(m, format, m->h, list[i], 2, m->use16bit ? MPG123_ENC_SIGNED_16 : MPG123_ENC_SIGNED_32);
+		MPG123(m, format, m->h, list[i], 2, m->enc);
 	}
 
 	err = MPG123(m, open_feed, m->h);
@@ -224,7 +222,7 @@ static bool load_mpg() {
 	}
 	
 	m->mpg123_init = dlsym(handle, "mpg123_init");
-	m->mpg123_feature = dlsym(handle, "mpg123_feature");
+	m->mpg123_encodings = dlsym(handle, "mpg123_encodings");
 	m->mpg123_rates = dlsym(handle, "mpg123_rates");
 	m->mpg123_format_none = dlsym(handle, "mpg123_format_none");
 	m->mpg123_format = dlsym(handle, "mpg123_format");
@@ -247,6 +245,8 @@ static bool load_mpg() {
 }
 
 struct codec *register_mpg(void) {
+	const int *encs;
+	size_t count, i;
 	static struct codec ret = { 
 		'm',          // id
 		"mp3",        // types
@@ -270,7 +270,16 @@ struct codec *register_mpg(void) {
 
 	MPG123(m, init);
 
-	m->use16bit = MPG123(m, feature, MPG123_FEATURE_OUTPUT_32BIT);
+	// prefer signed 32bit output as it needs no conversion, then float, falling back to 16bit for old libraries
+	MPG123(m, encodings, &encs, &count);
+	m->enc = MPG123_ENC_SIGNED_16;
+	for (i = 0; i < count; i++) {
+		if (encs[i] == MPG123_ENC_SIGNED_32 || (encs[i] == MPG123_ENC_FLOAT_32 && m->enc != MPG123_ENC_SIGNED_32)) {
+			m->enc = encs[i];
+		}
+	}
+
+	LOG_INFO("output encoding: %s", m->enc == MPG123_ENC_SIGNED_32 ? "s32" : m->enc == MPG123_ENC_FLOAT_32 ? "float" : "s16");
 
 	LOG_INFO("using mpg to decode mp3");
 	return &ret;
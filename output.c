@@ -34,6 +34,7 @@ struct buffer *outputbuf = &buf;
 u8_t *silencebuf;
 #if DSD
 u8_t *silencebuf_dop;
+u8_t *silencebuf_dsd;
 #endif
 
 #define LOCK   mutex_lock(outputbuf->mutex)
@@ -127,7 +128,7 @@ frames_t _output_frames(frames_t avail) {
 					delay = output.rate_delay;
 				}
 				IF_DSD(
-				   if (output.dop != output.next_dop) {
+				   if (output.dop != output.next_dop || output.dsd != output.next_dsd) {
 					   delay = output.dop_delay;
 				   }
 				)
@@ -151,6 +152,7 @@ frames_t _output_frames(frames_t avail) {
 				output.current_sample_rate = output.next_sample_rate;
 				IF_DSD(
 				   output.dop = output.next_dop;
+				   output.dsd = output.next_dsd;
 				)
 				if (!(output.fade == FADE_ACTIVE) || !(output.fade_mode == FADE_CROSSFADE)) {
 					output.current_replay_gain = output.next_replay_gain;
@@ -164,7 +166,7 @@ frames_t _output_frames(frames_t avail) {
 		}
 
 		IF_DSD(
-			if (output.dop) {
+			if (output.dop || output.dsd) {
 				gainL = gainR = FIXED_ONE;
 			}
 		)
@@ -250,6 +252,10 @@ frames_t _output_frames(frames_t avail) {
 			}
 		}
 		
+		if (!silence) {
+			cont_frames = _varispeed_frames(cont_frames, size);
+		}
+
 		out_frames = !silence ? min(size, cont_frames) : size;
 
 		wrote = output.write_cb(out_frames, silence, gainL, gainR, cross_gain_in, cross_gain_out, &cross_ptr);
@@ -271,6 +277,10 @@ frames_t _output_frames(frames_t avail) {
 		}
 	}
 			
+#if PROCESS
+	_process_output_space();
+#endif
+
 	LOG_SDEBUG("wrote %u frames", frames);
 
 	return frames;
@@ -331,6 +341,7 @@ void _checkfade(bool start) {
 			// if default setting used and nothing in buffer attempt to resize to provide full crossfade support
 			LOG_INFO("resize outputbuf for crossfade");
 			_buf_resize(outputbuf, OUTPUTBUF_SIZE_CROSSFADE);
+			_varispeed_flush();
 #if LINUX || FREEBSD
 			touch_memory(outputbuf->buf, outputbuf->size);
 #endif			
@@ -346,7 +357,7 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 	output_buf_size = output_buf_size - (output_buf_size % BYTES_PER_FRAME);
 	LOG_DEBUG("outputbuf size: %u", output_buf_size);
 
-	buf_init(outputbuf, output_buf_size);
+	buf_init(outputbuf, output_buf_size, 0);
 	if (!outputbuf->buf) {
 		LOG_ERROR("unable to malloc output buffer");
 		exit(0);
@@ -366,6 +377,13 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 			exit(0);
 		}
 		dop_silence_frames((u32_t *)silencebuf_dop, MAX_SILENCE_FRAMES);
+
+		silencebuf_dsd = malloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
+		if (!silencebuf_dsd) {
+			LOG_ERROR("unable to malloc silence dsd buffer");
+			exit(0);
+		}
+		dsd_silence_frames((u32_t *)silencebuf_dsd, MAX_SILENCE_FRAMES);
 	)
 
 	LOG_DEBUG("idle timeout: %u", idle);
@@ -417,6 +435,7 @@ void output_close_common(void) {
 	free(silencebuf);
 	IF_DSD(
 		free(silencebuf_dop);
+		free(silencebuf_dsd);
 	)
 }
 
@@ -433,5 +452,6 @@ void output_flush(void) {
 		output.delay_active = false;
 	}
 	output.frames_played = 0;
+	_varispeed_flush();
 	UNLOCK;
 }
@@ -38,6 +38,12 @@
 static snd_pcm_format_t fmts[] = { SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16_LE,
 								   SND_PCM_FORMAT_UNKNOWN };
 
+#if DSD
+// indexed by dsd_format
+static snd_pcm_format_t dsd_fmts[] = { SND_PCM_FORMAT_UNKNOWN, SND_PCM_FORMAT_DSD_U8, SND_PCM_FORMAT_DSD_U16_LE, SND_PCM_FORMAT_DSD_U16_BE,
+									   SND_PCM_FORMAT_DSD_U32_LE, SND_PCM_FORMAT_DSD_U32_BE };
+#endif
+
 #if SL_LITTLE_ENDIAN
 #define NATIVE_FORMAT SND_PCM_FORMAT_S32_LE
 #else
@@ -52,9 +58,11 @@ static struct {
 	snd_pcm_uframes_t buffer_size;
 	snd_pcm_uframes_t period_size;
 	unsigned rate;
+	bool dsd;
 	bool mmap;
 	bool reopen;
 	u8_t *write_buf;
+	snd_pcm_uframes_t write_buf_frames;
 	const char *volume_mixer_name;
 	int volume_mixer_index;
 } alsa;
@@ -64,6 +72,7 @@ static snd_pcm_t *pcmp = NULL;
 extern u8_t *silencebuf;
 #if DSD
 extern u8_t *silencebuf_dop;
+extern u8_t *silencebuf_dsd;
 #endif
 
 static log_level loglevel;
@@ -360,7 +369,7 @@ static bool pcm_probe(const char *device) {
 	return true;
 }
 
-static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buffer, unsigned alsa_period) {
+static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buffer, unsigned alsa_period, bool dsd) {
 	int err;
 	snd_pcm_hw_params_t *hw_params;
 	snd_pcm_hw_params_alloca(&hw_params);
@@ -378,7 +387,7 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 		return -1;
 	}
 
-	LOG_INFO("opening device at: %u", sample_rate);
+	LOG_INFO("opening device at: %u%s", sample_rate, dsd ? " for native dsd" : "");
 
 	bool retry;
 	do {
@@ -425,16 +434,23 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 		alsa.mmap = false;
 	}
 
-	// set the sample format
+	// set the sample format - native dsd uses the format requested for dsd and leaves the pcm format unchanged
 	snd_pcm_format_t *fmt = alsa.format ? &alsa.format : (snd_pcm_format_t *)fmts;
+	IF_DSD(
+		if (dsd) {
+			fmt = &dsd_fmts[output.dsd_fmt];
+		}
+	)
 	do {
 		if (snd_pcm_hw_params_set_format(pcmp, hw_params, *fmt) >= 0) {
 			LOG_INFO("opened device %s using format: %s sample rate: %u mmap: %u", alsa.device, snd_pcm_format_name(*fmt), sample_rate, alsa.mmap);
-			alsa.format = *fmt;
+			if (!dsd) {
+				alsa.format = *fmt;
+			}
 			break;
 		}
-		if (alsa.format) {
-			LOG_ERROR("unable to open audio device requested format: %s", snd_pcm_format_name(alsa.format));
+		if (alsa.format || dsd) {
+			LOG_ERROR("unable to open audio device requested format: %s", snd_pcm_format_name(*fmt));
 			return -1;
 		}
 		++fmt; 
@@ -445,7 +461,7 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 	} while (*fmt != SND_PCM_FORMAT_UNKNOWN);
 
 	// set the output format to be used by _scale_and_pack
-	switch(alsa.format) {
+	switch(*fmt) {
 	case SND_PCM_FORMAT_S32_LE:
 		output.format = S32_LE; break;
 	case SND_PCM_FORMAT_S24_LE: 
@@ -454,6 +470,18 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 		output.format = S24_3LE; break;
 	case SND_PCM_FORMAT_S16_LE: 
 		output.format = S16_LE; break;
+#if DSD
+	case SND_PCM_FORMAT_DSD_U8:
+		output.format = U8; break;
+	case SND_PCM_FORMAT_DSD_U16_LE:
+		output.format = U16_LE; break;
+	case SND_PCM_FORMAT_DSD_U16_BE:
+		output.format = U16_BE; break;
+	case SND_PCM_FORMAT_DSD_U32_LE:
+		output.format = U32_LE; break;
+	case SND_PCM_FORMAT_DSD_U32_BE:
+		output.format = U32_BE; break;
+#endif
 	default: 
 		break;
 	}
@@ -513,14 +541,19 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 	// ensure we have two buffer sizes of samples before starting output
 	output.start_frames = alsa.buffer_size * 2;
 
-	// create an intermediate buffer for non mmap case for all but NATIVE_FORMAT
+	// create an intermediate buffer for non mmap case for all but NATIVE_FORMAT pcm
 	// this is used to pack samples into the output format before calling writei
-	if (!alsa.mmap && !alsa.write_buf && alsa.format != NATIVE_FORMAT) {
+	// it grows if a higher rate (such as native dsd) needs more frames than it was created for
+	// dsd builds always have it as dop silence is marked into it rather than into the shared silence buffer
+	if (!alsa.mmap && (alsa.format != NATIVE_FORMAT || DSD) && alsa.buffer_size > alsa.write_buf_frames) {
+		if (alsa.write_buf) free(alsa.write_buf);
 		alsa.write_buf = malloc(alsa.buffer_size * BYTES_PER_FRAME);
 		if (!alsa.write_buf) {
 			LOG_ERROR("unable to malloc write_buf");
+			alsa.write_buf_frames = 0;
 			return -1;
 		}
+		alsa.write_buf_frames = alsa.buffer_size;
 	}
 
 	// set params
@@ -538,6 +571,7 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 
 	// this indicates we have opened the device ok
 	alsa.rate = sample_rate;
+	alsa.dsd = dsd;
 
 	return 0;
 }
@@ -574,24 +608,42 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 	inputptr = (s32_t *) (silence ? silencebuf : outputbuf->readp);
 
 	IF_DSD(
-		if (output.dop) {
+		if (output.dop && silence) {
+			inputptr = (s32_t *) silencebuf_dop;
+		}
+		if (alsa.dsd) {
 			if (silence) {
-				inputptr = (s32_t *) silencebuf_dop;
+				inputptr = (s32_t *) silencebuf_dsd;
+			} else if (output.invert) {
+				dsd_invert((u32_t *) inputptr, out_frames);
 			}
-			update_dop((u32_t *) inputptr, out_frames, output.invert && !silence);
 		}
 	)
 
-	if (alsa.mmap || alsa.format != NATIVE_FORMAT) {
+	if (alsa.mmap || alsa.format != NATIVE_FORMAT || alsa.dsd) {
 
 		outputptr = alsa.mmap ? (areas[0].addr + (areas[0].first + offset * areas[0].step) / 8) : alsa.write_buf;
 
+#if DSD
+		if (output.dop) {
+			_scale_and_pack_dop_frames(outputptr, inputptr, out_frames, output.invert && !silence, &output.dop_phase, output.format);
+		} else
+#endif
 		_scale_and_pack_frames(outputptr, inputptr, out_frames, gainL, gainR, output.format);
 
 	} else {
 
 		outputptr = (void *)inputptr;
 
+		IF_DSD(
+			if (output.dop) {
+				if (silence) {
+					outputptr = alsa.write_buf;
+				}
+				_apply_dop((u32_t *) outputptr, (u32_t *) inputptr, out_frames, output.invert && !silence, &output.dop_phase);
+			}
+		)
+
 		if (!silence) {
 
 			if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
@@ -660,17 +712,22 @@ static void *output_thread(void *arg) {
 			probe_device = false;
 		}
 
-		if (!pcmp || alsa.rate != output.current_sample_rate) {
+		bool dsd = false;
+		IF_DSD(
+			dsd = output.dsd;
+		)
+
+		if (!pcmp || alsa.rate != output.current_sample_rate || alsa.dsd != dsd) {
 			LOG_INFO("open output device: %s", output.device);
 			LOCK;
 
 			// FIXME - some alsa hardware requires opening twice for a new sample rate to work
 			// this is a workaround which should be removed
 			if (alsa.reopen) {
-				alsa_open(output.device, output.current_sample_rate, output.buffer, output.period);
+				alsa_open(output.device, output.current_sample_rate, output.buffer, output.period, dsd);
 			}
 
-			if (!!alsa_open(output.device, output.current_sample_rate, output.buffer, output.period)) {
+			if (!!alsa_open(output.device, output.current_sample_rate, output.buffer, output.period, dsd)) {
 				output.error_opening = true;
 				UNLOCK;
 				sleep(5);
@@ -868,6 +925,8 @@ void output_init_alsa(log_level level, const char *device, unsigned output_buf_s
 
 	alsa.mmap = alsa_mmap;
 	alsa.write_buf = NULL;
+	alsa.write_buf_frames = 0;
+	alsa.dsd = false;
 	alsa.format = 0;
 	alsa.reopen = alsa_reopen;
 	alsa.ctl = ctl4device(device);
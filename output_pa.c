@@ -382,26 +382,21 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 			_apply_gain(outputbuf, out_frames, gainL, gainR);
 		}
 
-		IF_DSD(
-			if (output.dop) {
-				update_dop((u32_t *) outputbuf->readp, out_frames, output.invert);
-			}
-		)
-
+#if DSD
+		if (output.dop) {
+			_apply_dop((u32_t *) optr, (u32_t *) outputbuf->readp, out_frames, output.invert, &output.dop_phase);
+		} else
+#endif
 		memcpy(optr, outputbuf->readp, out_frames * BYTES_PER_FRAME);
 
 	} else {
 
-		u8_t *buf = silencebuf;
-
-		IF_DSD(
-			if (output.dop) {
-				buf = silencebuf_dop;
-				update_dop((u32_t *) buf, out_frames, false); // don't invert silence
-			}
-		)
-
-		memcpy(optr, buf, out_frames * BYTES_PER_FRAME);
+#if DSD
+		if (output.dop) {
+			_apply_dop((u32_t *) optr, (u32_t *) silencebuf_dop, out_frames, false, &output.dop_phase); // don't invert silence
+		} else
+#endif
+		memcpy(optr, silencebuf, out_frames * BYTES_PER_FRAME);
 	}
 	
 	optr += out_frames * BYTES_PER_FRAME;
@@ -236,11 +236,200 @@ void _scale_and_pack_frames(void *outputptr, s32_t *inputptr, frames_t cnt, s32_
 #endif
 		}
 		break;
+#if DSD
+	// native dsd - each sample holds up to 4 bytes of dsd, first in time in the msb, gain is not applied
+	case U8:
+		{
+			u8_t *optr = (u8_t *)(void *)outputptr;
+			while (cnt--) {
+				*(optr++) = *(inputptr++) >> 24;
+				*(optr++) = *(inputptr++) >> 24;
+			}
+		}
+		break;
+	case U16_LE:
+		{
+			u8_t *optr = (u8_t *)(void *)outputptr;
+			while (cnt--) {
+				u32_t lsample = *(inputptr++);
+				u32_t rsample = *(inputptr++);
+				*(optr++) = lsample >> 16;
+				*(optr++) = lsample >> 24;
+				*(optr++) = rsample >> 16;
+				*(optr++) = rsample >> 24;
+			}
+		}
+		break;
+	case U16_BE:
+		{
+			u8_t *optr = (u8_t *)(void *)outputptr;
+			while (cnt--) {
+				u32_t lsample = *(inputptr++);
+				u32_t rsample = *(inputptr++);
+				*(optr++) = lsample >> 24;
+				*(optr++) = lsample >> 16;
+				*(optr++) = rsample >> 24;
+				*(optr++) = rsample >> 16;
+			}
+		}
+		break;
+	case U32_LE:
+		{
+#if SL_LITTLE_ENDIAN
+			memcpy(outputptr, inputptr, cnt * BYTES_PER_FRAME);
+#else
+			u8_t *optr = (u8_t *)(void *)outputptr;
+			cnt *= 2;
+			while (cnt--) {
+				u32_t sample = *(inputptr++);
+				*(optr++) = sample;
+				*(optr++) = sample >> 8;
+				*(optr++) = sample >> 16;
+				*(optr++) = sample >> 24;
+			}
+#endif
+		}
+		break;
+	case U32_BE:
+		{
+			u8_t *optr = (u8_t *)(void *)outputptr;
+			cnt *= 2;
+			while (cnt--) {
+				u32_t sample = *(inputptr++);
+				*(optr++) = sample >> 24;
+				*(optr++) = sample >> 16;
+				*(optr++) = sample >> 8;
+				*(optr++) = sample;
+			}
+		}
+		break;
+#endif
 	default:
 		break;
 	}
 }
 
+#if DSD
+// dop - the marker is applied and polarity optionally inverted as frames are packed, the marker phase is carried
+// in *phase across calls so that audio and silence form one continuous marker sequence
+#define DOP_MARKER(phase) ((phase) ? 0xFA000000 : 0x05000000)
+#define DOP_BLOCK 128
+
+// native byte order, optr may be the same as iptr
+void _apply_dop(u32_t *optr, u32_t *iptr, frames_t cnt, bool invert, bool *phase) {
+	u32_t m0 = DOP_MARKER(*phase);
+	u32_t m1 = m0 ^ 0xFF000000;
+	u32_t x = invert ? 0x00FFFFFF : 0;
+	frames_t quads = cnt / 4;
+
+	// four frames per pass so the marker pattern is fixed within the loop body, allowing it to vectorize
+	while (quads--) {
+		u32_t l1 = iptr[0], r1 = iptr[1], l2 = iptr[2], r2 = iptr[3];
+		u32_t l3 = iptr[4], r3 = iptr[5], l4 = iptr[6], r4 = iptr[7];
+		optr[0] = ((l1 ^ x) & 0x00FFFFFF) | m0;
+		optr[1] = ((r1 ^ x) & 0x00FFFFFF) | m0;
+		optr[2] = ((l2 ^ x) & 0x00FFFFFF) | m1;
+		optr[3] = ((r2 ^ x) & 0x00FFFFFF) | m1;
+		optr[4] = ((l3 ^ x) & 0x00FFFFFF) | m0;
+		optr[5] = ((r3 ^ x) & 0x00FFFFFF) | m0;
+		optr[6] = ((l4 ^ x) & 0x00FFFFFF) | m1;
+		optr[7] = ((r4 ^ x) & 0x00FFFFFF) | m1;
+		iptr += 8; optr += 8;
+	}
+
+	cnt &= 3;
+	while (cnt--) {
+		u32_t l = iptr[0], r = iptr[1];
+		optr[0] = ((l ^ x) & 0x00FFFFFF) | m0;
+		optr[1] = ((r ^ x) & 0x00FFFFFF) | m0;
+		iptr += 2; optr += 2;
+		m0 ^= 0xFF000000;
+		*phase = !*phase;
+	}
+}
+
+void _scale_and_pack_dop_frames(void *outputptr, s32_t *inputptr, frames_t cnt, bool invert, bool *phase, output_format format) {
+	u32_t *iptr = (u32_t *)(void *)inputptr;
+	u32_t m0 = DOP_MARKER(*phase);
+	u32_t m1 = m0 ^ 0xFF000000;
+	u32_t x = invert ? 0x00FFFFFF : 0;
+	frames_t done = 0;
+	unsigned bytes_per_frame;
+
+	switch (format) {
+#if SL_LITTLE_ENDIAN
+	case S32_LE:
+		_apply_dop((u32_t *)outputptr, iptr, cnt, invert, phase);
+		return;
+	case S24_LE:
+		{
+			u32_t *optr = (u32_t *)(void *)outputptr;
+			frames_t pairs = cnt / 2;
+			while (pairs--) {
+				u32_t l1 = ((iptr[0] ^ x) & 0x00FFFFFF) | m0;
+				u32_t r1 = ((iptr[1] ^ x) & 0x00FFFFFF) | m0;
+				u32_t l2 = ((iptr[2] ^ x) & 0x00FFFFFF) | m1;
+				u32_t r2 = ((iptr[3] ^ x) & 0x00FFFFFF) | m1;
+				optr[0] = (s32_t)l1 >> 8;
+				optr[1] = (s32_t)r1 >> 8;
+				optr[2] = (s32_t)l2 >> 8;
+				optr[3] = (s32_t)r2 >> 8;
+				iptr += 4; optr += 4;
+			}
+			done = cnt & ~1;
+		}
+		break;
+	case S24_3LE:
+		// 2 frames at once as 3 aligned 32 bit words, unaligned output is left to the block path below
+		if (((uintptr_t)outputptr & 0x3) == 0) {
+			u32_t *optr = (u32_t *)(void *)outputptr;
+			frames_t pairs = cnt / 2;
+			// the marker bytes sit at fixed positions within the 3 words, so only the data bytes are taken from input
+			u32_t x0 = x ? 0xff00ffff : 0, x1 = x ? 0xffff00ff : 0, x2 = x ? 0x00ffff00 : 0;
+			u32_t mk0 = m0 >> 8, mk1 = m0 >> 16, mk2 = m1 >> 24 | m1;
+			while (pairs--) {
+				u32_t l1 = iptr[0], r1 = iptr[1], l2 = iptr[2], r2 = iptr[3];
+				optr[0] = (((l1 & 0x00ffff00) >>  8 | (r1 & 0x0000ff00) << 16) ^ x0) | mk0;
+				optr[1] = (((r1 & 0x00ff0000) >> 16 | (l2 & 0x00ffff00) <<  8) ^ x1) | mk1;
+				optr[2] = ((r2 & 0x00ffff00) ^ x2) | mk2;
+				iptr += 4; optr += 3;
+			}
+			done = cnt & ~1;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	// pairs of frames leave the marker phase unchanged, anything not yet packed (a final odd frame, unaligned
+	// output, other formats or byte orders) is marked a block at a time on the stack and packed from there
+	if (done == cnt) {
+		return;
+	}
+
+	switch (format) {
+	case S16_LE:  bytes_per_frame = 4; break;
+	case S24_3LE: bytes_per_frame = 6; break;
+	default:      bytes_per_frame = 8; break;
+	}
+
+	{
+		s32_t buf[DOP_BLOCK * 2];
+		u8_t *optr = (u8_t *)outputptr + done * bytes_per_frame;
+		cnt -= done;
+		while (cnt) {
+			frames_t f = cnt < DOP_BLOCK ? cnt : DOP_BLOCK;
+			_apply_dop((u32_t *)(void *)buf, iptr, f, invert, phase);
+			_scale_and_pack_frames(optr, buf, f, FIXED_ONE, FIXED_ONE, format);
+			iptr += f * 2;
+			optr += f * bytes_per_frame;
+			cnt -= f;
+		}
+	}
+}
+#endif
+
 #if !WIN
 inline 
 #endif
@@ -63,15 +63,12 @@ static int _stdout_write_frames(frames_t out_frames, bool silence, s32_t gainL,
 		obuf = silencebuf;
 	}
 
-	IF_DSD(
-		   if (output.dop) {
-			   if (silence) {
-				   obuf = silencebuf_dop;
-			   }
-			   update_dop((u32_t *)obuf, out_frames, output.invert && !silence);
-		   }
-	)
-
+#if DSD
+	if (output.dop) {
+		_scale_and_pack_dop_frames(buf + buffill * bytes_per_frame, (s32_t *)(void *)(silence ? silencebuf_dop : obuf), out_frames,
+								   output.invert && !silence, &output.dop_phase, output.format);
+	} else
+#endif
 	_scale_and_pack_frames(buf + buffill * bytes_per_frame, (s32_t *)(void *)obuf, out_frames, gainL, gainR, output.format);
 
 	buffill += out_frames;
@@ -0,0 +1,422 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2016, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// sync correction by varying playback speed - small errors reported by the server as pause or skip requests are
+// absorbed by playing slightly slower or faster rather than inserting silence or dropping audio
+
+#include "squeezelite.h"
+
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static log_level loglevel;
+
+extern struct outputstate output;
+extern struct buffer *outputbuf;
+
+#define VS_TAPS       16    // interpolation filter length
+#define VS_HALF       (VS_TAPS / 2)
+#define VS_PHASES     64    // filter phases, interpolated between
+#define VS_CUTOFF     0.9   // filter cutoff as a fraction of nyquist
+#define VS_CHUNK      1024  // frames resampled at a time
+#define VS_CARRY      8192  // frames of input held back when there is no space in outputbuf to play slower
+#define VS_WIND_DOWN  (2 * VS_CARRY) // frames before a track start, fade or the end of the audio to stop playing slower
+#define VS_STEP_PPM   10    // largest change of speed per chunk
+#define VS_SETTLE     10    // seconds to absorb an error when not limited by the maximum speed change
+#define VS_MAX_DRIFT  300   // ppm, largest clock drift correction
+#define VS_DRIFT_MS   20000 // shortest time between corrections used to estimate drift
+#define VS_DRIFT_GAIN 0.5
+#define VS_LOG_MS     5000
+#define VS_IN         (VS_HALF + VS_CARRY + VS_CHUNK + VS_HALF)
+#define VS_OUT        (VS_CARRY + VS_CHUNK + (VS_CARRY + VS_CHUNK) / 100 + 2)
+
+// frames are resampled in place in outputbuf a chunk at a time just before they are played, the output of a chunk
+// ends where its input ended so readp moves forward when playing faster, when playing slower the extra frames go
+// before readp if outputbuf has space, otherwise the input not yet used is carried to the next chunk - decoders
+// normally keep outputbuf full so space is only certain once a chunk has been played
+// the frames resampled so far end at done and are played before the next chunk is resampled
+// track starts and fades are at chunk boundaries as chunks never extend past the frames _output_frames plays next,
+// approaching one of these or the end of the audio the speed is not reduced so that input carried is played out as
+// space in outputbuf allows, rather than skipped when the boundary is reached
+static struct {
+	bool enabled;
+	unsigned max_ms;
+	double max_ppm;
+	float coef[VS_PHASES + 1][VS_TAPS];
+	bool active;
+	unsigned rate;
+	double ppm;        // current speed change, positive plays slower
+	double drift;      // clock drift against the other players of the sync group, included in ppm
+	double error;      // frames still to correct, positive when ahead
+	double frac;       // input position of the next output relative to the first carried frame
+	unsigned held;     // input frames carried
+	u8_t *done;
+	u32_t last_correct;
+	u32_t last_log;
+	float in[2][VS_IN]; // VS_HALF frames of history, carried frames then the chunk and its lookahead
+	s32_t out[2 * VS_OUT];
+} vs;
+
+// frame k frames from readp, k may be negative
+static s32_t *_frame(int k) {
+	u8_t *p = outputbuf->readp + k * BYTES_PER_FRAME;
+	if (p >= outputbuf->wrap) p -= outputbuf->size;
+	if (p < outputbuf->buf) p += outputbuf->size;
+	return (s32_t *)(void *)p;
+}
+
+// frames from readp to p
+static unsigned _dist(u8_t *p) {
+	return (p >= outputbuf->readp ? p - outputbuf->readp : p + outputbuf->size - outputbuf->readp) / BYTES_PER_FRAME;
+}
+
+static inline s32_t _to_s32(float v) {
+	return v >= 2147483647.0f ? 0x7fffffff : v <= -2147483648.0f ? (s32_t)0x80000000 : (s32_t)v;
+}
+
+static void _reset(void) {
+	vs.active = false;
+	vs.ppm = 0;
+	vs.error = 0;
+	vs.frac = 0;
+	vs.held = 0;
+	vs.done = NULL;
+}
+
+// input still carried is skipped as it belongs before a fade, track start or the end of the audio and there was not
+// space in outputbuf to play it out before reaching it
+static void _drop(void) {
+	if (vs.held) {
+		LOG_INFO("varispeed skipped %u frames", vs.held);
+		output.frames_played += vs.held;
+	}
+	_reset();
+}
+
+// history for the first chunk is the frames played before readp unless they may have been overwritten, in which
+// case the next VS_HALF frames are played unchanged as the history
+static void _start(void) {
+	unsigned c, k;
+	bool played = _buf_space(outputbuf) >= VS_HALF * BYTES_PER_FRAME;
+
+	for (c = 0; c < 2; ++c) {
+		for (k = 0; k < VS_HALF; ++k) {
+			vs.in[c][k] = (float)_frame(played ? (int)k - VS_HALF : (int)k)[c];
+		}
+	}
+
+	vs.active = true;
+	vs.frac = 0;
+	vs.held = 0;
+	vs.done = played ? NULL : (u8_t *)_frame(VS_HALF);
+	vs.rate = output.current_sample_rate;
+	vs.last_log = gettime_ms();
+
+	LOG_DEBUG("varispeed start");
+}
+
+// corrected to within a frame with no drift
+static bool _corrected(void) {
+	return vs.error > -1 && vs.error < 1 && vs.drift == 0;
+}
+
+// speed change for the next chunk, moved towards its target in steps of at most VS_STEP_PPM
+static void _control(void) {
+	double target = vs.drift;
+	double slew = vs.error * 1e6 / (VS_SETTLE * vs.rate);
+
+	target += slew > vs.max_ppm ? vs.max_ppm : slew < -vs.max_ppm ? -vs.max_ppm : slew;
+
+	// once corrected keep a small change until the next output lines up with an input so that it can stop
+	if (_corrected()) {
+		target = vs.frac >= 0.02 ? VS_STEP_PPM : 0;
+	}
+
+	if (target > vs.ppm + VS_STEP_PPM) {
+		vs.ppm += VS_STEP_PPM;
+	} else if (target < vs.ppm - VS_STEP_PPM) {
+		vs.ppm -= VS_STEP_PPM;
+	} else {
+		vs.ppm = target;
+	}
+}
+
+// frames from readp to the next track start or fade, or to the last frames which can be resampled with lookahead
+static unsigned _boundary(unsigned used) {
+	unsigned ahead = used - VS_HALF;
+
+	if (output.track_start) {
+		ahead = min(ahead, _dist(output.track_start));
+	}
+	if (output.fade == FADE_DUE) {
+		ahead = min(ahead, _dist(output.fade_start));
+	}
+
+	return ahead;
+}
+
+// resample n frames at readp after any carried, returns the output frames which now start at readp
+// with wind_down set the speed is not reduced so that the input carried is played out where there is space for it
+static frames_t _resample(frames_t n, bool wind_down) {
+	double step = 1 / (1 + vs.ppm * 1e-6);
+	double t = vs.frac;
+	unsigned space = _buf_space(outputbuf) / BYTES_PER_FRAME;
+	unsigned avail = vs.held + n;
+	frames_t max_m = n + min(space, VS_OUT - n);
+	frames_t m = 0;
+	unsigned c, k, used;
+	int start;
+
+	// play at normal speed if the input carried would not fit or a boundary is close
+	if (step < 1 && (wind_down || vs.held + n * (1 - step) + 2 > VS_CARRY + (max_m - n) * step)) {
+		step = 1;
+	}
+
+	for (c = 0; c < 2; ++c) {
+		float *w = vs.in[c] + VS_HALF + vs.held;
+		for (k = 0; k < n + VS_HALF; ++k) {
+			w[k] = (float)_frame(k)[c];
+		}
+	}
+
+	// output at input position i + a is the sum of inputs i - VS_HALF + 1 to i + VS_HALF
+	while (t < avail && m < max_m) {
+		unsigned i = (unsigned)t;
+		double a = (t - i) * VS_PHASES;
+		unsigned p = (unsigned)a;
+		float f = (float)(a - p);
+		const float *c0 = vs.coef[p];
+		const float *c1 = vs.coef[p + 1];
+		const float *l = vs.in[0] + i + 1;
+		const float *r = vs.in[1] + i + 1;
+		float accl = 0, accr = 0;
+
+		for (k = 0; k < VS_TAPS; ++k) {
+			float coef = c0[k] + f * (c1[k] - c0[k]);
+			accl += coef * l[k];
+			accr += coef * r[k];
+		}
+
+		vs.out[2 * m]     = _to_s32(accl);
+		vs.out[2 * m + 1] = _to_s32(accr);
+		m++;
+		t = vs.frac + m * step;
+	}
+
+	// keep history and the input not yet used for the next chunk
+	used = min((unsigned)t, avail);
+	vs.frac = t - used;
+	for (c = 0; c < 2; ++c) {
+		memmove(vs.in[c], vs.in[c] + used, (VS_HALF + avail - used) * sizeof(float));
+	}
+
+	// output ends where the input did
+	start = (int)n - (int)m;
+	for (k = 0; k < m; ++k) {
+		s32_t *f = _frame(start + (int)k);
+		f[0] = vs.out[2 * k];
+		f[1] = vs.out[2 * k + 1];
+	}
+	vs.done = (u8_t *)_frame(n);
+	outputbuf->readp = (u8_t *)_frame(start);
+
+	// frames_played counts input used so the position reported to the server is that of the audio
+	if (m > used) {
+		output.frames_played = output.frames_played > m - used ? output.frames_played - (m - used) : 0;
+	} else {
+		output.frames_played += used - m;
+	}
+
+	// time gained or lost by playing m frames of m * step input, drift correction only stops the error growing
+	vs.error -= m * (1 - step) - m * vs.drift * 1e-6;
+
+	vs.held = avail - used;
+
+	return m;
+}
+
+// called from _output_frames with cont_frames contiguous frames at readp to play and size frames wanted, returns
+// frames which can be played from readp which may have moved
+frames_t _varispeed_frames(frames_t cont_frames, frames_t size) {
+	frames_t n, used, m, ret;
+	unsigned ahead;
+	u32_t now;
+
+	if (!vs.enabled) {
+		return cont_frames;
+	}
+
+	// play what is already resampled
+	if (vs.done) {
+		frames_t pending = (vs.done >= outputbuf->readp ? vs.done - outputbuf->readp :
+							vs.done + outputbuf->size - outputbuf->readp) / BYTES_PER_FRAME;
+		if (pending && pending <= VS_OUT) {
+			return min(cont_frames, pending);
+		}
+		vs.done = NULL;
+	}
+
+	if (output.fade == FADE_ACTIVE || output.current_sample_rate != vs.rate) {
+		if (vs.active) {
+			LOG_DEBUG("varispeed stopped - fade or rate change");
+			_drop();
+		}
+		vs.rate = output.current_sample_rate;
+		return cont_frames;
+	}
+
+	IF_DSD(
+		if (output.dop || output.dsd) {
+			if (vs.active) _drop();
+			return cont_frames;
+		}
+	)
+
+	if (!vs.active) {
+		if (_corrected()) {
+			return cont_frames;
+		}
+		_start();
+		if (vs.done) {
+			return min(cont_frames, VS_HALF);
+		}
+	}
+
+	used = _buf_used(outputbuf) / BYTES_PER_FRAME;
+	n = min(cont_frames, size);
+	n = min(n, VS_CHUNK);
+	if (used < n + VS_HALF) {
+		// end of the audio, not enough to look ahead
+		_drop();
+		return cont_frames;
+	}
+
+	_control();
+
+	ahead = _boundary(used);
+
+	m = _resample(n, ahead < VS_WIND_DOWN);
+
+	now = gettime_ms();
+	if (now - vs.last_log > VS_LOG_MS) {
+		LOG_INFO("varispeed sync error: %.1f ms speed: %+.0f ppm drift: %+.1f ppm",
+				 vs.error * 1000 / vs.rate, vs.ppm, vs.drift);
+		vs.last_log = now;
+	}
+
+	ret = min(m, (vs.done > outputbuf->readp ? vs.done - outputbuf->readp : outputbuf->wrap - outputbuf->readp) / BYTES_PER_FRAME);
+
+	// corrected and the next output lines up with an input, play at normal speed from here
+	if (_corrected() && !vs.held && vs.frac < 0.02 && vs.ppm <= VS_STEP_PPM && vs.ppm >= -VS_STEP_PPM) {
+		LOG_DEBUG("varispeed stop");
+		vs.active = false;
+		vs.ppm = 0;
+		vs.frac = 0;
+	} else if (vs.held && n >= ahead) {
+		// chunk ends at the boundary without space to play out the input carried
+		LOG_DEBUG("varispeed stopped - boundary reached");
+		_drop();
+	}
+
+	return ret;
+}
+
+// correction requested by the server, frames is positive when ahead, returns false if it is too large for
+// varispeed so should be paused or skipped - called with outputbuf mutex locked
+bool _varispeed_correct(int frames) {
+	unsigned rate = output.current_sample_rate;
+	u32_t now = gettime_ms();
+	bool ok = rate && (unsigned)abs(frames) <= vs.max_ms * rate / 1000;
+
+	if (!vs.enabled) {
+		return false;
+	}
+
+	IF_DSD(
+		if (output.dop || output.dsd) ok = false;
+	)
+
+	if (!ok) {
+		LOG_INFO("sync error: %d ms - %s", frames * 1000 / (int)(rate ? rate : 1), frames > 0 ? "pause" : "skip");
+		// the pause or skip removes the error, any left from earlier corrections is part of what the server measured
+		vs.error = 0;
+		vs.last_correct = 0;
+		return false;
+	}
+
+	// the server measures the whole error, including what is not yet corrected, the rest is drift since the last one
+	if (vs.last_correct && now - vs.last_correct >= VS_DRIFT_MS) {
+		vs.drift += VS_DRIFT_GAIN * (frames - vs.error) * 1e6 / ((double)(now - vs.last_correct) * rate / 1000);
+		vs.drift = vs.drift > VS_MAX_DRIFT ? VS_MAX_DRIFT : vs.drift < -VS_MAX_DRIFT ? -VS_MAX_DRIFT : vs.drift;
+	}
+
+	vs.error = frames;
+	vs.last_correct = now;
+
+	LOG_INFO("sync error: %d ms - varispeed drift: %+.1f ppm", frames * 1000 / (int)rate, vs.drift);
+
+	return true;
+}
+
+// called with outputbuf mutex locked
+void _varispeed_flush(void) {
+	_reset();
+	vs.last_correct = 0;
+}
+
+// opt = <max_ms>:<max_ppm>, errors larger than max_ms are paused or skipped, speed changes by at most max_ppm
+void varispeed_init(log_level level, char *opt) {
+	char *max_ms = next_param(opt, ':');
+	char *max_ppm = next_param(NULL, ':');
+	unsigned p, k;
+
+	loglevel = level;
+
+	vs.max_ms = max_ms && *max_ms ? atoi(max_ms) : 50;
+	vs.max_ppm = max_ppm && *max_ppm ? atof(max_ppm) : 1000;
+	// out has room for 1% more frames than a chunk, including drift
+	vs.max_ppm = min(vs.max_ppm, 10000 - VS_MAX_DRIFT - VS_STEP_PPM);
+
+	// windowed sinc at VS_PHASES fractional delays, each normalised to unity gain at dc
+	for (p = 0; p <= VS_PHASES; ++p) {
+		double a = (double)p / VS_PHASES;
+		double beta = 6.0, sum = 0;
+		for (k = 0; k < VS_TAPS; ++k) {
+			double x = (double)k - (VS_HALF - 1) - a;
+			double r = x / VS_HALF;
+			double h = (x == 0 ? 1.0 : sin(M_PI * VS_CUTOFF * x) / (M_PI * VS_CUTOFF * x)) *
+				(r * r < 1 ? bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta) : 0);
+			vs.coef[p][k] = (float)h;
+			sum += h;
+		}
+		for (k = 0; k < VS_TAPS; ++k) {
+			vs.coef[p][k] /= (float)sum;
+		}
+	}
+
+	_reset();
+	vs.enabled = vs.max_ms > 0 && vs.max_ppm > 0;
+
+	LOG_INFO("varispeed sync correction up to %u ms, at most %.0f ppm", vs.max_ms, vs.max_ppm);
+}
@@ -63,8 +63,10 @@ static u32_t sample_size;
 static u32_t channels;
 static bool  bigendian;
 static bool  limit;
+static bool  check_header;
 static u32_t audio_left;
 static u32_t bytes_per_frame;
+static s32_t *mixbuf; // unpacked multichannel samples before downmix
 
 typedef enum { UNKNOWN = 0, WAVE, AIFF } header_format;
 
@@ -161,17 +163,37 @@ static void _check_header(void) {
 	}
 }
 
+// local seek - audio is uncompressed so the offset follows directly from the frame size
+static void _pcm_seek(void) {
+	u32_t frame = channels * sample_size;
+	u64_t offset = (u64_t)stream.seek_ms * sample_rate / 1000 * frame;
+
+	stream.seek_ms = 0;
+
+	if (!frame || offset >= audio_left) {
+		LOG_WARN("seek beyond end of audio");
+		return;
+	}
+
+	if (_stream_seek(_stream_tell() + offset)) {
+		audio_left -= (u32_t)offset;
+	}
+}
+
 static decode_state pcm_decode(void) {
 	unsigned bytes, in, out;
 	frames_t frames, count;
-	u32_t *optr;
+	u32_t *optr, *mptr = NULL;
 	u8_t  *iptr;
-	u8_t tmp[16];
+	u8_t tmp[MAX_CHANNELS * 4];
 	
 	LOCK_S;
 
-	if ( decode.new_stream && ( ( stream.state == STREAMING_FILE ) || pcm_check_header ) ) {
+	if ( decode.new_stream && ( ( stream.state == STREAMING_FILE ) || pcm_check_header || check_header ) ) {
 		_check_header();
+		if (limit && stream.seek_ms) {
+			_pcm_seek();
+		}
 	}
 
 	LOCK_O_direct;
@@ -192,11 +214,24 @@ static decode_state pcm_decode(void) {
 	}
 
 	if (decode.new_stream) {
+		if (channels > MAX_CHANNELS) {
+			LOG_ERROR("unsupported channels: %u", channels);
+			UNLOCK_O_direct;
+			UNLOCK_S;
+			return DECODE_ERROR;
+		}
+		// multichannel is only decoded through the downmix, never written out as interleaved stereo
+		if (channels > 2 && !mixbuf && !(mixbuf = malloc(MAX_DECODE_FRAMES * MAX_CHANNELS * sizeof(s32_t)))) {
+			LOG_ERROR("unable to malloc downmix buffer");
+			UNLOCK_O_direct;
+			UNLOCK_S;
+			return DECODE_ERROR;
+		}
 		LOG_INFO("setting track_start");
 		LOCK_O_not_direct;
 		output.next_sample_rate = decode_newstream(sample_rate, output.supported_rates);
 		output.track_start = outputbuf->writep;
-		IF_DSD( output.next_dop = false; )
+		IF_DSD( output.next_dop = false; output.next_dsd = false; )
 		if (output.fade_mode) _checkfade(true);
 		decode.new_stream = false;
 		UNLOCK_O_not_direct;
@@ -235,7 +270,13 @@ static decode_state pcm_decode(void) {
 
 	count = frames * channels;
 
-	if (channels == 2) {
+	if (channels > 2) {
+		// unpack interleaved channels to mixbuf, then downmix to the output
+		mptr = optr;
+		optr = (u32_t *)mixbuf;
+	}
+
+	if (channels == 2 || mptr) {
 		if (sample_size == 1) {
 			while (count--) {
 				*optr++ = *iptr++ << 24;
@@ -337,6 +378,10 @@ static decode_state pcm_decode(void) {
 		LOG_ERROR("unsupported channels");
 	}
 
+	if (mptr) {
+		convert_s32((s32_t *)mptr, mixbuf, channels, frames);
+	}
+
 	LOG_SDEBUG("decoded %u frames", frames);
 
 	_buf_inc_readp(streambuf, frames * bytes_per_frame);
@@ -359,11 +404,24 @@ static decode_state pcm_decode(void) {
 }
 
 static void pcm_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
+	limit       = false;
+
+	// format detected from stream data - streambuf already holds the header, which is parsed for the real values
+	if (size == '?') {
+		sample_size = 2;
+		sample_rate = 44100;
+		channels    = 2;
+		bigendian   = false;
+		check_header = true;
+		LOG_INFO("pcm format from header");
+		return;
+	}
+
 	sample_size = size - '0' + 1;
 	sample_rate = sample_rates[rate - '0'];
 	channels    = chan - '0';
 	bigendian   = (endianness == '0');
-	limit       = false;
+	check_header = false;
 
 	LOG_INFO("pcm size: %u rate: %u chan: %u bigendian: %u", sample_size, sample_rate, channels, bigendian);
 	buf_adjust(streambuf, sample_size * channels);
@@ -371,6 +429,10 @@ static void pcm_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 
 static void pcm_close(void) {
 	buf_adjust(streambuf, 1);
+	if (mixbuf) {
+		free(mixbuf);
+		mixbuf = NULL;
+	}
 }
 
 struct codec *register_pcm(void) {
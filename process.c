@@ -37,158 +37,544 @@ extern struct codec *codec;
 #define LOCK_O   mutex_lock(outputbuf->mutex)
 #define UNLOCK_O mutex_unlock(outputbuf->mutex)
 
-// macros to map to processing functions - currently only resample.c
-// this can be made more generic when multiple processing mechanisms get added
-#if RESAMPLE
-#define SAMPLES_FUNC resample_samples
-#define DRAIN_FUNC   resample_drain
-#define NEWSTREAM_FUNC resample_newstream
-#define FLUSH_FUNC   resample_flush
-#define INIT_FUNC    resample_init
+#define MAX_STAGES 8
+
+// processing chain - stages run in order, each passing its output to the next without copying, either in place
+// or from its own output buffer, the first stage reads the decoded block directly
+// a stage may take less input than offered when its output is full, the rest is offered again once the output has
+// been passed on, so each stage keeps its own buffer as input of the stage before may still be pending
+struct stage {
+	struct process_stage *s;
+	struct processstate st;    // input and output of this stage for the current call
+	bool active;               // set at new stream, inactive stages are skipped
+	u8_t *buf;
+	unsigned buf_frames;
+};
+
+static struct stage chain[MAX_STAGES];
+static unsigned stages;
+
+// pipeline - the chain runs on its own thread so that decoding and processing use separate cores
+// decoded blocks pass from the decode thread to the process thread through a single producer single consumer ring
+// without locking, pipeline.mutex is only taken to sleep and wake, the block being filled by the codec is process.inbuf
+#define PIPELINE_BLOCKS 4
+
+static struct {
+	u8_t *block[PIPELINE_BLOCKS];
+	unsigned frames[PIPELINE_BLOCKS];
+	volatile unsigned head;     // blocks queued, only written by the decode thread
+	volatile unsigned tail;     // blocks done, only written by the process thread unless idle
+	volatile unsigned drain_at; // drain the chain once this many blocks are done
+	volatile bool drain;
+	volatile bool abort;        // discard queued blocks and pending output, set by process_abort
+	volatile bool busy;         // process thread is running the chain
+	volatile bool sleeping;     // process thread is waiting for a block
+	bool space_wait;            // process thread is waiting for outputbuf space, set with outputbuf mutex held
+	u64_t cpu_us;               // process thread cpu time and frames written this track, updated with mutex held
+	u64_t frames_out;
+	mutex_type mutex;
+#if !WIN
+	pthread_cond_t wake;
+	pthread_cond_t done;
+#else
+	HANDLE wake;
+	HANDLE done;
+#endif
+	thread_type thread;
+} pipeline;
+
+// wait for a signal or timeout, called with pipeline.mutex held
+#if !WIN
+static void _wait(pthread_cond_t *cond, unsigned ms) {
+	struct timeval tv;
+	struct timespec ts;
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + ms / 1000;
+	ts.tv_nsec = (tv.tv_usec + (ms % 1000) * 1000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, &pipeline.mutex, &ts);
+}
+#define WAIT(c, ms) _wait(&pipeline.c, ms)
+#define SIGNAL(c)   pthread_cond_broadcast(&pipeline.c)
+#else
+static void _wait(HANDLE event, unsigned ms) {
+	mutex_unlock(pipeline.mutex);
+	WaitForSingleObject(event, ms);
+	mutex_lock(pipeline.mutex);
+}
+#define WAIT(c, ms) _wait(pipeline.c, ms)
+#define SIGNAL(c)   SetEvent(pipeline.c)
 #endif
 
+// wake the process thread if it is waiting for a block, the barrier orders the ring update before the sleeping test
+// and pairs with the one in process_thread so that either a new block is seen or the signal is sent
+static void _wake(void) {
+	memory_barrier();
+	if (pipeline.sleeping) {
+		mutex_lock(pipeline.mutex);
+		SIGNAL(wake);
+		mutex_unlock(pipeline.mutex);
+	}
+}
 
-// transfer all processed frames to the output buf
-static void _write_samples(void) {
-	size_t frames = process.out_frames;
-	u32_t *iptr   = (u32_t *)process.outbuf;
-	unsigned cnt  = 10;
+// transfer processed frames to the output buf, waiting for the output to make space rather than dropping them
+static void _write_samples(u8_t *buf, unsigned frames) {
+	u32_t *iptr   = (u32_t *)(void *)buf;
 
-	LOCK_O;
+	while (frames > 0 && !pipeline.abort) {
 
-	while (frames > 0) {
+		frames_t f;
 
-		frames_t f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		u32_t *optr = (u32_t *)outputbuf->writep;
+		LOCK_O;
 
-		if (f > 0) {
+		f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
 
+		if (f > 0) {
 			f = min(f, frames);
-			
-			memcpy(optr, iptr, f * BYTES_PER_FRAME);
-			
-			frames -= f;
-			
+			memcpy(outputbuf->writep, iptr, f * BYTES_PER_FRAME);
 			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+		} else {
+			pipeline.space_wait = true;
+		}
+
+		UNLOCK_O;
+
+		if (f > 0) {
+
+			frames -= f;
 			iptr += f * BYTES_PER_FRAME / sizeof(*iptr);
 
-		} else if (cnt--) {
+		} else {
+
+			// output buffer is full, wait for the output to play some of it or for an abort
+			mutex_lock(pipeline.mutex);
+			while (pipeline.space_wait && !pipeline.abort) {
+				WAIT(wake, 1000);
+			}
+			mutex_unlock(pipeline.mutex);
+		}
+	}
+}
+
+// run frames in buf through the active stages from first onwards and write the result to the output buf
+static void _run_chain(unsigned first, u8_t *buf, unsigned frames) {
+	struct stage *s;
+	unsigned i;
+
+	for (i = first; i < stages && !chain[i].active; i++);
 
-			// there should normally be space in the output buffer, but may need to wait during drain phase
-			UNLOCK_O;
-			usleep(10000);
-			LOCK_O;
+	if (i == stages) {
+		process.total_out += frames;
+		_write_samples(buf, frames);
+		return;
+	}
+
+	s = &chain[i];
+
+	while (frames && !pipeline.abort) {
+
+		s->st.inbuf = buf;
+		s->st.in_frames = frames;
+		s->st.outbuf = s->s->in_place ? buf : s->buf;
+
+		s->s->samples(&s->st);
+
+		// in_frames is now the input taken, a stage which can take none and makes no output has failed
+		if (!s->st.in_frames && !s->st.out_frames) {
+			LOG_ERROR("processing stage %s dropped %u frames", s->s->name, frames);
+			process.dropped += frames;
+			break;
+		}
+
+		_run_chain(i + 1, s->st.outbuf, s->st.out_frames);
+
+		buf += s->st.in_frames * BYTES_PER_FRAME;
+		frames -= s->st.in_frames;
+	}
+}
+
+// drain at end of track - each stage is drained in turn, its remaining output passing through the stages after it
+static void _drain_chain(void) {
+	unsigned i;
+
+	for (i = 0; i < stages && !pipeline.abort; i++) {
+		struct stage *s = &chain[i];
+		bool done;
+
+		if (!s->active || !s->s->drain) continue;
+
+		do {
+
+			s->st.outbuf = s->buf;
+
+			done = s->s->drain(&s->st);
+
+			_run_chain(i + 1, s->st.outbuf, s->st.out_frames);
+
+		} while (!done && !pipeline.abort);
+	}
+
+	LOG_DEBUG("processing track complete - frames in: %lu out: %lu cpu: " FMT_u64 "us", process.total_in, process.total_out,
+			  pipeline.cpu_us);
+
+	if (process.dropped) {
+		LOG_WARN("processing dropped %lu frames this track", process.dropped);
+	}
+}
+
+static void *process_thread() {
+
+	mutex_lock(pipeline.mutex);
+
+	while (true) {
+
+		if (!pipeline.abort && (pipeline.tail != pipeline.head || (pipeline.drain && pipeline.tail == pipeline.drain_at))) {
+
+			bool drain = pipeline.drain && pipeline.tail == pipeline.drain_at;
+			unsigned slot = pipeline.tail % PIPELINE_BLOCKS;
+			u64_t cpu;
+
+			pipeline.busy = true;
+			mutex_unlock(pipeline.mutex);
+
+			cpu = getcputime_us();
+
+			if (drain) {
+				_drain_chain();
+			} else {
+				// block contents were written before head was advanced
+				memory_barrier();
+				process.total_in += pipeline.frames[slot];
+				_run_chain(0, pipeline.block[slot], pipeline.frames[slot]);
+			}
+
+			cpu = getcputime_us() - cpu;
+
+			// finish with the block before handing it back
+			memory_barrier();
+
+			mutex_lock(pipeline.mutex);
+			pipeline.cpu_us += cpu;
+			pipeline.frames_out = process.total_out;
+			if (drain) {
+				pipeline.drain = false;
+			} else {
+				pipeline.tail++;
+			}
+			pipeline.busy = false;
+			SIGNAL(done);
 
 		} else {
 
-			// bail out if no space found after 100ms to avoid locking
-			LOG_ERROR("unable to get space in output buffer");
-			UNLOCK_O;
-			return;
+			pipeline.sleeping = true;
+			memory_barrier();
+			if (pipeline.abort || (pipeline.tail == pipeline.head && !pipeline.drain)) {
+				WAIT(wake, 1000);
+			}
+			pipeline.sleeping = false;
 		}
 	}
 
-	UNLOCK_O;
+	return 0;
+}
+
+// space for the codec to decode into, none if all blocks are queued - called with decode mutex set
+size_t process_space(void) {
+	bool space = pipeline.head - pipeline.tail < PIPELINE_BLOCKS;
+	// a block handed back is not written until the process thread has finished with it
+	memory_barrier();
+	return space ? process.max_in_frames * BYTES_PER_FRAME : 0;
 }
 
-// process samples - called with decode mutex set
+// queue samples for processing - called with decode mutex set
 void process_samples(void) {
 
-	SAMPLES_FUNC(&process);
+	pipeline.frames[pipeline.head % PIPELINE_BLOCKS] = process.in_frames;
+	memory_barrier();
+	pipeline.head++;
 
-	_write_samples();
+	_wake();
 
+	process.inbuf = pipeline.block[pipeline.head % PIPELINE_BLOCKS];
 	process.in_frames = 0;
 }
 
-// drain at end of track - called with decode mutex set
+// drain at end of track once the queued blocks are processed - called with decode mutex set
 void process_drain(void) {
-	bool done;
 
-	do {
+	pipeline.drain_at = pipeline.head;
+	memory_barrier();
+	pipeline.drain = true;
 
-		done = DRAIN_FUNC(&process);
+	_wake();
+}
+
+// output has played frames from outputbuf, wake the process thread if it is waiting for space - called with outputbuf
+// mutex set, which orders this against the process thread finding outputbuf full
+void _process_output_space(void) {
+	if (pipeline.space_wait) {
+		mutex_lock(pipeline.mutex);
+		pipeline.space_wait = false;
+		SIGNAL(wake);
+		mutex_unlock(pipeline.mutex);
+	}
+}
 
-		_write_samples();
+// cpu time and frames written by the process thread this track so far - called with decode mutex set
+void process_stats(u64_t *cpu_us, u64_t *frames) {
+	mutex_lock(pipeline.mutex);
+	*cpu_us = pipeline.cpu_us;
+	*frames = pipeline.frames_out;
+	mutex_unlock(pipeline.mutex);
+}
 
-	} while (!done);
+// true once the process thread has written everything queued so the chain can be changed - called with decode mutex set
+bool process_idle(void) {
+	bool idle;
+	mutex_lock(pipeline.mutex);
+	idle = !pipeline.busy && (pipeline.abort || (pipeline.tail == pipeline.head && !pipeline.drain));
+	mutex_unlock(pipeline.mutex);
+	return idle;
+}
 
-	LOG_DEBUG("processing track complete - frames in: %lu out: %lu", process.total_in, process.total_out);
-}	
+// wait up to ms for the process thread to finish a block, returns at once if it is idle - called with no mutex
+void process_wait(unsigned ms) {
+	mutex_lock(pipeline.mutex);
+	if (pipeline.busy || (!pipeline.abort && (pipeline.tail != pipeline.head || pipeline.drain))) {
+		WAIT(done, ms);
+	}
+	mutex_unlock(pipeline.mutex);
+}
 
 // new stream - called with decode mutex set
+// the decode thread does not run the codec for a new stream until process_idle, so the chain is not in use here
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]) {
 
-	bool active = NEWSTREAM_FUNC(&process, raw_sample_rate, supported_rates);
+	unsigned rate = raw_sample_rate;
+	unsigned frames, max_in_frames;
+	u64_t latency = 0;
+	bool active = false;
+	unsigned i;
 
-	LOG_INFO("processing: %s", active ? "active" : "inactive");
+	process.in_frames = process.out_frames = 0;
+	process.total_in = process.total_out = 0;
+	process.dropped = 0;
+	pipeline.cpu_us = pipeline.frames_out = 0;
 
-	*direct = !active;
+	max_in_frames = frames = codec->min_space / BYTES_PER_FRAME;
+
+	for (i = 0; i < stages; i++) {
+		struct stage *s = &chain[i];
 
-	if (active) {
+		s->active = s->s->newstream(&s->st, rate, supported_rates);
 
-		unsigned max_in_frames, max_out_frames;
+		LOG_INFO("processing stage %s: %s", s->s->name, s->active ? "active" : "inactive");
 
-		process.in_frames = process.out_frames = 0;
-		process.total_in = process.total_out = 0;
+		if (!s->active) continue;
 
-		max_in_frames = codec->min_space / BYTES_PER_FRAME ;
+		active = true;
 
-		// increase size of output buffer by 10% as output rate is not an exact multiple of input rate
-		if (process.out_sample_rate % process.in_sample_rate == 0) {
-			max_out_frames = max_in_frames * (process.out_sample_rate / process.in_sample_rate);
+		s->st.max_in_frames = frames;
+
+		// stage output can be 10% larger than its input scaled by the rate change when not an exact multiple
+		if (s->st.out_sample_rate % s->st.in_sample_rate == 0) {
+			frames = frames * (s->st.out_sample_rate / s->st.in_sample_rate);
 		} else {
-			max_out_frames = (int)(1.1 * (float)max_in_frames * (float)process.out_sample_rate / (float)process.in_sample_rate);
+			frames = (unsigned)(1.1 * (float)frames * (float)s->st.out_sample_rate / (float)s->st.in_sample_rate);
+		}
+
+		s->st.max_out_frames = frames;
+
+		rate = s->st.out_sample_rate;
+	}
+
+	*direct = !active;
+
+	if (!active) {
+		LOG_INFO("processing: inactive");
+		return raw_sample_rate;
+	}
+
+	process.in_sample_rate = raw_sample_rate;
+	process.out_sample_rate = rate;
+	process.max_out_frames = frames;
+
+	if (process.max_in_frames != max_in_frames) {
+		LOG_DEBUG("creating process blocks frames: %u", max_in_frames);
+		for (i = 0; i < PIPELINE_BLOCKS; i++) {
+			if (pipeline.block[i]) free(pipeline.block[i]);
+			pipeline.block[i] = malloc(max_in_frames * BYTES_PER_FRAME);
 		}
+		process.max_in_frames = max_in_frames;
+	}
 
-		if (process.max_in_frames != max_in_frames) {
-			LOG_DEBUG("creating process buf in frames: %u", max_in_frames);
-			if (process.inbuf) free(process.inbuf);
-			process.inbuf = malloc(max_in_frames * BYTES_PER_FRAME);
-			process.max_in_frames = max_in_frames;
+	for (i = 0; i < stages; i++) {
+		struct stage *s = &chain[i];
+		if (s->active && s->buf_frames != s->st.max_out_frames) {
+			LOG_DEBUG("creating process buf for %s frames: %u", s->s->name, s->st.max_out_frames);
+			if (s->buf) free(s->buf);
+			s->buf = malloc(s->st.max_out_frames * BYTES_PER_FRAME);
+			s->buf_frames = s->buf ? s->st.max_out_frames : 0;
 		}
-		
-		if (process.max_out_frames != max_out_frames) {
-			LOG_DEBUG("creating process buf out frames: %u", max_out_frames);
-			if (process.outbuf) free(process.outbuf);
-			process.outbuf = malloc(max_out_frames * BYTES_PER_FRAME);
-			process.max_out_frames = max_out_frames;
+		if (s->active && !s->buf) {
+			active = false;
 		}
-		
-		if (!process.inbuf || !process.outbuf) {
-			LOG_ERROR("malloc fail creating process buffers");
-			*direct = true;
-			return raw_sample_rate;
+	}
+
+	process.inbuf = pipeline.block[pipeline.head % PIPELINE_BLOCKS];
+
+	for (i = 0; i < PIPELINE_BLOCKS; i++) {
+		active = active && pipeline.block[i];
+	}
+	if (!active) {
+		LOG_ERROR("malloc fail creating process buffers");
+		process.max_in_frames = 0;
+		*direct = true;
+		return raw_sample_rate;
+	}
+
+	for (i = 0; i < stages; i++) {
+		struct stage *s = &chain[i];
+		if (s->active && s->s->latency) {
+			latency += (u64_t)s->s->latency(&s->st) * rate / s->st.out_sample_rate;
 		}
-		
-		return process.out_sample_rate;
 	}
+	process.latency = (unsigned)latency;
+
+	LOG_INFO("processing: %u -> %u latency: %u frames", raw_sample_rate, rate, process.latency);
+
+	return rate;
+}
 
-	return raw_sample_rate;
+// stop the process thread writing so a flush can take the decode mutex - called with no mutex
+void process_abort(void) {
+	mutex_lock(pipeline.mutex);
+	pipeline.abort = true;
+	SIGNAL(wake);
+	mutex_unlock(pipeline.mutex);
 }
 
-// process flush - called with decode mutex set
+// process flush - called with decode mutex set after process_abort
 void process_flush(void) {
+	unsigned i;
 
 	LOG_INFO("process flush");
 
-	FLUSH_FUNC();
+	mutex_lock(pipeline.mutex);
+	pipeline.abort = true;
+	while (pipeline.busy) {
+		WAIT(done, 100);
+	}
+	// the process thread is idle so the ring can be emptied from here
+	pipeline.tail = pipeline.head;
+	pipeline.drain = false;
+	mutex_unlock(pipeline.mutex);
+
+	for (i = 0; i < stages; i++) {
+		chain[i].s->flush();
+	}
 
+	process.inbuf = pipeline.block[pipeline.head % PIPELINE_BLOCKS];
 	process.in_frames = 0;
+
+	mutex_lock(pipeline.mutex);
+	pipeline.abort = false;
+	mutex_unlock(pipeline.mutex);
 }
 
-// init - called with no mutex
-void process_init(char *opt) {
+static bool _find_stage(struct process_stage *s) {
+	unsigned i;
+	for (i = 0; i < stages; i++) {
+		if (chain[i].s == s) return true;
+	}
+	return false;
+}
 
-	bool enabled = INIT_FUNC(opt);
+// init - called with no mutex
+// chain = <stage>[=<params>][,<stage>[=<params>]]..., stages run in the order given
+// resample = params for the resample stage when not given in the chain, chain defaults to resample alone
+void process_init(char *chain_opt, char *resample) {
+	char *names[MAX_STAGES], *params[MAX_STAGES];
+	unsigned n = 0, i;
+	char *p = chain_opt ? chain_opt : "resample";
 
 	memset(&process, 0, sizeof(process));
+	stages = 0;
+
+	// split the chain before initialising stages as they parse their own params
+	while (p && *p && n < MAX_STAGES) {
+		char *next = strchr(p, ',');
+		char *eq;
+		if (next) *next++ = '\0';
+		if ((eq = strchr(p, '='))) *eq++ = '\0';
+		names[n] = p;
+		params[n] = eq;
+		n++;
+		p = next;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct process_stage *s = NULL;
+
+#if RESAMPLE
+		if (!strcmp(names[i], "resample")) s = register_resample(params[i] ? params[i] : resample);
+#endif
+		if (!strcmp(names[i], "upsample")) s = register_upsample(params[i]);
+
+		// default chain falls back to native upsampling if libsoxr can't be loaded
+		if (!s && !chain_opt && !strcmp(names[i], "resample")) {
+			LOG_INFO("using upsample in place of resample");
+			s = register_upsample(NULL);
+		}
+
+		if (!s) {
+			LOG_WARN("processing stage %s not available", names[i]);
+			continue;
+		}
+
+		if (_find_stage(s)) {
+			LOG_WARN("processing stage %s already in chain", names[i]);
+			continue;
+		}
+
+		chain[stages++].s = s;
+		LOG_INFO("processing stage %u: %s", stages, s->name);
+	}
 
-	if (enabled) {
-		LOCK_D;
-		decode.process = true;
-		UNLOCK_D;
+	if (!stages) {
+		return;
 	}
+
+	mutex_create(pipeline.mutex);
+#if !WIN
+	pthread_cond_init(&pipeline.wake, NULL);
+	pthread_cond_init(&pipeline.done, NULL);
+#else
+	pipeline.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pipeline.done = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+
+#if LINUX || OSX || FREEBSD
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+#ifdef PTHREAD_STACK_MIN
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + PROCESS_THREAD_STACK_SIZE);
+#endif
+		pthread_create(&pipeline.thread, &attr, process_thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
+#endif
+#if WIN
+	pipeline.thread = CreateThread(NULL, PROCESS_THREAD_STACK_SIZE, (LPTHREAD_START_ROUTINE)&process_thread, NULL, 0, NULL);
+#endif
+
+	LOCK_D;
+	decode.process = true;
+	UNLOCK_D;
 }
 
 #endif // #if PROCESS
@@ -30,9 +30,21 @@
 
 extern log_level loglevel;
 
+// resamplers kept across tracks - quality params are fixed once parsed so instances are keyed on rate pair only
+#define MAX_CACHED 4
+
+struct soxr_cache {
+	soxr_t resampler;
+	unsigned in_rate;
+	unsigned out_rate;
+	u32_t last_used;
+};
+
 struct soxr {
 	soxr_t resampler;
 	size_t old_clips;
+	struct soxr_cache cache[MAX_CACHED];
+	u32_t uses;
 	unsigned long q_recipe;
 	unsigned long q_flags;
 	double q_precision;         /* Conversion precision (in bits).           20    */
@@ -49,8 +61,10 @@ struct soxr {
 	soxr_t (* soxr_create)(double, double, unsigned, soxr_error_t *, 
 						   soxr_io_spec_t const *, soxr_quality_spec_t const *, soxr_runtime_spec_t const *);
 	void (* soxr_delete)(soxr_t);
+	soxr_error_t (* soxr_clear)(soxr_t);
 	soxr_error_t (* soxr_process)(soxr_t, soxr_in_t, size_t, size_t *, soxr_out_t, size_t olen, size_t *);
 	size_t *(* soxr_num_clips)(soxr_t);
+	double (* soxr_delay)(soxr_t);
 #if RESAMPLE_MP
 	soxr_runtime_spec_t (* soxr_runtime_spec)(unsigned num_threads);
 #endif
@@ -67,7 +81,7 @@ static struct soxr *r;
 #endif
 
 
-void resample_samples(struct processstate *process) {
+static void resample_samples(struct processstate *process) {
 	size_t idone, odone;
 	size_t clip_cnt;
 	
@@ -75,15 +89,17 @@ void resample_samples(struct processstate *process) {
 		SOXR(r, process, r->resampler, process->inbuf, process->in_frames, &idone, process->outbuf, process->max_out_frames, &odone);
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
+		process->in_frames = process->out_frames = 0;
 		return;
 	}
 	
 	if (idone != process->in_frames) {
-		// should not get here if buffers are big enough...
-		LOG_ERROR("should not get here - partial sox process: %u of %u processed %u of %u out",
-				  (unsigned)idone, process->in_frames, (unsigned)odone, process->max_out_frames);
+		// output buffer full, the rest of the input is offered again once this output is passed on
+		LOG_SDEBUG("partial sox process: %u of %u processed %u of %u out",
+				   (unsigned)idone, process->in_frames, (unsigned)odone, process->max_out_frames);
 	}
 	
+	process->in_frames = idone;
 	process->out_frames = odone;
 	process->total_in  += idone;
 	process->total_out += odone;
@@ -95,13 +111,14 @@ void resample_samples(struct processstate *process) {
 	}
 }
 
-bool resample_drain(struct processstate *process) {
+static bool resample_drain(struct processstate *process) {
 	size_t odone;
 	size_t clip_cnt;
 		
 	soxr_error_t error = SOXR(r, process, r->resampler, NULL, 0, NULL, process->outbuf, process->max_out_frames, &odone);
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
+		process->out_frames = 0;
 		return true;
 	}
 	
@@ -118,9 +135,7 @@ bool resample_drain(struct processstate *process) {
 
 		LOG_INFO("resample track complete - total track clips: %u", r->old_clips);
 
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
-
+		// resampler is left in the cache and cleared when next used
 		return true;
 
 	} else {
@@ -129,7 +144,35 @@ bool resample_drain(struct processstate *process) {
 	}
 }
 
-bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+static struct soxr_cache *_find_cached(unsigned in_rate, unsigned out_rate) {
+	int i;
+	for (i = 0; i < MAX_CACHED; i++) {
+		if (r->cache[i].resampler && r->cache[i].in_rate == in_rate && r->cache[i].out_rate == out_rate) {
+			return &r->cache[i];
+		}
+	}
+	return NULL;
+}
+
+// free slot, else the least recently used one which is deleted
+static struct soxr_cache *_evict_cached(void) {
+	struct soxr_cache *c = &r->cache[0];
+	int i;
+	for (i = 0; i < MAX_CACHED; i++) {
+		if (!r->cache[i].resampler) {
+			return &r->cache[i];
+		}
+		if (r->cache[i].last_used < c->last_used) {
+			c = &r->cache[i];
+		}
+	}
+	LOG_DEBUG("dropping cached resampler %u -> %u", c->in_rate, c->out_rate);
+	SOXR(r, delete, c->resampler);
+	c->resampler = NULL;
+	return c;
+}
+
+static bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
 	unsigned outrate = 0;
 	int i;
 
@@ -172,22 +215,36 @@ bool resample_newstream(struct processstate *process, unsigned raw_sample_rate,
 	process->in_sample_rate = raw_sample_rate;
 	process->out_sample_rate = outrate;
 
-	if (r->resampler) {
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
-	}
+	r->resampler = NULL;
 
 	if (raw_sample_rate != outrate) {
 
+		struct soxr_cache *c;
 		soxr_io_spec_t io_spec;
 		soxr_quality_spec_t q_spec;
 		soxr_error_t error;
+		u64_t start;
 #if RESAMPLE_MP
 		soxr_runtime_spec_t r_spec;
 #endif
 
 		LOG_INFO("resampling from %u -> %u", raw_sample_rate, outrate);
 
+		if ((c = _find_cached(raw_sample_rate, outrate)) != NULL) {
+			error = SOXR(r, clear, c->resampler);
+			if (!error) {
+				LOG_DEBUG("reusing cached resampler");
+				c->last_used = ++r->uses;
+				r->resampler = c->resampler;
+				// count clips from here in case soxr_clear does not reset them
+				r->old_clips = *(SOXR(r, num_clips, r->resampler));
+				return true;
+			}
+			LOG_INFO("soxr_clear error: %s", soxr_strerror(error));
+			SOXR(r, delete, c->resampler);
+			c->resampler = NULL;
+		}
+
 		io_spec = SOXR(r, io_spec, SOXR_INT32_I, SOXR_INT32_I);
 		io_spec.scale = r->scale;
 
@@ -213,17 +270,31 @@ bool resample_newstream(struct processstate *process, unsigned raw_sample_rate,
 				  "phase_response: %03.1f, flags: 0x%02x], soxr_io_spec_t[scale: %03.2f]", q_spec.precision,
 				  q_spec.passband_end, q_spec.stopband_begin, q_spec.phase_response, q_spec.flags, io_spec.scale);
 
+		c = _evict_cached();
+
+		start = gettime_us();
 #if RESAMPLE_MP
-		r->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, &r_spec);
+		c->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, &r_spec);
 #else
-		r->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, NULL);
+		c->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, NULL);
 #endif
 
 		if (error) {
 			LOG_INFO("soxr_create error: %s", soxr_strerror(error));
+			if (c->resampler) {
+				SOXR(r, delete, c->resampler);
+				c->resampler = NULL;
+			}
 			return false;
 		}
 
+		LOG_INFO("resampler created in %u us", (unsigned)(gettime_us() - start));
+
+		c->in_rate = raw_sample_rate;
+		c->out_rate = outrate;
+		c->last_used = ++r->uses;
+
+		r->resampler = c->resampler;
 		r->old_clips = 0;
 		return true;
 
@@ -234,13 +305,18 @@ bool resample_newstream(struct processstate *process, unsigned raw_sample_rate,
 	}
 }
 
-void resample_flush(void) {
+static void resample_flush(void) {
 	if (r->resampler) {
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
+		SOXR(r, clear, r->resampler);
+		r->old_clips = *(SOXR(r, num_clips, r->resampler));
 	}
 }
 
+// output frames held within soxr
+static unsigned resample_latency(struct processstate *process) {
+	return r->resampler ? (unsigned)SOXR(r, delay, r->resampler) : 0;
+}
+
 static bool load_soxr(void) {
 #if !LINKALL
 	void *handle = dlopen(LIBSOXR, RTLD_NOW);
@@ -255,8 +331,10 @@ static bool load_soxr(void) {
 	r->soxr_quality_spec = dlsym(handle, "soxr_quality_spec");
 	r->soxr_create = dlsym(handle, "soxr_create");
 	r->soxr_delete = dlsym(handle, "soxr_delete");
+	r->soxr_clear = dlsym(handle, "soxr_clear");
 	r->soxr_process = dlsym(handle, "soxr_process");
 	r->soxr_num_clips = dlsym(handle, "soxr_num_clips");
+	r->soxr_delay = dlsym(handle, "soxr_delay");
 #if RESAMPLE_MP
 	r->soxr_runtime_spec = dlsym(handle, "soxr_runtime_spec");
 #endif
@@ -272,25 +350,39 @@ static bool load_soxr(void) {
 	return true;
 }
 
-bool resample_init(char *opt) {
+struct process_stage *register_resample(char *opt) {
 	char *recipe = NULL, *flags = NULL;
 	char *atten = NULL;
 	char *precision = NULL, *passband_end = NULL, *stopband_begin = NULL, *phase_response = NULL;
 
+	static struct process_stage ret = {
+		"resample",        // name
+		false,             // in place
+		resample_newstream, // newstream
+		resample_samples,  // samples
+		resample_drain,    // drain
+		resample_flush,    // flush
+		resample_latency,  // latency
+	};
+
 	r = malloc(sizeof(struct soxr));
 	if (!r) {
 		LOG_WARN("resampling disabled");
-		return false;
+		return NULL;
 	}
 
 	r->resampler = NULL;
 	r->old_clips = 0;
+	memset(r->cache, 0, sizeof(r->cache));
+	r->uses = 0;
 	r->max_rate = false;
 	r->exception = false;
 
 	if (!load_soxr()) {
 		LOG_WARN("resampling disabled");
-		return false;
+		free(r);
+		r = NULL;
+		return NULL;
 	}
 
 	if (opt) {
@@ -361,7 +453,7 @@ bool resample_init(char *opt) {
 			r->max_rate ? "async" : "sync",
 			r->q_recipe, r->q_flags, r->scale, r->q_precision, r->q_passband_end, r->q_stopband_begin, r->q_phase_response);
 
-	return true;
+	return &ret;
 }
 
 #endif // #if RESAMPLE
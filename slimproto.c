@@ -88,6 +88,7 @@ static struct {
 	u32_t current_sample_rate;
 	u32_t last;
 	stream_state stream_state;
+	struct decode_stats decode_stats;
 } status;
 
 int autostart;
@@ -185,6 +186,9 @@ static void sendSTAT(const char *event, u32_t server_timestamp) {
 		LOG_SDEBUG("received bytesL: %u streambuf: %u outputbuf: %u calc elapsed: %u real elapsed: %u (diff: %d) device: %u delay: %d",
 				   (u32_t)status.stream_bytes, status.stream_full, status.output_full, ms_played, now - status.stream_start,
 				   ms_played - now + status.stream_start, status.device_frames * 1000 / status.current_sample_rate, now - status.updated);
+		LOG_SDEBUG("decode frames: " FMT_u64 " bytes: " FMT_u64 " decode: " FMT_u64 "us (max %uus) process: " FMT_u64 "us (max %uus) chain: " FMT_u64 "us",
+				   status.decode_stats.frames, status.decode_stats.bytes, status.decode_stats.decode_us, status.decode_stats.decode_max_us,
+				   status.decode_stats.process_us, status.decode_stats.process_max_us, status.decode_stats.chain_us);
 	}
 
 	send_packet((u8_t *)&pkt, sizeof(pkt));
@@ -291,12 +295,15 @@ static void process_strm(u8_t *pkt, int len) {
 		{
 			unsigned interval = unpackN(&strm->replay_gain);
 			LOCK_O;
-			output.pause_frames = interval * status.current_sample_rate / 1000;
-			if (interval) {
-				output.state = OUTPUT_PAUSE_FRAMES;
-			} else {
-				output.state = OUTPUT_STOPPED;
-				output.stop_time = gettime_ms();
+			// small sync corrections are made by playing slower, otherwise by pausing
+			if (!interval || !_varispeed_correct((int)(interval * status.current_sample_rate / 1000))) {
+				output.pause_frames = interval * status.current_sample_rate / 1000;
+				if (interval) {
+					output.state = OUTPUT_PAUSE_FRAMES;
+				} else {
+					output.state = OUTPUT_STOPPED;
+					output.stop_time = gettime_ms();
+				}
 			}
 			UNLOCK_O;
 			if (!interval) sendSTAT("STMp", 0);
@@ -307,8 +314,11 @@ static void process_strm(u8_t *pkt, int len) {
 		{
 			unsigned interval = unpackN(&strm->replay_gain);
 			LOCK_O;
-			output.skip_frames = interval * status.current_sample_rate / 1000;
-			output.state = OUTPUT_SKIP_FRAMES;				
+			// small sync corrections are made by playing faster, otherwise by skipping
+			if (!_varispeed_correct(-(int)(interval * status.current_sample_rate / 1000))) {
+				output.skip_frames = interval * status.current_sample_rate / 1000;
+				output.state = OUTPUT_SKIP_FRAMES;
+			}
 			UNLOCK_O;
 			LOG_DEBUG("skip ahead interval: %u", interval);
 		}
@@ -348,15 +358,9 @@ static void process_strm(u8_t *pkt, int len) {
 				LOG_WARN("header too long: %u", header_len);
 				break;
 			}
-			if (strm->format != '?') {
-				codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
-			} else if (autostart >= 2) {
-				// extension to slimproto to allow server to detect codec from response header and send back in codc message
-				LOG_DEBUG("streaming unknown codec");
-			} else {
-				LOG_WARN("unknown codec requires autostart >= 2");
-				break;
-			}
+			// unknown codec '?' is detected by the decoder from the stream data
+			// with autostart >= 2 the server may also detect it from the response header and send a codc message which overrides
+			codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
 			if (ip == LOCAL_PLAYER_IP && port == LOCAL_PLAYER_PORT) {
 				// extension to slimproto for LocalPlayer - header is filename not http header, don't expect cont
 				stream_file(header, header_len, strm->threshold * 1024);
@@ -690,6 +694,7 @@ static void slimproto_run() {
 				}
 			}
 			_decode_state = decode.state;
+			status.decode_stats = decode.stats;
 			UNLOCK_D;
 			
 			LOCK_O;
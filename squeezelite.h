@@ -96,12 +96,11 @@
 
 #if defined(RESAMPLE) || defined(RESAMPLE_MP)
 #undef  RESAMPLE
-#define RESAMPLE  1 // resampling
-#define PROCESS   1 // any sample processing (only resampling at present)
+#define RESAMPLE  1 // resampling using libsoxr
 #else
 #define RESAMPLE  0
-#define PROCESS   0
 #endif
+#define PROCESS   1 // any sample processing, always built as native upsampling needs no library
 #if defined(RESAMPLE_MP)
 #undef RESAMPLE_MP
 #define RESAMPLE_MP 1
@@ -208,6 +207,7 @@
 
 // config options
 #define STREAMBUF_SIZE (2 * 1024 * 1024)
+#define STREAMBUF_MIRROR (32 * 1024) // allows decoders to read data wrapping round the end of streambuf contiguously
 #define OUTPUTBUF_SIZE (44100 * 8 * 10)
 #define OUTPUTBUF_SIZE_CROSSFADE (OUTPUTBUF_SIZE * 12 / 10)
 
@@ -252,6 +252,8 @@
 #define DECODE_THREAD_STACK_SIZE 128 * 1024
 #define OUTPUT_THREAD_STACK_SIZE  64 * 1024
 #define IR_THREAD_STACK_SIZE      64 * 1024
+#define DSD_THREAD_STACK_SIZE     32 * 1024
+#define PROCESS_THREAD_STACK_SIZE 128 * 1024
 #define thread_t pthread_t;
 #define closesocket(s) close(s)
 #define last_error() errno
@@ -279,6 +281,7 @@ typedef int64_t   s64_t;
 #define mutex_unlock(m) pthread_mutex_unlock(&m)
 #define mutex_destroy(m) pthread_mutex_destroy(&m)
 #define thread_type pthread_t
+#define memory_barrier() __sync_synchronize()
 
 #endif
 
@@ -291,6 +294,8 @@ typedef int64_t   s64_t;
 #define STREAM_THREAD_STACK_SIZE (1024 * 64)
 #define DECODE_THREAD_STACK_SIZE (1024 * 128)
 #define OUTPUT_THREAD_STACK_SIZE (1024 * 64)
+#define DSD_THREAD_STACK_SIZE (1024 * 32)
+#define PROCESS_THREAD_STACK_SIZE (1024 * 128)
 
 typedef unsigned __int8  u8_t;
 typedef unsigned __int16 u16_t;
@@ -313,6 +318,7 @@ typedef BOOL bool;
 #define mutex_unlock(m) ReleaseMutex(m)
 #define mutex_destroy(m) CloseHandle(m)
 #define thread_type HANDLE
+#define memory_barrier() MemoryBarrier()
 
 #define usleep(x) Sleep(x/1000)
 #define sleep(x) Sleep(x*1000)
@@ -384,7 +390,10 @@ struct wake {
 
 #define BYTES_PER_FRAME 8
 
+#define MAX_CHANNELS 8 // max decoded channels, downmixed to stereo
+
 #define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
 
 // logging
 typedef enum { lERROR = 0, lWARN, lINFO, lDEBUG, lSDEBUG } log_level;
@@ -403,6 +412,8 @@ typedef enum { EVENT_TIMEOUT = 0, EVENT_READ, EVENT_WAKE } event_type;
 
 char *next_param(char *src, char c);
 u32_t gettime_ms(void);
+u64_t gettime_us(void);
+u64_t getcputime_us(void);
 void get_mac(u8_t *mac);
 void set_nonblock(sockfd s);
 int connect_timeout(sockfd sock, const struct sockaddr *addr, socklen_t addrlen, int timeout);
@@ -413,6 +424,7 @@ void packN(u32_t *dest, u32_t val);
 void packn(u16_t *dest, u16_t val);
 u32_t unpackN(u32_t *src);
 u16_t unpackn(u16_t *src);
+double bessel_i0(double x);
 #if OSX
 void set_nosigpipe(sockfd s);
 #else
@@ -442,6 +454,7 @@ struct buffer {
 	u8_t *wrap;
 	size_t size;
 	size_t base_size;
+	size_t mirror;
 	mutex_type mutex;
 };
 
@@ -452,10 +465,16 @@ unsigned _buf_cont_read(struct buffer *buf);
 unsigned _buf_cont_write(struct buffer *buf);
 void _buf_inc_readp(struct buffer *buf, unsigned by);
 void _buf_inc_writep(struct buffer *buf, unsigned by);
+unsigned _buf_mirror(struct buffer *buf, unsigned want);
+void _buf_flush(struct buffer *buf);
+unsigned _buf_read_copy(struct buffer *buf, u8_t *dest, unsigned want);
+unsigned buf_read_view(struct buffer *buf, u8_t **ptr, unsigned want);
+unsigned buf_read_copy(struct buffer *buf, u8_t *dest, unsigned want);
+void buf_read_consume(struct buffer *buf, unsigned by);
 void buf_flush(struct buffer *buf);
 void buf_adjust(struct buffer *buf, size_t mod);
 void _buf_resize(struct buffer *buf, size_t size);
-void buf_init(struct buffer *buf, size_t size);
+void buf_init(struct buffer *buf, size_t size, size_t mirror);
 void buf_destroy(struct buffer *buf);
 
 // slimproto.c
@@ -481,6 +500,10 @@ struct streamstate {
 	u32_t meta_next;
 	u32_t meta_left;
 	bool  meta_send;
+	// local file seek
+	u32_t seek_ms;    // start time requested with the filename, cleared by the decoder once resolved
+	u32_t seek_start; // time of the request to measure seek latency
+	u64_t file_size;  // size of local file, 0 for network streams
 };
 
 void stream_init(log_level level, unsigned stream_buf_size);
@@ -488,14 +511,31 @@ void stream_close(void);
 void stream_file(const char *header, size_t header_len, unsigned threshold);
 void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait);
 bool stream_disconnect(void);
+u64_t _stream_tell(void);
+bool _stream_seek(u64_t offset);
 
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
 
+// decode performance counters, accumulated per track and per codec
+struct decode_stats {
+	u64_t frames;         // frames written to outputbuf
+	u64_t bytes;          // bytes consumed from streambuf
+	u64_t decode_us;      // cpu time within codec decode calls
+	u64_t process_us;     // cpu time of the decode thread within process_samples and process_drain
+	u64_t chain_us;       // cpu time of the process thread running the chain
+	u32_t decode_max_us;  // longest single decode call
+	u32_t process_max_us; // longest single process call
+	u32_t calls;
+	u32_t locks;          // lock acquisitions by the decode loop, excluding those within codecs
+	u32_t sample_rate;
+};
+
 struct decodestate {
 	decode_state state;
 	bool new_stream;
 	mutex_type mutex;
+	struct decode_stats stats; // current track
 #if PROCESS
 	bool direct;
 	bool process;
@@ -509,6 +549,19 @@ struct processstate {
 	unsigned in_frames, out_frames;
 	unsigned in_sample_rate, out_sample_rate;
 	unsigned long total_in, total_out;
+	unsigned latency;          // frames at out_sample_rate, summed over active stages of the chain
+	unsigned long dropped;     // frames lost to stage errors this track, output is never dropped for lack of space
+};
+
+// a stage of the processing chain, each stage is called with its own processstate describing its input and output
+struct process_stage {
+	char *name;
+	bool in_place;             // output is written over the input, outbuf is the same as inbuf
+	bool (*newstream)(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
+	void (*samples)(struct processstate *process); // sets in_frames to the input taken if less than offered
+	bool (*drain)(struct processstate *process);
+	void (*flush)(void);
+	unsigned (*latency)(struct processstate *process); // frames at the stage output rate, may be NULL
 };
 #endif
 
@@ -528,29 +581,107 @@ void decode_flush(void);
 unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]);
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
 
+// convert.c
+void convert_init(char *opt);
+void convert_s32p(s32_t *optr, const s32_t *const iptr[], unsigned channels, unsigned shift, frames_t frames);
+void convert_s32(s32_t *optr, const s32_t *iptr, unsigned channels, frames_t frames);
+void convert_fltp(s32_t *optr, const float *const iptr[], unsigned channels, frames_t frames);
+void convert_s16_inplace(void *buf, size_t samples);
+void convert_flt_inplace(void *buf, size_t samples);
+
+// mp4.c
+#define ALAC_CONFIG_LEN 36 // alac atom within the mp4 sample description
+
+enum mp4_box { MP4_NONE = 0, MP4_STSC, MP4_STCO, MP4_CO64 };
+
+struct mp4_stsc {
+	u32_t first, samples;
+};
+
+// sample table of one track - stsc runs and zigzag delta varint coded chunk offsets, read entry by entry as the
+// boxes may not fit contiguously in streambuf, and a walker giving the offset and first sample of the next chunk
+struct mp4_stbl {
+	struct mp4_stsc *stsc;
+	u32_t stsc_len, stsc_size, stsc_first;
+	u8_t *offsets;
+	u32_t offsets_len, offsets_size;
+	u32_t chunks;
+	u64_t last_offset;
+	enum mp4_box box;
+	u32_t box_remain;
+	bool  chunk_valid;
+	u32_t nextchunk;
+	u32_t offsets_read;
+	u32_t stsc_idx;
+	u32_t chunk_spc;
+	u32_t chunk_sample;
+	u64_t chunk_offset;
+};
+
+// mp4 framing of an alac track
+struct mp4_alac {
+	u8_t  config[ALAC_CONFIG_LEN];
+	bool  config_found;
+	unsigned trak, play;
+	u32_t *sample_sizes;
+	u32_t sample_sizes_len; // allocated entries, kept between tracks
+	u32_t sample_size;
+	u32_t sample_count;
+	u32_t sizes_read;
+	u32_t sample;
+	u64_t consume;
+	u64_t pos;
+	u8_t  *pkt;
+	u32_t pkt_len;
+	struct mp4_stbl stbl;
+};
+
+void mp4_stbl_reset(struct mp4_stbl *t);
+void mp4_stbl_free(struct mp4_stbl *t);
+bool mp4_stbl_box(struct mp4_stbl *t, const char *type, u32_t len, u32_t entries);
+int  mp4_stbl_read(struct mp4_stbl *t, const u8_t *ptr, size_t bytes);
+void mp4_stbl_rewind(struct mp4_stbl *t);
+bool mp4_stbl_next(struct mp4_stbl *t);
+void mp4_alac_reset(struct mp4_alac *m);
+void mp4_alac_free(struct mp4_alac *m);
+int  _mp4_alac_header(struct mp4_alac *m);
+int  mp4_alac_packet(struct mp4_alac *m, unsigned pad);
+bool _mp4_alac_seek(struct mp4_alac *m, u32_t sample);
+
 #if PROCESS
 // process.c
 void process_samples(void);
 void process_drain(void);
 void process_flush(void);
+void process_abort(void);
+size_t process_space(void);
+bool process_idle(void);
+void process_wait(unsigned ms);
+void _process_output_space(void);
+void process_stats(u64_t *cpu_us, u64_t *frames);
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]);
-void process_init(char *opt);
+void process_init(char *chain, char *resample);
 #endif
 
 #if RESAMPLE
 // resample.c
-void resample_samples(struct processstate *process);
-bool resample_drain(struct processstate *process);
-bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
-void resample_flush(void);
-bool resample_init(char *opt);
+struct process_stage *register_resample(char *opt);
+#endif
+
+#if PROCESS
+// upsample.c
+struct process_stage *register_upsample(char *opt);
 #endif
 
 // output.c output_alsa.c output_pa.c output_pack.c
 typedef enum { OUTPUT_OFF = -1, OUTPUT_STOPPED = 0, OUTPUT_BUFFER, OUTPUT_RUNNING, 
 			   OUTPUT_PAUSE_FRAMES, OUTPUT_SKIP_FRAMES, OUTPUT_START_AT } output_state;
 
-typedef enum { S32_LE, S24_LE, S24_3LE, S16_LE } output_format;
+typedef enum { S32_LE, S24_LE, S24_3LE, S16_LE, U8, U16_LE, U16_BE, U32_LE, U32_BE } output_format;
+
+#if DSD
+typedef enum { DOP = 0, DSD_U8, DSD_U16_LE, DSD_U16_BE, DSD_U32_LE, DSD_U32_BE } dsd_format;
+#endif
 
 typedef enum { FADE_INACTIVE = 0, FADE_DUE, FADE_ACTIVE } fade_state;
 typedef enum { FADE_UP = 1, FADE_DOWN, FADE_CROSS } fade_dir;
@@ -611,7 +742,11 @@ struct outputstate {
 	bool next_dop;             // set in decode thread
 	bool dop;
 	bool has_dop;              // set in dop_init - output device supports dop
+	bool dop_phase;            // marker of the next dop frame, 0x05 when false, 0xFA when true
 	unsigned dop_delay;        // set in dop_init - delay in ms switching to/from dop
+	bool next_dsd;             // set in decode thread - native dsd rather than dop
+	bool dsd;
+	dsd_format dsd_fmt;        // set in dop_init - native dsd format of output device, DOP if not supported
 #endif
 };
 
@@ -622,6 +757,13 @@ void output_flush(void);
 frames_t _output_frames(frames_t avail);
 void _checkfade(bool);
 
+// output_varispeed.c
+void varispeed_init(log_level level, char *opt);
+// _* called with mutex locked
+frames_t _varispeed_frames(frames_t cont_frames, frames_t size);
+bool _varispeed_correct(int frames);
+void _varispeed_flush(void);
+
 // output_alsa.c
 #if ALSA
 void list_devices(void);
@@ -653,6 +795,10 @@ void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gai
 void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR);
 s32_t gain(s32_t gain, s32_t sample);
 s32_t to_gain(float f);
+#if DSD
+void _apply_dop(u32_t *optr, u32_t *iptr, frames_t cnt, bool invert, bool *phase);
+void _scale_and_pack_dop_frames(void *outputptr, s32_t *inputptr, frames_t cnt, bool invert, bool *phase, output_format format);
+#endif
 
 // output_vis.c
 #if VISEXPORT
@@ -667,9 +813,10 @@ void vis_stop(void);
 // dop.c
 #if DSD
 bool is_flac_dop(u32_t *lptr, u32_t *rptr, frames_t frames);
-void update_dop(u32_t *ptr, frames_t frames, bool invert);
 void dop_silence_frames(u32_t *ptr, frames_t frames);
-void dop_init(bool enable, unsigned delay);
+void dsd_invert(u32_t *ptr, frames_t frames);
+void dsd_silence_frames(u32_t *ptr, frames_t frames);
+void dop_init(bool enable, unsigned delay, dsd_format format);
 #endif
 
 // codecs
@@ -681,6 +828,7 @@ struct codec *register_mad(void);
 struct codec *register_mpg(void);
 struct codec *register_vorbis(void);
 struct codec *register_faad(void);
+struct codec *register_alac(void);
 struct codec *register_dsd(void);
 struct codec *register_ff(const char *codec);
 
@@ -40,6 +40,15 @@ static sockfd fd;
 
 struct streamstate stream;
 
+// local file position of the next byte read into streambuf, used to resolve decoder seeks
+static u64_t file_pos;
+
+#if WIN
+#define file_seek(fd, offset, whence) _lseeki64(fd, offset, whence)
+#else
+#define file_seek(fd, offset, whence) lseek(fd, offset, whence)
+#endif
+
 static void send_header(void) {
 	char *ptr = stream.header;
 	int len = stream.header_len;
@@ -105,6 +114,7 @@ static void *stream_thread() {
 			if (n > 0) {
 				_buf_inc_writep(streambuf, n);
 				stream.bytes += n;
+				file_pos += n;
 				LOG_SDEBUG("streambuf read %d bytes", n);
 			}
 			if (n < 0) {
@@ -294,7 +304,7 @@ void stream_init(log_level level, unsigned stream_buf_size) {
 	LOG_INFO("init stream");
 	LOG_DEBUG("streambuf size: %u", stream_buf_size);
 
-	buf_init(streambuf, stream_buf_size);
+	buf_init(streambuf, stream_buf_size, STREAMBUF_MIRROR);
 	if (streambuf->buf == NULL) {
 		LOG_ERROR("unable to malloc buffer");
 		exit(0);
@@ -340,6 +350,8 @@ void stream_close(void) {
 }
 
 void stream_file(const char *header, size_t header_len, unsigned threshold) {
+	char *frag;
+
 	buf_flush(streambuf);
 
 	LOCK;
@@ -348,6 +360,20 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 	memcpy(stream.header, header, header_len);
 	*(stream.header+header_len) = '\0';
 
+	// a start time may follow the filename as a media fragment "#t=<seconds>", the decoder resolves it to a file offset
+	stream.seek_ms = 0;
+	stream.seek_start = 0;
+	if ((frag = strstr(stream.header, "#t=")) != NULL) {
+		char *end;
+		double secs = strtod(frag + 3, &end);
+		if (end != frag + 3 && *end == '\0' && secs >= 0) {
+			*frag = '\0';
+			stream.header_len = frag - stream.header;
+			stream.seek_ms = (u32_t)(secs * 1000);
+			stream.seek_start = gettime_ms();
+		}
+	}
+
 	LOG_INFO("opening local file: %s", stream.header);
 
 #if WIN
@@ -357,9 +383,18 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 #endif
 
 	stream.state = STREAMING_FILE;
+	stream.file_size = 0;
+	file_pos = 0;
 	if (fd < 0) {
 		LOG_INFO("can't open file: %s", stream.header);
 		stream.state = DISCONNECT;
+	} else {
+		s64_t size = file_seek(fd, 0, SEEK_END);
+		stream.file_size = size > 0 ? size : 0;
+		file_seek(fd, 0, SEEK_SET);
+		if (stream.seek_ms) {
+			LOG_INFO("seek to: %u ms requested", stream.seek_ms);
+		}
 	}
 	wake_controller();
 	
@@ -375,6 +410,59 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 	UNLOCK;
 }
 
+// file offset of the next byte the decoder will read from streambuf, called with streambuf locked
+u64_t _stream_tell(void) {
+	return file_pos - _buf_used(streambuf);
+}
+
+// reposition a local file to an offset resolved by the decoder from the codec's seek index
+// called with streambuf locked, discards buffered data so the decoder resumes reading from offset
+bool _stream_seek(u64_t offset) {
+	u32_t start = gettime_ms();
+
+	if (!stream.file_size || offset > stream.file_size) {
+		return false;
+	}
+
+	// target already in streambuf - skip forward to it without touching the file
+	if (offset >= _stream_tell() && offset <= file_pos) {
+		_buf_inc_readp(streambuf, (unsigned)(offset - _stream_tell()));
+		LOG_INFO("seek to offset: " FMT_u64 " within streambuf", offset);
+		return true;
+	}
+
+	// end of file has already been reported to the server
+	if (stream.state == STOPPED) {
+		return false;
+	}
+
+	// file is closed once fully read, reopen it if the seek goes back into it
+	if (fd < 0) {
+#if WIN
+		fd = open(stream.header, O_RDONLY | O_BINARY);
+#else
+		fd = open(stream.header, O_RDONLY);
+#endif
+		if (fd < 0) {
+			LOG_WARN("can't reopen file: %s", stream.header);
+			return false;
+		}
+	}
+
+	if (file_seek(fd, offset, SEEK_SET) < 0) {
+		LOG_WARN("seek failed: %s", strerror(errno));
+		return false;
+	}
+
+	_buf_flush(streambuf);
+	file_pos = offset;
+	stream.state = STREAMING_FILE;
+
+	LOG_INFO("seek to offset: " FMT_u64 " took: %u ms", offset, gettime_ms() - start);
+
+	return true;
+}
+
 void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait) {
 	struct sockaddr_in addr;
 
@@ -409,6 +497,9 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 	LOCK;
 
 	fd = sock;
+	stream.seek_ms = 0;
+	stream.seek_start = 0;
+	stream.file_size = 0;
 	stream.state = SEND_HEADERS;
 	stream.cont_wait = cont_wait;
 	stream.meta_interval = 0;
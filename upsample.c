@@ -0,0 +1,366 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2016, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// native polyphase fir upsampling for simple ratios, needs no external library - only included when building with PROCESS set
+
+#include "squeezelite.h"
+
+#if PROCESS
+
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+extern log_level loglevel;
+
+#define UP_MAX_RATIO   16   // largest interpolation factor once the ratio is reduced, eg 44.1k -> 705.6k or 32k -> 48k (3/2)
+#define UP_MIN_TAPS    8
+#define UP_MAX_TAPS    256
+#define UP_TAPS        64   // default taps per phase
+#define UP_BLOCK       4096 // input frames taken per call
+#define UP_PASS        0.907 // passband edge as a fraction of the input nyquist at which images of it are fully rejected, 20k at 44.1k
+#define UP_ATTEN_MAX   140  // dB, longer filters widen the passband rather than go beyond this as samples are float
+
+// upsampling by l/m - each period of l outputs takes m inputs, output q of a period uses the coefficients of phase
+// q * m % l at an input offset of q * m / l, so coef holds the phases in the order they are used within a period
+// and each channel keeps its own float history of taps - 1 samples followed by input not yet used
+struct upsample {
+	unsigned taps;
+	float scale;
+	unsigned l, m;
+	float *coef;               // l sets of taps, reversed so they run forwards over the input
+	unsigned *offset;          // input offset of each output of a period
+	float *buf[2];
+	unsigned fill;             // samples in each channel buf including history
+	unsigned pad;              // zero input frames added at drain to flush the filter
+};
+
+static struct upsample *u;
+
+// prototype filter at l times the input rate, kaiser window design with the transition centred on the input nyquist
+static bool _design(unsigned l, unsigned m) {
+	unsigned t = u->taps, n = t * l, q, k;
+	double centre = (n - 1) / 2.0;
+	double trans = (1 - UP_PASS) / l;
+	double atten = 14.36 * trans * (n - 1) + 7.95;
+	double beta, sum = 0;
+	float *coef;
+	unsigned *offset;
+
+	if (atten > UP_ATTEN_MAX) {
+		atten = UP_ATTEN_MAX;
+		trans = (atten - 7.95) / (14.36 * (n - 1));
+	}
+
+	if (atten > 50) {
+		beta = 0.1102 * (atten - 8.7);
+	} else if (atten > 21) {
+		beta = 0.5842 * pow(atten - 21, 0.4) + 0.07886 * (atten - 21);
+	} else {
+		beta = 0;
+	}
+
+	coef = malloc(n * sizeof(float));
+	offset = malloc(l * sizeof(unsigned));
+
+	if (!coef || !offset) {
+		if (coef) free(coef);
+		if (offset) free(offset);
+		return false;
+	}
+
+	for (q = 0; q < l; ++q) {
+		unsigned phase = q * m % l;
+		offset[q] = q * m / l;
+		for (k = 0; k < t; ++k) {
+			// tap phase + k * l of the prototype multiplies the input k before the newest
+			double i = phase + (double)k * l - centre;
+			double r = i / centre;
+			double h = (i == 0 ? 1.0 : sin(M_PI * i / l) / (M_PI * i / l)) * bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+			coef[q * t + t - 1 - k] = (float)h;
+			sum += h;
+		}
+	}
+
+	// unity gain at dc for each phase, sum is over all phases
+	for (k = 0; k < n; ++k) {
+		coef[k] *= (float)(u->scale * l / sum);
+	}
+
+	if (u->coef) free(u->coef);
+	if (u->offset) free(u->offset);
+
+	u->coef = coef;
+	u->offset = offset;
+	u->l = l;
+	u->m = m;
+
+	LOG_INFO("upsample filter %u/%u: %u taps per phase, passband %.1f%% stopband %.0fdB", l, m, t,
+			 100 * (1 - trans * l), atten);
+
+	return true;
+}
+
+static inline s32_t _to_s32(float v) {
+	// 2147483647.0f rounds up to 2^31 so anything below it converts without overflow
+	return v >= 2147483647.0f ? 0x7fffffff : v <= -2147483648.0f ? (s32_t)0x80000000 : (s32_t)v;
+}
+
+// filter periods of one channel to every second sample of out, for m of 1 the inputs of consecutive outputs are adjacent
+// so outputs are made 8 at a time in fixed length loops which the compiler vectorises - buffers have room for the
+// extra inputs read by the last group of 8 whose outputs are not stored
+static void _filter(const float *x, unsigned periods, s32_t *out) {
+	unsigned t = u->taps, l = u->l, q, p, k, j;
+
+	for (q = 0; q < l; ++q) {
+		const float *c = u->coef + q * t;
+		const float *xq = x + u->offset[q];
+		for (p = 0; p < periods; p += 8) {
+			float acc[8] = { 0 };
+			for (k = 0; k < t; ++k) {
+				const float coef = c[k];
+				const float *xk = xq + p + k;
+				for (j = 0; j < 8; ++j) {
+					acc[j] += coef * xk[j];
+				}
+			}
+			for (j = 0; j < 8 && p + j < periods; ++j) {
+				out[2 * ((p + j) * l + q)] = _to_s32(acc[j]);
+			}
+		}
+	}
+}
+
+// as _filter for m above 1, consecutive outputs of a phase are m inputs apart so each output is a dot product of
+// adjacent taps and inputs made 8 taps at a time, taps are a multiple of 8
+static void _filter_m(const float *x, unsigned periods, s32_t *out) {
+	unsigned t = u->taps, l = u->l, m = u->m, q, p, k, j;
+
+	for (q = 0; q < l; ++q) {
+		const float *c = u->coef + q * t;
+		const float *xq = x + u->offset[q];
+		for (p = 0; p < periods; ++p) {
+			const float *xp = xq + p * m;
+			float acc[8] = { 0 };
+			for (k = 0; k < t; k += 8) {
+				const float *ck = c + k;
+				const float *xk = xp + k;
+				for (j = 0; j < 8; ++j) {
+					acc[j] += ck[j] * xk[j];
+				}
+			}
+			out[2 * (p * l + q)] = _to_s32(((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7])));
+		}
+	}
+}
+
+// run whole periods of the buffered input to outbuf and keep what is left as history, returns frames written
+static unsigned _upsample(s32_t *outbuf) {
+	unsigned hist = u->taps - 1;
+	unsigned periods = (u->fill - hist) / u->m;
+	unsigned used = periods * u->m;
+	unsigned c;
+
+	for (c = 0; c < 2; ++c) {
+		if (u->m == 1) {
+			_filter(u->buf[c], periods, outbuf + c);
+		} else {
+			_filter_m(u->buf[c], periods, outbuf + c);
+		}
+		memmove(u->buf[c], u->buf[c] + used, (u->fill - used) * sizeof(float));
+	}
+
+	u->fill -= used;
+
+	return periods * u->l;
+}
+
+// input that can be taken without the output of the call exceeding max_out_frames
+static unsigned _max_input(struct processstate *process) {
+	unsigned pending = u->fill - (u->taps - 1);
+	unsigned in = process->max_out_frames / u->l * u->m;
+	in = in > pending ? in - pending : 0;
+	return min(in, UP_BLOCK);
+}
+
+static void upsample_samples(struct processstate *process) {
+	s32_t *iptr = (s32_t *)(void *)process->inbuf;
+	float *l = u->buf[0] + u->fill;
+	float *r = u->buf[1] + u->fill;
+	unsigned in = min(process->in_frames, _max_input(process));
+	unsigned i;
+
+	for (i = 0; i < in; ++i) {
+		l[i] = (float)iptr[2 * i];
+		r[i] = (float)iptr[2 * i + 1];
+	}
+	u->fill += in;
+
+	process->in_frames = in;
+	process->out_frames = _upsample((s32_t *)(void *)process->outbuf);
+	process->total_in  += in;
+	process->total_out += process->out_frames;
+}
+
+// flush the filter with zero input so the tail of the track is output, may take more than one call
+static bool upsample_drain(struct processstate *process) {
+	unsigned in = min(u->pad, _max_input(process));
+
+	memset(u->buf[0] + u->fill, 0, in * sizeof(float));
+	memset(u->buf[1] + u->fill, 0, in * sizeof(float));
+	u->fill += in;
+	u->pad -= in;
+
+	process->out_frames = _upsample((s32_t *)(void *)process->outbuf);
+	process->total_out += process->out_frames;
+
+	if (!u->pad) {
+		LOG_INFO("upsample track complete");
+		return true;
+	}
+
+	return false;
+}
+
+static void upsample_flush(void) {
+	unsigned hist = u->taps - 1;
+	if (u->buf[0]) {
+		memset(u->buf[0], 0, hist * sizeof(float));
+		memset(u->buf[1], 0, hist * sizeof(float));
+	}
+	u->fill = hist;
+	// filter delay is about taps / 2 inputs, plus enough to complete a part period
+	u->pad = u->taps / 2 + u->m;
+}
+
+static unsigned _gcd(unsigned a, unsigned b) {
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static bool upsample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	unsigned outrate = 0, l = 0, m = 0;
+	int i;
+
+	// highest supported rate above the input which is a simple ratio of it, otherwise leave it to later stages
+	for (i = 0; supported_rates[i]; i++) {
+		unsigned g = _gcd(supported_rates[i], raw_sample_rate);
+		if (supported_rates[i] > raw_sample_rate && supported_rates[i] / g <= UP_MAX_RATIO) {
+			outrate = supported_rates[i];
+			l = outrate / g;
+			m = raw_sample_rate / g;
+			break;
+		}
+	}
+
+	process->in_sample_rate = raw_sample_rate;
+	process->out_sample_rate = outrate ? outrate : raw_sample_rate;
+
+	if (!outrate) {
+		LOG_INFO("upsample: no simple ratio for %u", raw_sample_rate);
+		return false;
+	}
+
+	if ((u->l != l || u->m != m) && !_design(l, m)) {
+		LOG_ERROR("malloc fail creating upsample filter");
+		u->l = u->m = 0;
+		return false;
+	}
+
+	if (!u->buf[0]) {
+		// history, pending input of a part period, a block of input and the reads of the last group of 8 outputs
+		size_t size = (UP_MAX_TAPS + UP_MAX_RATIO + UP_BLOCK + 8 * UP_MAX_RATIO) * sizeof(float);
+		u->buf[0] = calloc(1, size);
+		u->buf[1] = calloc(1, size);
+		if (!u->buf[0] || !u->buf[1]) {
+			LOG_ERROR("malloc fail creating upsample buffers");
+			if (u->buf[0]) free(u->buf[0]);
+			if (u->buf[1]) free(u->buf[1]);
+			u->buf[0] = u->buf[1] = NULL;
+			return false;
+		}
+	}
+
+	upsample_flush();
+
+	LOG_INFO("upsampling from %u -> %u", raw_sample_rate, outrate);
+
+	return true;
+}
+
+// output frames of filter delay
+static unsigned upsample_latency(struct processstate *process) {
+	return (u->taps * u->l - 1) / (2 * u->m);
+}
+
+// opt = <taps>:<attenuation>, taps per phase of the filter rounded up to a multiple of 8, attenuation in dB as for resample
+struct process_stage *register_upsample(char *opt) {
+	char *taps = NULL, *atten = NULL;
+
+	static struct process_stage ret = {
+		"upsample",        // name
+		false,             // in place
+		upsample_newstream, // newstream
+		upsample_samples,  // samples
+		upsample_drain,    // drain
+		upsample_flush,    // flush
+		upsample_latency,  // latency
+	};
+
+	u = calloc(1, sizeof(struct upsample));
+	if (!u) {
+		LOG_WARN("upsampling disabled");
+		return NULL;
+	}
+
+	u->taps = UP_TAPS;
+	// default to 1db of attenuation as for resample
+	u->scale = (float)pow(10, -1.0 / 20);
+
+	if (opt) {
+		taps = next_param(opt, ':');
+		atten = next_param(NULL, ':');
+	}
+
+	if (taps && taps[0] != '\0') {
+		unsigned t = (atoi(taps) + 7) & ~7;
+		u->taps = t < UP_MIN_TAPS ? UP_MIN_TAPS : t > UP_MAX_TAPS ? UP_MAX_TAPS : t;
+	}
+
+	if (atten) {
+		double scale = pow(10, -atof(atten) / 20);
+		if (scale > 0 && scale <= 1.0) {
+			u->scale = (float)scale;
+		}
+	}
+
+	LOG_INFO("upsampling taps per phase: %u, scale: %03.2f", u->taps, u->scale);
+
+	return &ret;
+}
+
+#endif // #if PROCESS
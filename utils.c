@@ -114,6 +114,49 @@ u32_t gettime_ms(void) {
 #endif
 }
 
+u64_t gettime_us(void) {
+#if WIN
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (u64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (u64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+#if LINUX || FREEBSD
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+#else
+	if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+#endif
+		return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+// cpu time of the calling thread, elapsed time where this is not available
+u64_t getcputime_us(void) {
+#if WIN
+	FILETIME create, exit, kernel, user;
+	if (GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user)) {
+		u64_t k = (u64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+		u64_t u = (u64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+		return (k + u) / 10;
+	}
+#endif
+#if (LINUX || FREEBSD) && defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+		return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	return gettime_us();
+}
+
 // mac address
 #if LINUX && !defined(SUN)
 // search first 4 interfaces returned by IFCONF
@@ -403,6 +446,18 @@ u16_t unpackn(u16_t *src) {
 	return *(ptr) << 8 | *(ptr+1);
 } 
 
+// modified bessel function of the first kind, order 0 - for kaiser window filter design
+double bessel_i0(double x) {
+	double sum = 1.0, term = 1.0;
+	int k;
+	for (k = 1; k < 50; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12) break;
+	}
+	return sum;
+}
+
 #if OSX
 void set_nosigpipe(sockfd s) {
 	int set = 1;
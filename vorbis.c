@@ -37,7 +37,7 @@ struct vorbis {
 	// vorbis symbols to be dynamically loaded - from either vorbisfile or vorbisidec (tremor) version of library
 	vorbis_info *(* ov_info)(OggVorbis_File *vf, int link);
 	int (* ov_clear)(OggVorbis_File *vf);
-	long (* ov_read)(OggVorbis_File *vf, char *buffer, int length, int bigendianp, int word, int sgned, int *bitstream);
+	long (* ov_read_float)(OggVorbis_File *vf, float ***pcm_channels, int samples, int *bitstream);
 	long (* ov_read_tremor)(OggVorbis_File *vf, char *buffer, int length, int *bitstream);
 	int (* ov_open_callbacks)(void *datasource, OggVorbis_File *vf, const char *initial, long ibytes, ov_callbacks callbacks);
 #endif
@@ -83,17 +83,20 @@ extern int ov_read_tremor(); // needed to enable compilation, not linked
 #define TREMOR(h)      (h)->ov_read_tremor
 #endif
 
-// called with mutex locked within vorbis_decode to avoid locking O before S
-static size_t _read_cb(void *ptr, size_t size, size_t nmemb, void *datasource) {
-	size_t bytes;
-
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	bytes = min(bytes, size * nmemb);
-
-	memcpy(ptr, streambuf->readp, bytes);
-	_buf_inc_readp(streambuf, bytes);
+// vorbis channel order to the wav order used by the downmix matrix, indexed by channel count
+static const u8_t order[MAX_CHANNELS + 1][MAX_CHANNELS] = {
+	{ 0 }, { 0 }, { 0, 1 },
+	{ 0, 2, 1 },
+	{ 0, 1, 2, 3 },
+	{ 0, 2, 1, 3, 4 },
+	{ 0, 2, 1, 5, 3, 4 },
+	{ 0, 2, 1, 6, 5, 3, 4 },
+	{ 0, 2, 1, 7, 5, 6, 3, 4 },
+};
 
-	return bytes / size;
+// called with S locked
+static size_t _read_cb(void *ptr, size_t size, size_t nmemb, void *datasource) {
+	return _buf_read_copy(streambuf, ptr, size * nmemb) / size;
 }
 
 // these are needed for older versions of tremor, later versions and libvorbis allow NULL to be used
@@ -151,7 +154,7 @@ static decode_state vorbis_decode(void) {
 		LOG_INFO("setting track_start");
 		LOCK_O_not_direct;
 		output.next_sample_rate = decode_newstream(info->rate, output.supported_rates); 
-		IF_DSD(	output.next_dop = false; )
+		IF_DSD(	output.next_dop = false; output.next_dsd = false; )
 		output.track_start = outputbuf->writep;
 		if (output.fade_mode) _checkfade(true);
 		decode.new_stream = false;
@@ -163,7 +166,7 @@ static decode_state vorbis_decode(void) {
 
 		channels = info->channels;
 
-		if (channels > 2) {
+		if (channels > (TREMOR(v) ? 2 : MAX_CHANNELS)) {
 			LOG_WARN("too many channels: %d", channels);
 			UNLOCK_O_direct;
 			UNLOCK_S;
@@ -171,8 +174,6 @@ static decode_state vorbis_decode(void) {
 		}
 	}
 
-	bytes = frames * 2 * channels; // samples returned are 16 bits
-
 	IF_DIRECT(
 		write_buf = outputbuf->writep;
 	);
@@ -180,40 +181,60 @@ static decode_state vorbis_decode(void) {
 		write_buf = process.inbuf;
 	);
 
-	// write the decoded frames into outputbuf even though they are 16 bits per sample, then unpack them
 	if (!TREMOR(v)) {
-#if SL_LITTLE_ENDIAN
-		n = OV(v, read, v->vf, (char *)write_buf, bytes, 0, 2, 1, &s);
-#else
-		n = OV(v, read, v->vf, (char *)write_buf, bytes, 1, 2, 1, &s);
-#endif
+
+		// libvorbis decodes to float, convert at full precision directly into outputbuf
+		float **pcm;
+
+		n = OV(v, read_float, v->vf, &pcm, frames, &s);
+
+		if (n > 0) {
+			const float *iptr[MAX_CHANNELS];
+			int c;
+
+			for (c = 0; c < channels; ++c) {
+				iptr[c] = pcm[order[channels][c]];
+			}
+
+			frames = n;
+			convert_fltp((s32_t *)write_buf, iptr, channels, frames);
+		}
+
 	} else {
+
+		// tremor is fixed point and only returns 16 bit samples
+		// write the decoded frames into outputbuf even though they are 16 bits per sample, then unpack them
+		bytes = frames * 2 * channels;
+
 		n = OV(v, read_tremor, v->vf, (char *)write_buf, bytes, &s);
-	}
 
-	if (n > 0) {
+		if (n > 0) {
 
-		frames_t count;
-		s16_t *iptr;
-		s32_t *optr;
+			frames_t count;
+			s16_t *iptr;
+			s32_t *optr;
 
-		frames = n / 2 / channels;
-		count = frames * channels;
+			frames = n / 2 / channels;
+			count = frames * channels;
 
-		// work backward to unpack samples to 4 bytes per sample
-		iptr = (s16_t *)write_buf + count;
-		optr = (s32_t *)write_buf + frames * 2;
+			// work backward to unpack samples to 4 bytes per sample
+			iptr = (s16_t *)write_buf + count;
+			optr = (s32_t *)write_buf + frames * 2;
 
-		if (channels == 2) {
-			while (count--) {
-				*--optr = *--iptr << 16;
-			}
-		} else if (channels == 1) {
-			while (count--) {
-				*--optr = *--iptr << 16;
-				*--optr = *iptr   << 16;
+			if (channels == 2) {
+				while (count--) {
+					*--optr = *--iptr << 16;
+				}
+			} else if (channels == 1) {
+				while (count--) {
+					*--optr = *--iptr << 16;
+					*--optr = *iptr   << 16;
+				}
 			}
 		}
+	}
+
+	if (n > 0) {
 
 		IF_DIRECT(
 			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
@@ -287,7 +308,7 @@ static bool load_vorbis() {
 		}
 	}
 
-	v->ov_read = tremor ? NULL : dlsym(handle, "ov_read");
+	v->ov_read_float = tremor ? NULL : dlsym(handle, "ov_read_float");
 	v->ov_read_tremor = tremor ? dlsym(handle, "ov_read") : NULL;
 	v->ov_info = dlsym(handle, "ov_info");
 	v->ov_clear = dlsym(handle, "ov_clear");